@@ -0,0 +1,200 @@
+/*
+ * adnsbench.c
+ * - throughput and latency benchmark driver, not part of the library
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006  Ian Jackson
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Keeps concurrency queries outstanding against benchresponder until
+ * count have completed, and prints one line of JSON with the rate,
+ * the CPU time used per query and latency percentiles.  Queries that
+ * fail (eg, timing out when the responder drops) are counted in the
+ * latencies but not in "ok". */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "config.h"
+#include "adns.h"
+
+#define MAXFDS 32
+
+static const char *progname;
+
+static void sysfail(const char *what, int err) {
+  fprintf(stderr,"%s: %s: %s\n",progname,what,strerror(err));
+  exit(2);
+}
+
+static void usage(void) {
+  fprintf(stderr,"usage: %s [-a addr] [-t a|ptr|mx|txt] [-c concurrency]"
+	  " [-n count] [-z zonesize]\n",progname);
+  exit(1);
+}
+
+static long usecs(const struct timeval *tv) {
+  return tv->tv_sec*1000000L + tv->tv_usec;
+}
+
+static int cmplong(const void *a, const void *b) {
+  long la= *(const long*)a, lb= *(const long*)b;
+  return la<lb ? -1 : la>lb;
+}
+
+static long percentile(const long *sorted, long n, int permille) {
+  return n ? sorted[(n-1)*permille/1000] : 0;
+}
+
+static void submit(adns_state ads, const char *type, long i,
+		   unsigned long n) {
+  struct sockaddr_in sin;
+  adns_query qu;
+  char name[32];
+  int r;
+
+  if (!strcmp(type,"ptr")) {
+    memset(&sin,0,sizeof(sin));
+    sin.sin_family= AF_INET;
+    sin.sin_addr.s_addr= htonl(0x0a000000UL | n);
+    r= adns_submit_reverse(ads,(struct sockaddr*)&sin,adns_r_ptr,
+			   0,(void*)i,&qu);
+  } else {
+    sprintf(name,"h%lu.bench",n);
+    r= adns_submit(ads,name,
+		   !strcmp(type,"a") ? adns_r_a :
+		   !strcmp(type,"mx") ? adns_r_mx : adns_r_txt,
+		   0,(void*)i,&qu);
+  }
+  if (r) sysfail("adns_submit",r);
+}
+
+int main(int argc, char **argv) {
+  const char *addr= "127.0.0.1", *type= "a";
+  long count= 10000, conc= 16, submitted, completed, ok, i;
+  unsigned long zonesize= 1000;
+  struct timeval start, end, now, *started;
+  struct rusage ru0, ru1;
+  struct pollfd pfds[MAXFDS];
+  adns_state ads;
+  adns_query qu;
+  adns_answer *ans;
+  void *ctx;
+  char config[100];
+  long *lat;
+  double secs, cpu;
+  int c, r, nfds, timeout, reaped;
+
+  progname= strrchr(*argv,'/'); if (progname) progname++; else progname= *argv;
+
+  while ((c= getopt(argc,argv,"a:t:c:n:z:")) != -1) {
+    switch (c) {
+    case 'a': addr= optarg; break;
+    case 't': type= optarg; break;
+    case 'c': conc= atol(optarg); break;
+    case 'n': count= atol(optarg); break;
+    case 'z': zonesize= strtoul(optarg,0,10); break;
+    default: usage();
+    }
+  }
+  if (optind != argc || conc < 1 || count < 1 || !zonesize ||
+      (strcmp(type,"a") && strcmp(type,"ptr") &&
+       strcmp(type,"mx") && strcmp(type,"txt")))
+    usage();
+
+  started= malloc(sizeof(*started)*count);
+  lat= malloc(sizeof(*lat)*count);
+  if (!started || !lat) sysfail("malloc",errno);
+
+  snprintf(config,sizeof(config),"nameserver %s\n",addr);
+  r= adns_init_strcfg(&ads,adns_if_noenv|adns_if_noerrprint,0,config);
+  if (r) sysfail("adns_init",r);
+
+  if (gettimeofday(&start,0)) sysfail("gettimeofday",errno);
+  if (getrusage(RUSAGE_SELF,&ru0)) sysfail("getrusage",errno);
+
+  submitted= completed= ok= 0;
+  while (completed < count) {
+    if (gettimeofday(&now,0)) sysfail("gettimeofday",errno);
+    while (submitted < count && submitted-completed < conc) {
+      started[submitted]= now;
+      submit(ads,type,submitted,
+	     (unsigned long)submitted*2654435761UL % zonesize);
+      submitted++;
+    }
+
+    /* adns_submit and adns_afterpoll may both complete queries, and
+     * adns_beforepoll does not count those as work to do. */
+    for (reaped=0; ; reaped++) {
+      qu= 0;
+      r= adns_check(ads,&qu,&ans,&ctx);
+      if (r == EAGAIN || r == ESRCH) break;
+      if (r) sysfail("adns_check",r);
+      i= (long)ctx;
+      if (gettimeofday(&now,0)) sysfail("gettimeofday",errno);
+      lat[completed++]= usecs(&now) - usecs(&started[i]);
+      if (ans->status == adns_s_ok) ok++;
+      free(ans);
+    }
+    if (reaped) continue;
+
+    nfds= MAXFDS; timeout= -1;
+    r= adns_beforepoll(ads,pfds,&nfds,&timeout,&now);
+    if (r) sysfail("adns_beforepoll",r);
+    if (poll(pfds,nfds,timeout) < 0 && errno != EINTR)
+      sysfail("poll",errno);
+    if (gettimeofday(&now,0)) sysfail("gettimeofday",errno);
+    adns_afterpoll(ads,pfds,nfds,&now);
+  }
+
+  if (gettimeofday(&end,0)) sysfail("gettimeofday",errno);
+  if (getrusage(RUSAGE_SELF,&ru1)) sysfail("getrusage",errno);
+  adns_finish(ads);
+
+  secs= (usecs(&end) - usecs(&start)) / 1e6;
+  cpu= (usecs(&ru1.ru_utime) - usecs(&ru0.ru_utime) +
+	usecs(&ru1.ru_stime) - usecs(&ru0.ru_stime));
+  qsort(lat,count,sizeof(*lat),cmplong);
+
+  printf("{\"type\":\"%s\",\"concurrency\":%ld,\"queries\":%ld,"
+	 "\"ok\":%ld,\"seconds\":%.3f,\"qps\":%.0f,"
+	 "\"cpu_us_per_query\":%.2f,"
+	 "\"p50_us\":%ld,\"p99_us\":%ld,\"p999_us\":%ld}\n",
+	 type,conc,count,ok,secs,secs>0 ? count/secs : 0.0,
+	 cpu/count,
+	 percentile(lat,count,500),percentile(lat,count,990),
+	 percentile(lat,count,999));
+  if (fflush(stdout) || ferror(stdout)) sysfail("stdout",errno);
+
+  free(started);
+  free(lat);
+  return 0;
+}
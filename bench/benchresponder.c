@@ -0,0 +1,375 @@
+/*
+ * benchresponder.c
+ * - loopback authoritative DNS responder for adnsbench
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006  Ian Jackson
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Serves a synthetic zone over UDP and TCP on port 53 of a loopback
+ * address, so binding needs root or CAP_NET_BIND_SERVICE.  The zone
+ * has zonesize names h<N>.bench, each with A, MX and TXT records,
+ * and a PTR for each address 10.<N>.
+ *
+ *   h<N>.bench A    10+i.N>>16.N>>8.N for i < size (at most 32)
+ *   h<N>.bench MX   10 h<N>.bench
+ *   h<N>.bench TXT  size bytes of text
+ *   c.b.a.10.in-addr.arpa PTR h<N>.bench, N = a<<16|b<<8|c
+ *
+ * Other types get an empty answer and names outside the zone
+ * NXDOMAIN.  UDP replies can be delayed, dropped or truncated (forcing
+ * a retry over TCP); TCP replies are sent at once. */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define MAXTCP 64
+#define MAXMSG 65535
+#define MAXUDP 512
+
+typedef unsigned char byte;
+
+struct delayed {
+  struct delayed *next;
+  struct timeval due;
+  struct sockaddr_in addr;
+  int len;
+  byte msg[MAXUDP];
+};
+
+struct tcpclient {
+  int fd, got;
+  byte buf[2+MAXMSG];
+};
+
+static const char *progname;
+static unsigned long zonesize= 1000;
+static int latencyms, losspct, truncpct, ansz= 1;
+static struct delayed *delayhead, *delaytail;
+static struct tcpclient tcpclients[MAXTCP];
+
+static void sysfail(const char *what) {
+  fprintf(stderr,"%s: %s: %s\n",progname,what,strerror(errno));
+  exit(2);
+}
+
+static void usage(void) {
+  fprintf(stderr,"usage: %s [-a addr] [-z zonesize] [-l latencyms]"
+	  " [-L losspct] [-T truncpct] [-s answersize] [-S seed]\n",
+	  progname);
+  exit(1);
+}
+
+static void nonblock(int fd) {
+  int r;
+
+  r= fcntl(fd,F_GETFL); if (r<0) sysfail("fcntl F_GETFL");
+  if (fcntl(fd,F_SETFL,r|O_NONBLOCK)) sysfail("fcntl F_SETFL");
+}
+
+static int chance(int pct) {
+  return pct && (rand() % 100) < pct;
+}
+
+static int lookup(const char *name, unsigned long *n_r, int *isptr_r) {
+  /* Returns 1 and sets *n_r if name is in the zone. */
+  unsigned long n;
+  unsigned a, b, c;
+  char tail[32];
+  int l;
+
+  if (sscanf(name,"h%lu.bench%n",&n,&l) == 1 && !name[l]) {
+    *isptr_r= 0;
+  } else if (sscanf(name,"%u.%u.%u.10.%31s",&c,&b,&a,tail) == 4 &&
+	     !strcmp(tail,"in-addr.arpa") && a<256 && b<256 && c<256) {
+    n= (a<<16)|(b<<8)|c;
+    *isptr_r= 1;
+  } else {
+    return 0;
+  }
+  if (n >= zonesize) return 0;
+  *n_r= n;
+  return 1;
+}
+
+static byte *addrr(byte *p, int type, int rdlen) {
+  /* Owner is always the question name, by compression. */
+  *p++= 0xc0; *p++= 12;
+  *p++= type>>8; *p++= type;
+  *p++= 0; *p++= 1;
+  *p++= 0; *p++= 0; *p++= 0x0e; *p++= 0x10;
+  *p++= rdlen>>8; *p++= rdlen;
+  return p;
+}
+
+static int mkreply(const byte *q, int ql, byte *r, int tcp) {
+  /* Returns the length of the reply in r, or -1 to ignore q. */
+  char name[256];
+  const byte *qp;
+  byte *p;
+  int nl, l, i, qtype, nans, rcode, isptr, left;
+  unsigned long n;
+  char hname[32];
+
+  if (ql < 12 || (q[2] & 0x80) || q[4] || q[5] != 1) return -1;
+  qp= q+12; nl= 0;
+  for (;;) {
+    if (qp >= q+ql) return -1;
+    l= *qp++;
+    if (!l) break;
+    if (l > 63 || qp+l > q+ql || nl+l+1 >= (int)sizeof(name)) return -1;
+    if (nl) name[nl++]= '.';
+    for (i=0; i<l; i++) {
+      name[nl++]= (qp[i] >= 'A' && qp[i] <= 'Z') ? qp[i]+32 : qp[i];
+    }
+    qp += l;
+  }
+  name[nl]= 0;
+  if (qp+4 > q+ql) return -1;
+  qtype= (qp[0]<<8)|qp[1];
+  qp += 4;
+
+  memcpy(r,q,qp-q);
+  r[2]= 0x84 | (q[2] & 0x01); /* QR, AA, copy RD */
+  r[3]= 0x80; /* RA */
+  r[6]= r[7]= r[8]= r[9]= r[10]= r[11]= 0;
+  p= r+(qp-q);
+
+  if (!tcp && chance(truncpct)) { r[2] |= 0x02; return p-r; }
+
+  nans= 0; rcode= 0;
+  if (!lookup(name,&n,&isptr)) {
+    rcode= 3;
+  } else if (isptr) {
+    if (qtype == 12) {
+      sprintf(hname,"h%lu",n);
+      l= strlen(hname);
+      p= addrr(p,12,1+l+1+5+1);
+      *p++= l; memcpy(p,hname,l); p += l;
+      *p++= 5; memcpy(p,"bench",5); p += 5;
+      *p++= 0;
+      nans= 1;
+    }
+  } else if (qtype == 1) {
+    for (i=0; i<ansz && i<32; i++) {
+      p= addrr(p,1,4);
+      *p++= 10+i; *p++= n>>16; *p++= n>>8; *p++= n;
+      nans++;
+    }
+  } else if (qtype == 15) {
+    p= addrr(p,15,4);
+    *p++= 0; *p++= 10; *p++= 0xc0; *p++= 12;
+    nans= 1;
+  } else if (qtype == 16) {
+    left= ansz < 1 ? 1 : ansz > 16384 ? 16384 : ansz;
+    p= addrr(p,16,left + (left+254)/255);
+    while (left) {
+      l= left > 255 ? 255 : left;
+      *p++= l; memset(p,'x',l); p += l;
+      left -= l;
+    }
+    nans= 1;
+  }
+
+  if (!tcp && p-r > MAXUDP) { r[2] |= 0x02; return qp-q; }
+  r[3] |= rcode;
+  r[6]= nans>>8; r[7]= nans;
+  return p-r;
+}
+
+static void udp_reply(int fd, const byte *msg, int len,
+		      const struct sockaddr_in *addr) {
+  if (sendto(fd,msg,len,0,(const struct sockaddr*)addr,sizeof(*addr)) < 0 &&
+      errno != EAGAIN && errno != ENOBUFS && errno != ECONNREFUSED)
+    sysfail("sendto");
+}
+
+static void udp_readable(int fd) {
+  static byte q[MAXMSG], r[MAXMSG];
+  struct sockaddr_in addr;
+  socklen_t al;
+  struct delayed *d;
+  int ql, rl;
+
+  for (;;) {
+    al= sizeof(addr);
+    ql= recvfrom(fd,q,sizeof(q),0,(struct sockaddr*)&addr,&al);
+    if (ql<0) {
+      if (errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED) return;
+      sysfail("recvfrom");
+    }
+    if (chance(losspct)) continue;
+    rl= mkreply(q,ql,r,0);
+    if (rl<0) continue;
+    if (!latencyms) { udp_reply(fd,r,rl,&addr); continue; }
+    d= malloc(sizeof(*d)); if (!d) sysfail("malloc");
+    if (gettimeofday(&d->due,0)) sysfail("gettimeofday");
+    d->due.tv_usec += latencyms*1000L;
+    d->due.tv_sec += d->due.tv_usec / 1000000;
+    d->due.tv_usec %= 1000000;
+    d->addr= addr;
+    d->len= rl;
+    memcpy(d->msg,r,rl);
+    d->next= 0;
+    if (delaytail) delaytail->next= d; else delayhead= d;
+    delaytail= d;
+  }
+}
+
+static int udp_flush(int fd) {
+  /* Sends the delayed replies that are due; returns the poll timeout. */
+  struct timeval now;
+  struct delayed *d;
+  long ms;
+
+  if (!delayhead) return -1;
+  if (gettimeofday(&now,0)) sysfail("gettimeofday");
+  while ((d= delayhead) && !timercmp(&now,&d->due,<)) {
+    udp_reply(fd,d->msg,d->len,&d->addr);
+    delayhead= d->next;
+    if (!delayhead) delaytail= 0;
+    free(d);
+  }
+  if (!delayhead) return -1;
+  ms= (d->due.tv_sec - now.tv_sec)*1000 + (d->due.tv_usec - now.tv_usec)/1000;
+  return ms > 0 ? ms : 1;
+}
+
+static void tcp_close(struct tcpclient *tc) {
+  close(tc->fd);
+  tc->fd= -1;
+}
+
+static void tcp_readable(struct tcpclient *tc) {
+  static byte r[2+MAXMSG];
+  int l, ml, rl, done;
+
+  l= read(tc->fd,tc->buf+tc->got,sizeof(tc->buf)-tc->got);
+  if (l<0 && (errno == EAGAIN || errno == EINTR)) return;
+  if (l<=0) { tcp_close(tc); return; }
+  tc->got += l;
+
+  while (tc->got >= 2) {
+    ml= (tc->buf[0]<<8)|tc->buf[1];
+    if (tc->got < 2+ml) return;
+    rl= mkreply(tc->buf+2,ml,r+2,1);
+    if (rl>=0) {
+      r[0]= rl>>8; r[1]= rl;
+      /* Replies are small next to the socket buffer, so a short
+       * write means the client is not reading; give up on it. */
+      for (done=0; done<2+rl; done += l) {
+	l= write(tc->fd,r+done,2+rl-done);
+	if (l<=0) { tcp_close(tc); return; }
+      }
+    }
+    memmove(tc->buf,tc->buf+2+ml,tc->got-2-ml);
+    tc->got -= 2+ml;
+  }
+}
+
+static void tcp_accept(int lfd) {
+  int fd, i;
+
+  fd= accept(lfd,0,0);
+  if (fd<0) {
+    if (errno == EAGAIN || errno == EINTR) return;
+    sysfail("accept");
+  }
+  for (i=0; i<MAXTCP && tcpclients[i].fd >= 0; i++);
+  if (i == MAXTCP) { close(fd); return; }
+  tcpclients[i].fd= fd;
+  tcpclients[i].got= 0;
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in addr;
+  struct pollfd pfds[2+MAXTCP];
+  int udpfd, tcpfd, c, i, np, timeout, on;
+
+  progname= strrchr(*argv,'/'); if (progname) progname++; else progname= *argv;
+
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family= AF_INET;
+  addr.sin_port= htons(53);
+  addr.sin_addr.s_addr= htonl(INADDR_LOOPBACK);
+
+  while ((c= getopt(argc,argv,"a:z:l:L:T:s:S:")) != -1) {
+    switch (c) {
+    case 'a': if (!inet_aton(optarg,&addr.sin_addr)) usage(); break;
+    case 'z': zonesize= strtoul(optarg,0,10); break;
+    case 'l': latencyms= atoi(optarg); break;
+    case 'L': losspct= atoi(optarg); break;
+    case 'T': truncpct= atoi(optarg); break;
+    case 's': ansz= atoi(optarg); break;
+    case 'S': srand(atoi(optarg)); break;
+    default: usage();
+    }
+  }
+  if (optind != argc || zonesize > 1UL<<24) usage();
+
+  signal(SIGPIPE,SIG_IGN);
+  on= 1;
+
+  udpfd= socket(AF_INET,SOCK_DGRAM,0); if (udpfd<0) sysfail("socket");
+  if (bind(udpfd,(struct sockaddr*)&addr,sizeof(addr))) sysfail("bind udp");
+  nonblock(udpfd);
+
+  tcpfd= socket(AF_INET,SOCK_STREAM,0); if (tcpfd<0) sysfail("socket");
+  if (setsockopt(tcpfd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on)))
+    sysfail("setsockopt");
+  if (bind(tcpfd,(struct sockaddr*)&addr,sizeof(addr))) sysfail("bind tcp");
+  if (listen(tcpfd,16)) sysfail("listen");
+  nonblock(tcpfd);
+
+  for (i=0; i<MAXTCP; i++) tcpclients[i].fd= -1;
+
+  for (;;) {
+    timeout= udp_flush(udpfd);
+    pfds[0].fd= udpfd; pfds[0].events= POLLIN;
+    pfds[1].fd= tcpfd; pfds[1].events= POLLIN;
+    np= 2;
+    for (i=0; i<MAXTCP; i++) {
+      pfds[np].fd= tcpclients[i].fd; /* poll ignores -1 */
+      pfds[np].events= POLLIN;
+      np++;
+    }
+    if (poll(pfds,np,timeout) < 0) {
+      if (errno == EINTR) continue;
+      sysfail("poll");
+    }
+    if (pfds[0].revents) udp_readable(udpfd);
+    if (pfds[1].revents) tcp_accept(tcpfd);
+    for (i=0; i<MAXTCP; i++)
+      if (pfds[2+i].revents && tcpclients[i].fd >= 0)
+	tcp_readable(&tcpclients[i]);
+  }
+}
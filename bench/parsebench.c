@@ -0,0 +1,390 @@
+/*
+ * parsebench.c
+ * - reply parser microbenchmark, not part of the library
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006  Ian Jackson
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Feeds reply datagrams straight to adns__procdgram, so this is built
+ * from the library sources rather than linked against libadns.  The
+ * corpus is the UDP replies recorded in the regress case-*.sys files
+ * named on the command line, plus some made-up replies: NS and SRV
+ * with big additional sections, a CNAME chain, heavily compressed
+ * names and a truncated reply.
+ *
+ * For each reply a matching query is submitted (with the adns type
+ * for the reply's QTYPE; the +addr variants for NS, MX and SRV) and
+ * its ID patched into the reply; only the adns__procdgram call is
+ * timed.  Any UDP or TCP sends it triggers (retries, address
+ * lookups, TCP after truncation) go to 127.0.0.1 and are included.
+ * Prints one JSON line per RR type with nanoseconds and allocations
+ * per reply. */
+
+#include <time.h>
+#include <stdio.h>
+
+#include "internal.h"
+
+#define MAXENTRIES 4096
+#define MAXTYPES 32
+
+typedef struct {
+  byte *dgram;
+  int len;
+  adns_rrtype type;
+  char owner[DNS_MAXDOMAIN+1];
+} entry;
+
+typedef struct {
+  adns_rrtype type;
+  long replies;
+  double ns, allocs;
+} typetotal;
+
+static const char *progname;
+static entry entries[MAXENTRIES];
+static int nentries, nskipped;
+static typetotal totals[MAXTYPES];
+static int ntotals;
+static long nallocs;
+
+static void sysfail(const char *what, int err) {
+  fprintf(stderr,"%s: %s: %s\n",progname,what,strerror(err));
+  exit(2);
+}
+
+static void *count_malloc(void *ctx, size_t sz) {
+  nallocs++;
+  return malloc(sz);
+}
+
+static void *count_realloc(void *ctx, void *p, size_t sz) {
+  nallocs++;
+  return realloc(p,sz);
+}
+
+static void count_free(void *ctx, void *p) {
+  free(p);
+}
+
+static const adns_allocator counting= {
+  count_malloc, count_realloc, count_free, 0
+};
+
+static double nsecs(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC,&ts)) sysfail("clock_gettime",errno);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static adns_rrtype wiretype(int qtype) {
+  switch (qtype) {
+  case 1:  return adns_r_a;
+  case 2:  return adns_r_ns;
+  case 5:  return adns_r_cname;
+  case 6:  return adns_r_soa;
+  case 12: return adns_r_ptr_raw;
+  case 13: return adns_r_hinfo;
+  case 15: return adns_r_mx;
+  case 16: return adns_r_txt;
+  case 17: return adns_r_rp;
+  case 28: return adns_r_aaaa;
+  case 33: return adns_r_srv;
+  default: return adns_r_none;
+  }
+}
+
+static void add_entry(const byte *dgram, int len) {
+  /* Takes the owner and type from the reply's question; skips
+   * replies we could not have asked for through adns_submit. */
+  entry *e;
+  int cb, l, ol, i, qtype;
+
+  if (nentries == MAXENTRIES || len < DNS_HDRSIZE+5 ||
+      dgram[4] || dgram[5] != 1) goto x_skip;
+
+  e= &entries[nentries];
+  cb= DNS_HDRSIZE; ol= 0;
+  while ((l= dgram[cb++])) {
+    if (l > DNS_MAXLABEL || cb+l+4 >= len || ol+l+1 > DNS_MAXDOMAIN)
+      goto x_skip;
+    if (ol) e->owner[ol++]= '.';
+    for (i=0; i<l; i++) {
+      if (!ctype_domainunquoted(dgram[cb+i])) goto x_skip;
+      e->owner[ol++]= dgram[cb+i];
+    }
+    cb += l;
+  }
+  if (!ol) goto x_skip;
+  e->owner[ol]= 0;
+  qtype= (dgram[cb]<<8) | dgram[cb+1];
+  e->type= wiretype(qtype);
+  if (!e->type) goto x_skip;
+
+  e->dgram= malloc(len); if (!e->dgram) sysfail("malloc",errno);
+  memcpy(e->dgram,dgram,len);
+  e->len= len;
+  nentries++;
+  return;
+
+ x_skip:
+  nskipped++;
+}
+
+/* Reading replies from the regress harness's .sys format. */
+
+static int hexval(int c) {
+  if (c >= '0' && c <= '9') return c-'0';
+  if (c >= 'a' && c <= 'f') return c-'a'+10;
+  return -1;
+}
+
+static void read_sysfile(const char *fn) {
+  FILE *f;
+  char line[256];
+  byte buf[DNS_MAXUDP*2];
+  const char *p;
+  int len, inreply, h, l;
+
+  f= fopen(fn,"r"); if (!f) sysfail(fn,errno);
+  inreply= 0; len= 0;
+  while (fgets(line,sizeof(line),f)) {
+    if (!strncmp(line," recvfrom=OK ",13)) { inreply= 1; len= 0; continue; }
+    if (!inreply) continue;
+    if (strncmp(line,"     ",5)) { inreply= 0; continue; }
+    for (p= line+5; *p; p++) {
+      if (*p == '.') { add_entry(buf,len); inreply= 0; break; }
+      h= hexval(*p); if (h<0) continue;
+      l= hexval(p[1]); if (l<0 || len == sizeof(buf)) { inreply= 0; break; }
+      buf[len++]= (h<<4)|l;
+      p++;
+    }
+  }
+  if (ferror(f)) sysfail(fn,errno);
+  fclose(f);
+}
+
+/* Made-up replies. */
+
+static byte *put_w(byte *p, int v) { *p++= v>>8; *p++= v; return p; }
+
+static byte *put_name(byte *p, const char *name) {
+  const char *dot;
+  int l;
+
+  while (*name) {
+    dot= strchr(name,'.');
+    l= dot ? dot-name : strlen(name);
+    *p++= l; memcpy(p,name,l); p += l;
+    name += l; if (*name) name++;
+  }
+  *p++= 0;
+  return p;
+}
+
+static byte *put_ptr(byte *p, int offset) {
+  return put_w(p,0xc000|offset);
+}
+
+static byte *put_rrhead(byte *p, int type, int rdlen) {
+  p= put_w(p,type); p= put_w(p,1);
+  p= put_w(p,0); p= put_w(p,3600);
+  return put_w(p,rdlen);
+}
+
+static byte *put_header(byte *p, int flags, int an, int ns, int ar,
+			const char *owner, int qtype) {
+  p= put_w(p,0); p= put_w(p,flags);
+  p= put_w(p,1); p= put_w(p,an); p= put_w(p,ns); p= put_w(p,ar);
+  p= put_name(p,owner);
+  p= put_w(p,qtype);
+  return put_w(p,1);
+}
+
+static byte *put_a(byte *p, int owneroffset, int n) {
+  p= put_ptr(p,owneroffset);
+  p= put_rrhead(p,1,4);
+  *p++= 192; *p++= 0; *p++= 2; *p++= n;
+  return p;
+}
+
+static void synth_entries(void) {
+  byte buf[8192], *p, *rd;
+  int offsets[32], i, n;
+  char name[32];
+
+  /* NS+addr: 13 servers with glue, each name compressed against the
+   * zone in the question. */
+  p= put_header(buf,0x8580,13,0,13,"example.com",2);
+  for (i=0; i<13; i++) {
+    p= put_ptr(p,DNS_HDRSIZE);
+    p= put_rrhead(p,2,4);
+    offsets[i]= p-buf;
+    *p++= 1; *p++= 'a'+i; p= put_ptr(p,DNS_HDRSIZE);
+  }
+  for (i=0; i<13; i++) p= put_a(p,offsets[i],i+1);
+  add_entry(buf,p-buf);
+
+  /* SRV+addr: 32 targets with their addresses. */
+  p= put_header(buf,0x8580,32,0,32,"_sip._udp.example.com",33);
+  for (i=0; i<32; i++) {
+    p= put_ptr(p,DNS_HDRSIZE);
+    p= put_rrhead(p,33,6+6);
+    p= put_w(p,i%4); p= put_w(p,10); p= put_w(p,5060);
+    offsets[i]= p-buf;
+    sprintf(name,"s%02d",i);
+    *p++= 3; memcpy(p,name,3); p += 3;
+    p= put_ptr(p,DNS_HDRSIZE+10); /* example.com */
+  }
+  for (i=0; i<32; i++) p= put_a(p,offsets[i],i+1);
+  add_entry(buf,p-buf);
+
+  /* MX+addr where every name is a chain of compression pointers. */
+  p= put_header(buf,0x8580,8,0,8,"mail.example.com",15);
+  n= DNS_HDRSIZE;
+  for (i=0; i<8; i++) {
+    p= put_ptr(p,DNS_HDRSIZE);
+    rd= p; p= put_rrhead(p,15,0);
+    p= put_w(p,i*10);
+    offsets[i]= p-buf;
+    *p++= 1; *p++= 'a'+i; p= put_ptr(p,n);
+    put_w(rd+8,p-rd-10);
+    n= offsets[i];
+  }
+  for (i=0; i<8; i++) p= put_a(p,offsets[i],i+1);
+  add_entry(buf,p-buf);
+
+  /* A via a CNAME, then a CNAME chain, which adns refuses. */
+  p= put_header(buf,0x8580,2,0,0,"www.example.com",1);
+  p= put_ptr(p,DNS_HDRSIZE);
+  p= put_rrhead(p,5,6);
+  offsets[0]= p-buf;
+  *p++= 3; memcpy(p,"web",3); p += 3; p= put_ptr(p,DNS_HDRSIZE+4);
+  p= put_a(p,offsets[0],1);
+  add_entry(buf,p-buf);
+
+  p= put_header(buf,0x8580,4,0,0,"www.example.com",1);
+  n= DNS_HDRSIZE;
+  for (i=0; i<3; i++) {
+    p= put_ptr(p,n);
+    p= put_rrhead(p,5,4);
+    n= p-buf;
+    *p++= 1; *p++= 'x'+i; p= put_ptr(p,DNS_HDRSIZE+4);
+  }
+  p= put_a(p,n,1);
+  add_entry(buf,p-buf);
+
+  /* Truncated: just the question, with TC set. */
+  p= put_header(buf,0x8780,0,0,0,"big.example.com",16);
+  add_entry(buf,p-buf);
+}
+
+static void account(adns_rrtype type, double ns, long allocs) {
+  int i;
+
+  for (i=0; i<ntotals && totals[i].type != type; i++);
+  if (i == ntotals) {
+    if (ntotals == MAXTYPES) return;
+    totals[ntotals++].type= type;
+  }
+  totals[i].replies++;
+  totals[i].ns += ns;
+  totals[i].allocs += allocs;
+}
+
+static void run_entry(adns_state ads, entry *e, int iterations) {
+  struct timeval now;
+  adns_query qu;
+  adns_answer *ans;
+  void *ctx;
+  double t0, t1;
+  int i, r;
+
+  for (i=0; i<iterations; i++) {
+    r= adns_submit(ads,e->owner,e->type,0,0,&qu);
+    if (r) sysfail("adns_submit",r);
+    if (qu->state != query_tosend || qu->id < 0) {
+      /* Answered locally or failed at once; nothing to parse. */
+      adns_cancel(qu);
+      return;
+    }
+    e->dgram[0]= qu->id>>8; e->dgram[1]= qu->id;
+    if (gettimeofday(&now,0)) sysfail("gettimeofday",errno);
+
+    nallocs= 0;
+    t0= nsecs();
+    adns__procdgram(ads,e->dgram,e->len,qu->udpserver,0,now);
+    t1= nsecs();
+    account(e->type,t1-t0,nallocs);
+
+    r= adns_check(ads,&qu,&ans,&ctx);
+    if (r == EAGAIN) adns_cancel(qu);
+    else if (r) sysfail("adns_check",r);
+    else adns_freeanswer(ads,ans);
+  }
+}
+
+static void usage(void) {
+  fprintf(stderr,"usage: %s [-n iterations] [case-X.sys ...]\n",progname);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *typename;
+  adns_state ads;
+  int iterations= 1000, c, i, r;
+
+  progname= strrchr(*argv,'/'); if (progname) progname++; else progname= *argv;
+
+  while ((c= getopt(argc,argv,"n:")) != -1) {
+    switch (c) {
+    case 'n': iterations= atoi(optarg); break;
+    default: usage();
+    }
+  }
+  if (iterations < 1) usage();
+
+  for (i=optind; i<argc; i++) read_sysfile(argv[i]);
+  synth_entries();
+
+  r= adns_init_alloc(&ads,adns_if_noenv|adns_if_noerrprint|adns_if_noautosys,
+		     "nameserver 127.0.0.1\n",0,0,&counting);
+  if (r) sysfail("adns_init",r);
+
+  for (i=0; i<nentries; i++) run_entry(ads,&entries[i],iterations);
+
+  for (i=0; i<ntotals; i++) {
+    if (adns_rr_info(totals[i].type,&typename,0,0,0,0)) typename= "?";
+    printf("{\"rrtype\":\"%s\",\"deref\":%s,\"replies\":%ld,"
+	   "\"ns_per_reply\":%.0f,\"allocs_per_reply\":%.2f}\n",
+	   typename,
+	   totals[i].type & adns__qtf_deref ? "true" : "false",
+	   totals[i].replies/iterations,
+	   totals[i].ns/totals[i].replies,
+	   totals[i].allocs/totals[i].replies);
+  }
+  fprintf(stderr,"%s: %d replies, %d skipped\n",progname,nentries,nskipped);
+  if (fflush(stdout) || ferror(stdout)) sysfail("stdout",errno);
+
+  adns_finish(ads);
+  for (i=0; i<nentries; i++) free(entries[i].dgram);
+  return 0;
+}
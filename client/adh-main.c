@@ -91,6 +91,7 @@ void of_type(const struct optioninfo *oi, const char *arg, const char *arg2) {
     { adns_r_rp,     "rp"     },
     { adns_r_srv,    "srv"    },
     { adns_r_addr,   "addr"   },
+    { adns_r_addr6,  "addr6"  },
 
     /* types with only one version */
     { adns_r_cname,  "cname"  },
@@ -31,7 +31,7 @@ int ov_env=1, ov_pipe=0, ov_asynch=0, ov_tormode = 0;
 int ov_verbose= 0;
 adns_rrtype ov_type= adns_r_none;
 int ov_search=0, ov_qc_query=0, ov_qc_anshost=0, ov_qc_cname=1;
-int ov_tcp=0, ov_cname=0, ov_format=fmt_default;
+int ov_tcp=0, ov_cname=0, ov_format=fmt_default, ov_dualstack=0;
 char *ov_id= 0;
 struct perqueryflags_remember ov_pqfr = { 1,1,1, tm_none };
 
@@ -93,6 +93,8 @@ static const struct optioninfo perquery_options[]= {
     "Qc", "qc-cname",      &ov_qc_cname, 0 },
   { ot_flag,             "Force use of a virtual circuit",
     "u", "tcp",            &ov_tcp, 1 },
+  { ot_flag,             "Look up IPv6 addresses as well as IPv4",
+    "6", "dual-stack",     &ov_dualstack, 1 },
   { ot_flag,             "Do not display owner name in output",
     "Do", "show-owner",   &ov_pqfr.show_owner, 0 },
   { ot_flag,             "Do not display RR type in output",
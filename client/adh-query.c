@@ -117,6 +117,7 @@ static void prep_query(struct query_node **qun_r, int *quflags_r) {
   *quflags_r=
     (ov_search ? adns_qf_search : 0) |
     (ov_tcp ? adns_qf_usevc : 0) |
+    (ov_dualstack ? adns_qf_dualstack : 0) |
     ((ov_pqfr.show_owner || ov_format == fmt_simple) ? adns_qf_owner : 0) |
     (ov_qc_query ? adns_qf_quoteok_query : 0) |
     (ov_qc_anshost ? adns_qf_quoteok_anshost : 0) |
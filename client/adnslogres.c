@@ -64,6 +64,12 @@
 /* Length of a buffer to hold an expanded IP addr string incl 0.  */
 #define FULLIPBUFLEN 33
 
+/* size of each chunk of line storage; must hold several lines */
+#define LINECHUNK 65536
+
+/* initial number of buckets in the address table */
+#define MEMOBUCKETS 1024
+
 /* option flags */
 #define OPT_DEBUG 1
 #define OPT_POLL 2
@@ -741,38 +747,232 @@ printline(FILE *outf, char *start, char *addr, char *rest, const char *domain,
     aargh("write output");
 }
 
+/* Every distinct address gets one query, shared by all the lines
+ * which mention it: those read while it is pending wait on it, and
+ * those read after it is answered reuse the answer.  Entries which
+ * cannot be keyed (unparseable addresses) are not put in the table
+ * and belong to a single line. */
+typedef struct addrmemo {
+  struct addrmemo *next;
+  adns_query query; /* 0 once answer is set */
+  adns_answer *answer;
+  int keylen; /* 0 => not in the table */
+  unsigned char key[16];
+} addrmemo;
+
+static addrmemo **memotab;
+static unsigned long memobuckets, nmemos;
+
+/* Lines are stored consecutively in chunks, and since they are
+ * written out in the order they were read, a chunk can be reused
+ * as soon as its last line has been written. */
+typedef struct linechunk {
+  struct linechunk *next;
+  size_t used;
+  int live;
+} linechunk;
+
+typedef union { void *p; long l; double d; } arena_align;
+#define ARENA_ROUND(sz) \
+  (((sz) + sizeof(arena_align) - 1) / sizeof(arena_align) * sizeof(arena_align))
+#define CHUNKHDR ARENA_ROUND(sizeof(linechunk))
+
+static linechunk *curchunk, *freechunks;
+
 typedef struct logline {
   struct logline *next;
+  linechunk *chunk;
   char *start, *addr, *rest;
   char fullip[FULLIPBUFLEN];
   int is_v6;
-  adns_query query;
+  addrmemo *memo;
 } logline;
 
+static char *chunk_space(size_t want) {
+  /* Returns room for want bytes at the end of the current chunk,
+   * starting a new chunk if necessary.  Nothing is allocated until
+   * chunk_commit. */
+  linechunk *ch;
+
+  want= ARENA_ROUND(want);
+  assert(CHUNKHDR + want <= LINECHUNK);
+  if (!curchunk || curchunk->used + want > LINECHUNK) {
+    if (curchunk && !curchunk->live) {
+      ch= curchunk;
+    } else if (freechunks) {
+      ch= freechunks; freechunks= ch->next;
+    } else {
+      ch= malloc(LINECHUNK);
+      if (!ch) aargh("malloc");
+    }
+    ch->next= NULL;
+    ch->used= CHUNKHDR;
+    ch->live= 0;
+    curchunk= ch;
+  }
+  return (char*)curchunk + curchunk->used;
+}
+
+static void chunk_commit(size_t used) {
+  curchunk->used += ARENA_ROUND(used);
+  curchunk->live++;
+}
+
+static void chunk_release(linechunk *ch) {
+  assert(ch->live > 0);
+  if (--ch->live) return;
+  if (ch == curchunk) {
+    ch->used= CHUNKHDR;
+  } else {
+    ch->next= freechunks;
+    freechunks= ch;
+  }
+}
+
+static void chunk_freeall(void) {
+  linechunk *ch;
+
+  while ((ch= freechunks)) { freechunks= ch->next; free(ch); }
+  free(curchunk);
+  curchunk= NULL;
+}
+
+static int hexval(int c) {
+  return sensible_ctype(isdigit, c)
+    ? c - '0' : sensible_ctype(tolower, c) - 'a' + 10;
+}
+
+static int memo_key(unsigned char key[16], const char *fullip, int is_v6) {
+  /* Returns the length of the binary address in key, or 0 if fullip
+   * is not an address which maps to exactly one reverse domain. */
+  const char *p;
+  unsigned long v;
+  int i;
+
+  if (is_v6) {
+    for (i=0; i<16; i++) {
+      if (!sensible_ctype(isxdigit, fullip[i*2]) ||
+	  !sensible_ctype(isxdigit, fullip[i*2+1])) return 0;
+      key[i]= hexval(fullip[i*2])<<4 | hexval(fullip[i*2+1]);
+    }
+    return fullip[32] ? 0 : 16;
+  }
+  p= fullip;
+  for (i=0; i<4; i++) {
+    if (!sensible_ctype(isdigit, *p)) return 0;
+    if (*p == '0' && sensible_ctype(isdigit, p[1])) return 0;
+    v= 0;
+    while (sensible_ctype(isdigit, *p)) v= v*10 + (*p++ - '0');
+    if (v > 255 || *p != (i<3 ? '.' : 0)) return 0;
+    if (i<3) p++;
+    key[i]= v;
+  }
+  return 4;
+}
+
+static unsigned long memo_hash(const unsigned char *key, int keylen) {
+  unsigned long h= 2166136261UL;
+
+  while (keylen-- > 0) { h ^= *key++; h= (h * 16777619UL) & 0xffffffffUL; }
+  return h;
+}
+
+static void memo_grow(void) {
+  addrmemo **newtab, *memo, *next;
+  unsigned long newbuckets, i, b;
+
+  newbuckets= memobuckets ? memobuckets*2 : MEMOBUCKETS;
+  newtab= malloc(newbuckets * sizeof(*newtab));
+  if (!newtab) aargh("malloc");
+  for (b=0; b<newbuckets; b++) newtab[b]= NULL;
+  for (i=0; i<memobuckets; i++) {
+    for (memo= memotab[i]; memo; memo= next) {
+      next= memo->next;
+      b= memo_hash(memo->key,memo->keylen) % newbuckets;
+      memo->next= newtab[b]; newtab[b]= memo;
+    }
+  }
+  free(memotab);
+  memotab= newtab;
+  memobuckets= newbuckets;
+}
+
+static addrmemo *memo_find(logline *line, adns_state adns, const char *domain,
+			   int opts) {
+  unsigned char key[16];
+  addrmemo *memo;
+  unsigned long b;
+  int keylen;
+
+  keylen= line->addr ? memo_key(key, line->fullip, line->is_v6) : 0;
+  if (keylen) {
+    b= memo_hash(key,keylen) % memobuckets;
+    for (memo= memotab[b]; memo; memo= memo->next) {
+      if (memo->keylen == keylen && !memcmp(memo->key,key,keylen)) {
+	if (opts & OPT_DEBUG)
+	  msg("reusing %s %.*s", memo->query ? "query for" : "answer for",
+	      (int)(line->rest-line->addr), line->addr);
+	return memo;
+      }
+    }
+  }
+
+  memo= malloc(sizeof(*memo));
+  if (!memo) aargh("malloc");
+  memo->answer= NULL;
+  memo->keylen= keylen;
+  if (opts & OPT_DEBUG)
+    msg("submitting %.*s -> %s", (int)(line->rest-line->addr), guard_null(line->addr), domain);
+  /* Note: ADNS does not yet support "ptr" for IPv6.  */
+  if (adns_submit(adns, domain,
+		  line->is_v6? adns_r_ptr_raw : adns_r_ptr,
+		  adns_qf_quoteok_cname|adns_qf_cname_loose,
+		  NULL, &memo->query))
+    aargh("adns_submit");
+  if (keylen) {
+    if (nmemos >= memobuckets) memo_grow();
+    memcpy(memo->key,key,keylen);
+    b= memo_hash(key,keylen) % memobuckets;
+    memo->next= memotab[b]; memotab[b]= memo;
+    nmemos++;
+  }
+  return memo;
+}
+
+static void memo_freeall(void) {
+  addrmemo *memo, *next;
+  unsigned long i;
+
+  for (i=0; i<memobuckets; i++) {
+    for (memo= memotab[i]; memo; memo= next) {
+      next= memo->next;
+      assert(!memo->query);
+      free(memo->answer);
+      free(memo);
+    }
+  }
+  free(memotab);
+  memotab= NULL; memobuckets= nmemos= 0;
+}
+
 static logline *readline(FILE *inf, adns_state adns, int opts) {
-  static char buf[MAXLINE];
   char *str;
   logline *line;
+  size_t hdr;
 
-  if (fgets(buf, MAXLINE, inf)) {
-    str= malloc(sizeof(*line) + strlen(buf) + 1);
-    if (!str) aargh("malloc");
+  hdr= ARENA_ROUND(sizeof(*line));
+  str= chunk_space(hdr + MAXLINE);
+  if (fgets(str+hdr, MAXLINE, inf)) {
     line= (logline*)str;
     line->next= NULL;
-    line->start= str+sizeof(logline);
+    line->chunk= curchunk;
+    line->start= str+hdr;
     line->is_v6 = 0;
     *line->fullip = 0;
-    strcpy(line->start, buf);
+    chunk_commit(hdr + strlen(line->start) + 1);
     str= ipaddr2domain(line->start, &line->addr, &line->rest, line->fullip,
                        &line->is_v6, opts);
-    if (opts & OPT_DEBUG)
-      msg("submitting %.*s -> %s", (int)(line->rest-line->addr), guard_null(line->addr), str);
-    /* Note: ADNS does not yet support "ptr" for IPv6.  */
-    if (adns_submit(adns, str,
-                    line->is_v6? adns_r_ptr_raw : adns_r_ptr,
-		    adns_qf_quoteok_cname|adns_qf_cname_loose,
-		    NULL, &line->query))
-      aargh("adns_submit");
+    line->memo= memo_find(line, adns, str, opts);
     return line;
   }
   if (!feof(inf))
@@ -785,6 +985,7 @@ static void proclog(FILE *inf, FILE *outf, int maxpending, int opts) {
   adns_state adns;
   adns_answer *answer;
   logline *head, *tail, *line;
+  addrmemo *memo;
   adns_initflags initflags;
 
   initflags= (opts & OPT_DEBUG) ? adns_if_debug : 0;
@@ -794,32 +995,42 @@ static void proclog(FILE *inf, FILE *outf, int maxpending, int opts) {
     errno= adns_init(&adns, initflags, 0);
   }
   if (errno) aargh("adns_init");
+  memo_grow();
   head= tail= readline(inf, adns, opts);
   len= 1; eof= 0;
   while (head) {
     while (head) {
-      if (opts & OPT_DEBUG)
-	msg("%d in queue; checking %.*s", len,
-	    (int)(head->rest-head->addr), guard_null(head->addr));
-      if (eof || len >= maxpending) {
-	if (opts & OPT_POLL)
-	  err= adns_wait_poll(adns, &head->query, &answer, NULL);
-	else
-	  err= adns_wait(adns, &head->query, &answer, NULL);
-      } else {
-	err= adns_check(adns, &head->query, &answer, NULL);
-      }
-      if (err == EAGAIN) break;
-      if (err) {
-	fprintf(stderr, "%s: adns_wait/check: %s", progname, strerror(err));
-	exit(1);
+      memo= head->memo;
+      if (memo->query) {
+	if (opts & OPT_DEBUG)
+	  msg("%d in queue; checking %.*s", len,
+	      (int)(head->rest-head->addr), guard_null(head->addr));
+	if (eof || len >= maxpending) {
+	  if (opts & OPT_POLL)
+	    err= adns_wait_poll(adns, &memo->query, &answer, NULL);
+	  else
+	    err= adns_wait(adns, &memo->query, &answer, NULL);
+	} else {
+	  err= adns_check(adns, &memo->query, &answer, NULL);
+	}
+	if (err == EAGAIN) break;
+	if (err) {
+	  fprintf(stderr, "%s: adns_wait/check: %s", progname, strerror(err));
+	  exit(1);
+	}
+	memo->query= NULL;
+	memo->answer= answer;
       }
+      answer= memo->answer;
       printline(outf, head->start, head->addr, head->rest,
 		answer->status == adns_s_ok ? *answer->rrs.str : NULL,
                 head->fullip, head->is_v6, opts);
+      if (!memo->keylen) {
+	free(answer);
+	free(memo);
+      }
       line= head; head= head->next;
-      free(line);
-      free(answer);
+      chunk_release(line->chunk);
       len--;
     }
     if (!eof) {
@@ -833,6 +1044,8 @@ static void proclog(FILE *inf, FILE *outf, int maxpending, int opts) {
       }
     }
   }
+  memo_freeall();
+  chunk_freeall();
   adns_finish(adns);
 }
 
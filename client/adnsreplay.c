@@ -0,0 +1,557 @@
+/*
+ * adnsreplay.c
+ * - play back traffic recorded with adns_capture
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006  Ian Jackson
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Submits the queries in a capture file to a fresh adns_state, at
+ * their original spacing or (with -f) as fast as possible, and prints
+ * one JSON line with the rate and latency percentiles.
+ *
+ * Normally the queries go to the nameservers in resolv.conf.  With -l
+ * they go instead to a responder in this process on port 53 of a
+ * loopback address (so needing root or CAP_NET_BIND_SERVICE), which
+ * answers each question with the reply recorded for it, after the
+ * recorded delay unless -f is given.  Questions with no recorded
+ * reply get SERVFAIL. */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "config.h"
+#include "adns.h"
+
+#define MAXFDS 32
+#define MAXTCP 16
+#define HASHSIZE 4096
+#define MAXMSG 65535
+#define MAXUDP 512
+#define HDRSIZE 12
+
+typedef unsigned char byte;
+
+struct query {
+  long when; /* usec after the first query */
+  adns_rrtype type;
+  adns_queryflags flags;
+  char *owner;
+};
+
+struct sent {
+  /* A datagram sent in the capture, waiting for its reply. */
+  struct sent *next;
+  long when;
+  int qlen; /* of the question: ID and question section */
+  byte *q;
+};
+
+struct reply {
+  struct reply *next;
+  int qdlen; /* of the question section */
+  long delay; /* usec */
+  int len;
+  byte *msg;
+};
+
+struct delayed {
+  struct delayed *next;
+  long due;
+  struct sockaddr_in addr;
+  int len;
+  byte msg[MAXUDP];
+};
+
+struct tcpclient {
+  int fd, got;
+  byte buf[2+MAXMSG];
+};
+
+static const char *progname;
+static struct query *queries;
+static int nqueries, aqueries;
+static struct sent *sentlist;
+static struct reply *replies[HASHSIZE];
+static struct delayed *delayhead, *delaytail;
+static struct tcpclient tcpclients[MAXTCP];
+static int fastest, nunknown;
+
+static void sysfail(const char *what, int err) {
+  fprintf(stderr,"%s: %s: %s\n",progname,what,strerror(err));
+  exit(2);
+}
+
+static void badfile(const char *why) {
+  fprintf(stderr,"%s: bad capture file: %s\n",progname,why);
+  exit(2);
+}
+
+static void *xmalloc(size_t sz) {
+  void *p= malloc(sz); if (!p) sysfail("malloc",errno);
+  return p;
+}
+
+static long usecs(const struct timeval *tv) {
+  return tv->tv_sec*1000000L + tv->tv_usec;
+}
+
+static unsigned long getl(const byte *p) {
+  return ((unsigned long)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+/* Questions are compared as the bytes of the question section, which
+ * is what adns itself checks replies against. */
+
+static int question_len(const byte *msg, int len) {
+  int cb, l;
+
+  if (len < HDRSIZE || msg[4] || msg[5] != 1) return -1;
+  for (cb= HDRSIZE; cb < len && (l= msg[cb]); cb += l+1)
+    if (l > 63) return -1;
+  cb += 1+4;
+  return cb <= len ? cb-HDRSIZE : -1;
+}
+
+static unsigned hash(const byte *p, int len) {
+  unsigned h= 2166136261U;
+  while (len--) h= (h ^ *p++) * 16777619U;
+  return h % HASHSIZE;
+}
+
+static struct reply *find_reply(const byte *qd, int qdlen) {
+  struct reply *rp;
+
+  for (rp= replies[hash(qd,qdlen)]; rp; rp= rp->next)
+    if (rp->qdlen == qdlen && !memcmp(rp->msg+HDRSIZE,qd,qdlen)) return rp;
+  return 0;
+}
+
+static void record_sent(long when, const byte *msg, int len) {
+  struct sent *st;
+  int qdlen;
+
+  qdlen= question_len(msg,len); if (qdlen<0) return;
+  st= xmalloc(sizeof(*st));
+  st->when= when;
+  st->qlen= 2+qdlen;
+  st->q= xmalloc(st->qlen);
+  memcpy(st->q,msg,2);
+  memcpy(st->q+2,msg+HDRSIZE,qdlen);
+  st->next= sentlist;
+  sentlist= st;
+}
+
+static void record_reply(long when, const byte *msg, int len) {
+  /* Keeps the first reply to each question, with the time since the
+   * datagram it answered was sent; but a truncated reply gives way to
+   * the full one, as fetched over TCP. */
+  struct sent **stp, *st;
+  struct reply *rp;
+  int qdlen;
+  unsigned h;
+
+  qdlen= question_len(msg,len); if (qdlen<0) return;
+  for (stp= &sentlist; (st= *stp); stp= &st->next)
+    if (st->qlen == 2+qdlen && !memcmp(st->q,msg,2) &&
+	!memcmp(st->q+2,msg+HDRSIZE,qdlen)) break;
+  if (!st) return;
+  *stp= st->next;
+
+  rp= find_reply(msg+HDRSIZE,qdlen);
+  if (!rp) {
+    rp= xmalloc(sizeof(*rp));
+    rp->qdlen= qdlen;
+    h= hash(msg+HDRSIZE,qdlen);
+    rp->next= replies[h];
+    replies[h]= rp;
+  } else if ((rp->msg[2] & 0x02) && !(msg[2] & 0x02)) {
+    free(rp->msg);
+  } else {
+    rp= 0;
+  }
+  if (rp) {
+    rp->delay= when - st->when;
+    rp->len= len;
+    rp->msg= xmalloc(len);
+    memcpy(rp->msg,msg,len);
+  }
+  free(st->q);
+  free(st);
+}
+
+static void read_capture(const char *fn) {
+  FILE *f;
+  byte head[19], *data;
+  int headlen, len;
+  long when, base;
+  struct query *q;
+
+  f= fopen(fn,"rb"); if (!f) sysfail(fn,errno);
+  if (fread(head,8,1,f) != 1 || memcmp(head,"ADNSCAP1",8))
+    badfile("no ADNSCAP1 header");
+
+  base= -1;
+  data= xmalloc(MAXMSG);
+  while (fread(head,1,1,f) == 1) {
+    switch (head[0]) {
+    case 'Q': headlen= 19; break;
+    case 'S': case 'R': headlen= 14; break;
+    default: badfile("unknown record kind");
+    }
+    if (fread(head+1,headlen-1,1,f) != 1) badfile("truncated record");
+    len= (head[headlen-2]<<8) | head[headlen-1];
+    if (len && fread(data,len,1,f) != 1) badfile("truncated record");
+    when= getl(head+1)*1000000L + getl(head+5);
+    if (base < 0) base= when;
+    when -= base;
+
+    switch (head[0]) {
+    case 'Q':
+      if (nqueries == aqueries) {
+	aqueries= aqueries ? aqueries*2 : 256;
+	queries= realloc(queries,sizeof(*queries)*aqueries);
+	if (!queries) sysfail("realloc",errno);
+      }
+      q= &queries[nqueries++];
+      q->when= when;
+      q->type= getl(head+9);
+      q->flags= getl(head+13);
+      q->owner= xmalloc(len+1);
+      memcpy(q->owner,data,len);
+      q->owner[len]= 0;
+      break;
+    case 'S':
+      record_sent(when,data,len);
+      break;
+    case 'R':
+      record_reply(when,data,len);
+      break;
+    }
+  }
+  if (ferror(f)) sysfail(fn,errno);
+  fclose(f);
+  free(data);
+}
+
+/* The loopback responder, for -l. */
+
+static void nonblock(int fd) {
+  int r;
+
+  r= fcntl(fd,F_GETFL); if (r<0) sysfail("fcntl",errno);
+  if (fcntl(fd,F_SETFL,r|O_NONBLOCK)) sysfail("fcntl",errno);
+}
+
+static int mkreply(const byte *q, int ql, byte *r, int tcp, long *delay_r) {
+  /* Returns the length of the reply in r, or -1 to ignore q. */
+  struct reply *rp;
+  int qdlen, len;
+
+  qdlen= question_len(q,ql); if (qdlen<0) return -1;
+  rp= find_reply(q+HDRSIZE,qdlen);
+  if (!rp) {
+    nunknown++;
+    len= HDRSIZE+qdlen;
+    memcpy(r,q,len);
+    r[2]= 0x80 | (q[2] & 0x01);
+    r[3]= 0x82; /* RA, SERVFAIL */
+    *delay_r= 0;
+    return len;
+  }
+  *delay_r= fastest ? 0 : rp->delay;
+  len= rp->len;
+  if (!tcp && len > MAXUDP) {
+    len= HDRSIZE+qdlen;
+    memcpy(r,rp->msg,len);
+    memset(r+6,0,6);
+    r[2] |= 0x02;
+  } else {
+    memcpy(r,rp->msg,len);
+  }
+  r[0]= q[0]; r[1]= q[1];
+  return len;
+}
+
+static void udp_readable(int fd, long now) {
+  static byte q[MAXMSG], r[MAXMSG];
+  struct sockaddr_in addr;
+  socklen_t al;
+  struct delayed *d;
+  long delay;
+  int ql, rl;
+
+  for (;;) {
+    al= sizeof(addr);
+    ql= recvfrom(fd,q,sizeof(q),0,(struct sockaddr*)&addr,&al);
+    if (ql<0) {
+      if (errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED) return;
+      sysfail("recvfrom",errno);
+    }
+    rl= mkreply(q,ql,r,0,&delay);
+    if (rl<0) continue;
+    d= xmalloc(sizeof(*d));
+    d->due= now+delay;
+    d->addr= addr;
+    d->len= rl;
+    memcpy(d->msg,r,rl);
+    /* Delays differ, so keep the list in order of due time. */
+    if (!delayhead || delaytail->due <= d->due) {
+      d->next= 0;
+      if (delaytail) delaytail->next= d; else delayhead= d;
+      delaytail= d;
+    } else {
+      struct delayed **dp;
+      for (dp= &delayhead; (*dp)->due <= d->due; dp= &(*dp)->next);
+      d->next= *dp;
+      *dp= d;
+    }
+  }
+}
+
+static long udp_flush(int fd, long now) {
+  /* Sends the replies that are due; returns when the next one is,
+   * or -1. */
+  struct delayed *d;
+
+  while ((d= delayhead) && d->due <= now) {
+    sendto(fd,d->msg,d->len,0,(struct sockaddr*)&d->addr,sizeof(d->addr));
+    delayhead= d->next;
+    if (!delayhead) delaytail= 0;
+    free(d);
+  }
+  return delayhead ? delayhead->due : -1;
+}
+
+static void tcp_readable(struct tcpclient *tc) {
+  static byte r[2+MAXMSG];
+  long delay;
+  int l, ml, rl, done;
+
+  l= read(tc->fd,tc->buf+tc->got,sizeof(tc->buf)-tc->got);
+  if (l<0 && (errno == EAGAIN || errno == EINTR)) return;
+  if (l<=0) goto x_close;
+  tc->got += l;
+
+  while (tc->got >= 2) {
+    ml= (tc->buf[0]<<8)|tc->buf[1];
+    if (tc->got < 2+ml) return;
+    rl= mkreply(tc->buf+2,ml,r+2,1,&delay);
+    if (rl>=0) {
+      /* Over TCP the reply goes at once. */
+      r[0]= rl>>8; r[1]= rl;
+      for (done=0; done<2+rl; done += l) {
+	l= write(tc->fd,r+done,2+rl-done);
+	if (l<=0) goto x_close;
+      }
+    }
+    memmove(tc->buf,tc->buf+2+ml,tc->got-2-ml);
+    tc->got -= 2+ml;
+  }
+  return;
+
+ x_close:
+  close(tc->fd);
+  tc->fd= -1;
+}
+
+static void tcp_accept(int lfd) {
+  int fd, i;
+
+  fd= accept(lfd,0,0);
+  if (fd<0) return;
+  for (i=0; i<MAXTCP && tcpclients[i].fd >= 0; i++);
+  if (i == MAXTCP) { close(fd); return; }
+  tcpclients[i].fd= fd;
+  tcpclients[i].got= 0;
+}
+
+static void responder_open(const char *addrstr, int *udpfd_r, int *tcpfd_r) {
+  struct sockaddr_in addr;
+  int fd, on, i;
+
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family= AF_INET;
+  addr.sin_port= htons(53);
+  if (!inet_aton(addrstr,&addr.sin_addr)) sysfail(addrstr,EINVAL);
+
+  fd= socket(AF_INET,SOCK_DGRAM,0); if (fd<0) sysfail("socket",errno);
+  if (bind(fd,(struct sockaddr*)&addr,sizeof(addr))) sysfail("bind",errno);
+  nonblock(fd);
+  *udpfd_r= fd;
+
+  fd= socket(AF_INET,SOCK_STREAM,0); if (fd<0) sysfail("socket",errno);
+  on= 1;
+  if (setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on)))
+    sysfail("setsockopt",errno);
+  if (bind(fd,(struct sockaddr*)&addr,sizeof(addr))) sysfail("bind",errno);
+  if (listen(fd,16)) sysfail("listen",errno);
+  nonblock(fd);
+  *tcpfd_r= fd;
+
+  for (i=0; i<MAXTCP; i++) tcpclients[i].fd= -1;
+}
+
+static int cmplong(const void *a, const void *b) {
+  long la= *(const long*)a, lb= *(const long*)b;
+  return la<lb ? -1 : la>lb;
+}
+
+static void usage(void) {
+  fprintf(stderr,"usage: %s [-f] [-l] [-a addr] <capturefile>\n",progname);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *addr= "127.0.0.1";
+  int local= 0, udpfd= -1, tcpfd= -1;
+  struct timeval tv;
+  struct pollfd pfds[MAXFDS+2+MAXTCP];
+  adns_state ads;
+  adns_query qu;
+  adns_answer *ans;
+  void *ctx;
+  char config[100];
+  long start, now, due, *started, *lat, elapsed;
+  int c, r, i, nextq, completed, ok, nfds, nadns, timeout, reaped;
+
+  progname= strrchr(*argv,'/'); if (progname) progname++; else progname= *argv;
+
+  while ((c= getopt(argc,argv,"fla:")) != -1) {
+    switch (c) {
+    case 'f': fastest= 1; break;
+    case 'l': local= 1; break;
+    case 'a': addr= optarg; break;
+    default: usage();
+    }
+  }
+  if (optind+1 != argc) usage();
+
+  read_capture(argv[optind]);
+  started= xmalloc(sizeof(*started)*(nqueries+1));
+  lat= xmalloc(sizeof(*lat)*(nqueries+1));
+
+  if (local) {
+    responder_open(addr,&udpfd,&tcpfd);
+    snprintf(config,sizeof(config),"nameserver %s\n",addr);
+    r= adns_init_strcfg(&ads,adns_if_noenv|adns_if_noerrprint,0,config);
+  } else {
+    r= adns_init(&ads,adns_if_noerrprint,0);
+  }
+  if (r) sysfail("adns_init",r);
+
+  if (gettimeofday(&tv,0)) sysfail("gettimeofday",errno);
+  start= usecs(&tv);
+  nextq= completed= ok= 0;
+
+  while (completed < nqueries) {
+    if (gettimeofday(&tv,0)) sysfail("gettimeofday",errno);
+    now= usecs(&tv) - start;
+
+    for (; nextq < nqueries && (fastest || queries[nextq].when <= now);
+	 nextq++) {
+      started[nextq]= now;
+      r= adns_submit(ads,queries[nextq].owner,queries[nextq].type,
+		     queries[nextq].flags,(void*)(long)nextq,&qu);
+      if (r) {
+	/* Eg, a type this build does not know; count it as done. */
+	lat[completed++]= 0;
+      }
+    }
+
+    /* adns_submit may finish queries, which adns_beforepoll does
+     * not count as work to do. */
+    for (reaped=0; ; reaped++) {
+      qu= 0;
+      r= adns_check(ads,&qu,&ans,&ctx);
+      if (r == EAGAIN || r == ESRCH) break;
+      if (r) sysfail("adns_check",r);
+      if (gettimeofday(&tv,0)) sysfail("gettimeofday",errno);
+      lat[completed++]= usecs(&tv) - start - started[(long)ctx];
+      if (ans->status == adns_s_ok) ok++;
+      free(ans);
+    }
+    if (reaped) continue;
+
+    timeout= -1;
+    if (nextq < nqueries)
+      timeout= (queries[nextq].when - now + 999)/1000;
+    if (local) {
+      due= udp_flush(udpfd,now);
+      if (due >= 0 && (timeout < 0 || (due-now+999)/1000 < timeout))
+	timeout= (due-now+999)/1000;
+    }
+
+    nadns= MAXFDS;
+    r= adns_beforepoll(ads,pfds,&nadns,&timeout,0);
+    if (r) sysfail("adns_beforepoll",r);
+    nfds= nadns;
+    if (local) {
+      pfds[nfds].fd= udpfd; pfds[nfds].events= POLLIN; nfds++;
+      pfds[nfds].fd= tcpfd; pfds[nfds].events= POLLIN; nfds++;
+      for (i=0; i<MAXTCP; i++) {
+	pfds[nfds].fd= tcpclients[i].fd;
+	pfds[nfds].events= POLLIN;
+	nfds++;
+      }
+    }
+    if (poll(pfds,nfds,timeout) < 0 && errno != EINTR)
+      sysfail("poll",errno);
+    adns_afterpoll(ads,pfds,nadns,0);
+
+    if (local) {
+      if (gettimeofday(&tv,0)) sysfail("gettimeofday",errno);
+      now= usecs(&tv) - start;
+      if (pfds[nadns].revents) udp_readable(udpfd,now);
+      if (pfds[nadns+1].revents) tcp_accept(tcpfd);
+      for (i=0; i<MAXTCP; i++)
+	if (pfds[nadns+2+i].revents && tcpclients[i].fd >= 0)
+	  tcp_readable(&tcpclients[i]);
+      udp_flush(udpfd,now);
+    }
+  }
+
+  if (gettimeofday(&tv,0)) sysfail("gettimeofday",errno);
+  elapsed= usecs(&tv) - start;
+  adns_finish(ads);
+
+  qsort(lat,nqueries,sizeof(*lat),cmplong);
+  printf("{\"queries\":%d,\"ok\":%d,\"unknown_questions\":%d,"
+	 "\"seconds\":%.3f,\"qps\":%.0f,"
+	 "\"p50_us\":%ld,\"p99_us\":%ld,\"p999_us\":%ld}\n",
+	 nqueries,ok,nunknown,elapsed/1e6,
+	 elapsed ? nqueries/(elapsed/1e6) : 0.0,
+	 nqueries ? lat[(nqueries-1)*500/1000] : 0,
+	 nqueries ? lat[(nqueries-1)*990/1000] : 0,
+	 nqueries ? lat[(nqueries-1)*999/1000] : 0);
+  if (fflush(stdout) || ferror(stdout)) sysfail("stdout",errno);
+  return 0;
+}
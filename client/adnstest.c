@@ -43,17 +43,25 @@ struct myctx {
   adns_query qu;
   int doneyet, found;
   const char *fdom;
+  adns_rrtype type;
+  adns_prepared prep; /* if this one did adns_prepare[_wire] */
 };
   
 static struct myctx *mcs;
+static int nmcs;
 static adns_state ads;
 static adns_rrtype *types_a;
 
 static void quitnow(int rc) NONRETURNING;
 static void quitnow(int rc) {
+  int i;
+
+  if (ads) adns_finish(ads);
+  /* Prepared questions may outlive their adns_state. */
+  for (i=0; i<nmcs; i++)
+    if (mcs[i].prep) adns_prepared_free(mcs[i].prep);
   free(mcs);
   free(types_a);
-  if (ads) adns_finish(ads);
   
   exit(rc);
 }
@@ -102,6 +110,10 @@ static void usageerr(const char *why) {
 	  "initflags:   p  use poll(2) instead of select(2)\n"
 	  "             s  use adns_wait with specified query, instead of 0\n"
 	  "queryflags:  a  print status abbrevs instead of strings\n"
+	  "             d  submit with a deadline 500ms from now\n"
+	  "             q  submit with adns_prepare (one question per\n"
+	  "                 distinct argument, however often it is given)\n"
+	  "             w  likewise, but with adns_prepare_wire\n"
 	  "exit status:  0 ok (though some queries may have failed)\n"
 	  "              1 used by test harness to indicate test failed\n"
 	  "              2 unable to submit or init or some such\n"
@@ -162,6 +174,55 @@ static int consistsof(const char *string, const char *accept) {
   return strspn(string,accept) == strlen(string);
 }
 
+static int domain_towire(const char *domain, unsigned char *buf, int buflen) {
+  /* Returns the length of domain in wire format, or -1 if it will not
+   * go (no quoting is understood). */
+  const char *dot;
+  int l, used;
+
+  used= 0;
+  while (*domain) {
+    dot= strchr(domain,'.');
+    l= dot ? dot-domain : strlen(domain);
+    if (!l || l>63 || used+1+l+1 > buflen) return -1;
+    buf[used++]= l;
+    memcpy(buf+used,domain,l);
+    used += l;
+    domain += l;
+    if (*domain) domain++;
+  }
+  if (used+1 > buflen) return -1;
+  buf[used++]= 0;
+  return used;
+}
+
+static int submit_prepared(struct myctx *mc, const char *domain,
+			   adns_rrtype type, int qflags, int wire) {
+  /* Uses the question prepared for an earlier identical argument, if
+   * there was one, so that it is submitted more than once. */
+  unsigned char wbuf[256];
+  struct myctx *omc;
+  adns_prepared prep;
+  int r, wl;
+
+  prep= 0;
+  for (omc= mcs; omc < mc && !prep; omc++)
+    if (omc->prep && omc->type == type && !strcmp(omc->fdom,mc->fdom))
+      prep= omc->prep;
+  if (!prep) {
+    if (wire) {
+      wl= domain_towire(domain,wbuf,sizeof(wbuf));
+      if (wl < 0) usageerr("domain will not go into wire format");
+      r= adns_prepare_wire(ads,wbuf,wl,type,qflags,&mc->prep);
+    } else {
+      r= adns_prepare(ads,domain,type,qflags,&mc->prep);
+    }
+    if (r) return r;
+    prep= mc->prep;
+  }
+  return adns_submit_prepared(ads,prep,mc,&mc->qu);
+}
+
 int main(int argc, char *const *argv) {
   adns_query qu;
   struct myctx *mc, *mcw;
@@ -247,14 +308,26 @@ int main(int argc, char *const *argv) {
 
   for (qi=0; qi<qc; qi++) {
     fdom_split(fdomlist[qi],&domain,&qflags,ownflags,sizeof(ownflags));
-    if (!consistsof(ownflags,"a")) usageerr("unknown ownqueryflag");
+    if (!consistsof(ownflags,"adqw")) usageerr("unknown ownqueryflag");
     for (ti=0; ti<tc; ti++) {
       mc= &mcs[qi*tc+ti];
       mc->doneyet= 0;
       mc->fdom= fdomlist[qi];
+      mc->type= types[ti];
+      mc->prep= 0;
+      nmcs++;
 
       fprintf(stdout,"%s flags %d type %d",domain,qflags,types[ti]);
-      r= adns_submit(ads,domain,types[ti],qflags,mc,&mc->qu);
+      if (strchr(ownflags,'d')) {
+	if (gettimeofday(&now,0)) { perror("gettimeofday"); quitnow(3); }
+	now.tv_usec += 500000;
+	if (now.tv_usec >= 1000000) { now.tv_sec++; now.tv_usec -= 1000000; }
+	r= adns_submit_deadline(ads,domain,types[ti],qflags,mc,&now,&mc->qu);
+      } else if (strchr(ownflags,'q') || strchr(ownflags,'w')) {
+	r= submit_prepared(mc,domain,types[ti],qflags,!!strchr(ownflags,'w'));
+      } else {
+	r= adns_submit(ads,domain,types[ti],qflags,mc,&mc->qu);
+      }
       if (r == ENOSYS) {
 	fprintf(stdout," not implemented\n");
 	mc->qu= 0;
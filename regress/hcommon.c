@@ -39,6 +39,15 @@ int Hgettimeofday(struct timeval *tv, struct timezone *tz) {
   *tv= currenttime;
   return 0;
 }
+
+int Hclock_gettime(clockid_t clk, struct timespec *ts) {
+  struct timeval tv;
+
+  Hgettimeofday(&tv,0);
+  ts->tv_sec= tv.tv_sec;
+  ts->tv_nsec= tv.tv_usec * 1000;
+  return 0;
+}
 int Hwritev(int fd, const struct iovec *vector, size_t count) {
   size_t i;
   vbw.used= 0;
@@ -47,6 +56,59 @@ int Hwritev(int fd, const struct iovec *vector, size_t count) {
   }
   return Hwrite(fd,vbw.buf,vbw.used);
 }
+
+int Hsend(int fd, const void *buf, size_t len, int flags) {
+  /* Only used for MSG_NOSIGNAL, so we record it as write. */
+  Tmust("send","flags",!(flags & ~MSG_NOSIGNAL));
+  return Hwrite(fd,buf,len);
+}
+
+int Hsendmsg(int fd, const struct msghdr *msg, int flags) {
+  Tmust("sendmsg","flags",!(flags & ~MSG_NOSIGNAL));
+  Tmust("sendmsg","msg_name",!msg->msg_name);
+  Tmust("sendmsg","msg_controllen",!msg->msg_controllen);
+  return Hwritev(fd,msg->msg_iov,msg->msg_iovlen);
+}
+
+int Hrecvmsg(int fd, struct msghdr *msg, int flags) {
+  /* This is recvfrom (or read, if no address is wanted).  The only
+   * ancillary data is the count of dropped datagrams, which is
+   * recorded by rxqovfl first if the caller asked for any. */
+#ifdef SO_RXQ_OVFL
+  struct cmsghdr *cm;
+  unsigned int ucount;
+#endif
+  int r, addrlen, count;
+
+  Tmust("recvmsg","flags",!flags);
+  Tmust("recvmsg","msg_iovlen",msg->msg_iovlen == 1);
+  count= msg->msg_controllen ? Hrxqovfl(fd) : 0;
+  if (msg->msg_name) {
+    addrlen= msg->msg_namelen;
+    r= Hrecvfrom(fd,msg->msg_iov[0].iov_base,msg->msg_iov[0].iov_len,0,
+		 msg->msg_name,&addrlen);
+    msg->msg_namelen= addrlen;
+  } else {
+    r= Hread(fd,msg->msg_iov[0].iov_base,msg->msg_iov[0].iov_len);
+  }
+  msg->msg_flags= 0;
+#ifdef SO_RXQ_OVFL
+  if (r>=0 && count>0) {
+    Tmust("recvmsg","msg_controllen",
+	  msg->msg_controllen >= CMSG_SPACE(sizeof(ucount)));
+    cm= CMSG_FIRSTHDR(msg);
+    cm->cmsg_level= SOL_SOCKET;
+    cm->cmsg_type= SO_RXQ_OVFL;
+    cm->cmsg_len= CMSG_LEN(sizeof(ucount));
+    ucount= count;
+    memcpy(CMSG_DATA(cm),&ucount,sizeof(ucount));
+    msg->msg_controllen= CMSG_SPACE(sizeof(ucount));
+    return r;
+  }
+#endif
+  msg->msg_controllen= 0;
+  return r;
+}
 void Qselect(	int max , const fd_set *rfds , const fd_set *wfds , const fd_set *efds , struct timeval *to 	) {
  vb.used= 0;
  Tvba("select");
@@ -67,9 +129,10 @@ void Qpoll(	const struct pollfd *fds , int nfds , int timeout 	) {
   Q_vb();
 }
 #endif
-void Qsocket(	 int type 	) {
+void Qsocket(	int domain , int type 	) {
  vb.used= 0;
  Tvba("socket");
+  if (domain==AF_INET6) Tvba(" domain=AF_INET6"); 
   Tvbf(type==SOCK_STREAM ? " type=SOCK_STREAM" : " type=SOCK_DGRAM"); 
   Q_vb();
 }
@@ -100,6 +163,15 @@ void Qbind(	int fd , const struct sockaddr *addr , int addrlen 	) {
 	Tvba(" addr="); Tvbaddr(addr,addrlen); 
   Q_vb();
 }
+void Qsetsockopt(	int fd , int level , int optname , const void *optval , int optlen 	) {
+ vb.used= 0;
+ Tvba("setsockopt");
+	Tvbf(" fd=%d",fd); 
+	Tvbf(" level=%d",level); 
+	Tvbf(" optname=%d",optname); 
+	Tvbbytes(optval,optlen); 
+  Q_vb();
+}
 void Qlisten(	int fd , int backlog 	) {
  vb.used= 0;
  Tvba("listen");
@@ -136,6 +208,12 @@ void Qread(	int fd , size_t buflen 	) {
 	Tvbf(" buflen=%lu",(unsigned long)buflen); 
   Q_vb();
 }
+void Qrxqovfl(	int fd 	) {
+ vb.used= 0;
+ Tvba("rxqovfl");
+	Tvbf(" fd=%d",fd);
+  Q_vb();
+}
 void Qwrite(	int fd , const void *buf , size_t len 	) {
  vb.used= 0;
  Tvba("write");
@@ -145,6 +223,14 @@ void Qwrite(	int fd , const void *buf , size_t len 	) {
 }
 void Tvbaddr(const struct sockaddr *addr, int len) {
   const struct sockaddr_in *ai= (const struct sockaddr_in*)addr;
+  const struct sockaddr_in6 *ai6= (const struct sockaddr_in6*)addr;
+  char buf[INET6_ADDRSTRLEN];
+  if (addr->sa_family==AF_INET6) {
+    assert(len==sizeof(struct sockaddr_in6));
+    if (!inet_ntop(AF_INET6,&ai6->sin6_addr,buf,sizeof(buf))) abort();
+    Tvbf("[%s]:%u",buf,htons(ai6->sin6_port));
+    return;
+  }
   assert(len==sizeof(struct sockaddr_in));
   assert(ai->sin_family==AF_INET);
   Tvbf("%s:%u",inet_ntoa(ai->sin_addr),htons(ai->sin_port));
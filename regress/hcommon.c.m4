@@ -73,6 +73,15 @@ int Hgettimeofday(struct timeval *tv, struct timezone *tz) {
   return 0;
 }
 
+int Hclock_gettime(clockid_t clk, struct timespec *ts) {
+  struct timeval tv;
+
+  Hgettimeofday(&tv,0);
+  ts->tv_sec= tv.tv_sec;
+  ts->tv_nsec= tv.tv_usec * 1000;
+  return 0;
+}
+
 int Hwritev(int fd, const struct iovec *vector, size_t count) {
   size_t i;
   
@@ -83,6 +92,59 @@ int Hwritev(int fd, const struct iovec *vector, size_t count) {
   return Hwrite(fd,vbw.buf,vbw.used);
 }
 
+int Hsend(int fd, const void *buf, size_t len, int flags) {
+  /* Only used for MSG_NOSIGNAL, so we record it as write. */
+  Tmust("send","flags",!(flags & ~MSG_NOSIGNAL));
+  return Hwrite(fd,buf,len);
+}
+
+int Hsendmsg(int fd, const struct msghdr *msg, int flags) {
+  Tmust("sendmsg","flags",!(flags & ~MSG_NOSIGNAL));
+  Tmust("sendmsg","msg_name",!msg->msg_name);
+  Tmust("sendmsg","msg_controllen",!msg->msg_controllen);
+  return Hwritev(fd,msg->msg_iov,msg->msg_iovlen);
+}
+
+int Hrecvmsg(int fd, struct msghdr *msg, int flags) {
+  /* This is recvfrom (or read, if no address is wanted).  The only
+   * ancillary data is the count of dropped datagrams, which is
+   * recorded by rxqovfl first if the caller asked for any. */
+#ifdef SO_RXQ_OVFL
+  struct cmsghdr *cm;
+  unsigned int ucount;
+#endif
+  int r, addrlen, count;
+
+  Tmust("recvmsg","flags",!flags);
+  Tmust("recvmsg","msg_iovlen",msg->msg_iovlen == 1);
+  count= msg->msg_controllen ? Hrxqovfl(fd) : 0;
+  if (msg->msg_name) {
+    addrlen= msg->msg_namelen;
+    r= Hrecvfrom(fd,msg->msg_iov[0].iov_base,msg->msg_iov[0].iov_len,0,
+		 msg->msg_name,&addrlen);
+    msg->msg_namelen= addrlen;
+  } else {
+    r= Hread(fd,msg->msg_iov[0].iov_base,msg->msg_iov[0].iov_len);
+  }
+  msg->msg_flags= 0;
+#ifdef SO_RXQ_OVFL
+  if (r>=0 && count>0) {
+    Tmust("recvmsg","msg_controllen",
+	  msg->msg_controllen >= CMSG_SPACE(sizeof(ucount)));
+    cm= CMSG_FIRSTHDR(msg);
+    cm->cmsg_level= SOL_SOCKET;
+    cm->cmsg_type= SO_RXQ_OVFL;
+    cm->cmsg_len= CMSG_LEN(sizeof(ucount));
+    ucount= count;
+    memcpy(CMSG_DATA(cm),&ucount,sizeof(ucount));
+    msg->msg_controllen= CMSG_SPACE(sizeof(ucount));
+    return r;
+  }
+#endif
+  msg->msg_controllen= 0;
+  return r;
+}
+
 m4_define(`hm_syscall', `
  hm_create_proto_q
 void Q$1(hm_args_massage($3,void)) {
@@ -100,6 +162,8 @@ void Q$1(hm_args_massage($3,void)) {
  m4_define(`hm_arg_must', `')
  m4_define(`hm_arg_socktype', `
   Tvbf($'`1==SOCK_STREAM ? " $'`1=SOCK_STREAM" : " $'`1=SOCK_DGRAM");')
+ m4_define(`hm_arg_sockdomain', `
+  if ($'`1==AF_INET6) Tvba(" $'`1=AF_INET6");')
  m4_define(`hm_arg_ign', `')
  m4_define(`hm_arg_fd', `Tvbf(" $'`1=%d",$'`1);')
  m4_define(`hm_arg_fcntl_cmd_arg', `
@@ -130,7 +194,15 @@ m4_include(`hsyscalls.i4')
 
 void Tvbaddr(const struct sockaddr *addr, int len) {
   const struct sockaddr_in *ai= (const struct sockaddr_in*)addr;
+  const struct sockaddr_in6 *ai6= (const struct sockaddr_in6*)addr;
+  char buf[INET6_ADDRSTRLEN];
   
+  if (addr->sa_family==AF_INET6) {
+    assert(len==sizeof(struct sockaddr_in6));
+    if (!inet_ntop(AF_INET6,&ai6->sin6_addr,buf,sizeof(buf))) abort();
+    Tvbf("[%s]:%u",buf,htons(ai6->sin6_port));
+    return;
+  }
   assert(len==sizeof(struct sockaddr_in));
   assert(ai->sin_family==AF_INET);
   Tvbf("%s:%u",inet_ntoa(ai->sin_addr),htons(ai->sin_port));
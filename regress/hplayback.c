@@ -154,20 +154,37 @@ static void Ppollfds(struct pollfd *fds, int nfds) {
 #endif
 static void Paddr(struct sockaddr *addr, int *lenr) {
   struct sockaddr_in *sa= (struct sockaddr_in*)addr;
+  struct sockaddr_in6 *sa6= (struct sockaddr_in6*)addr;
   char *p, *ep;
   long ul;
-  assert(*lenr >= sizeof(*sa));
-  p= strchr(vb2.buf+vb2.used,':');
-  if (!p) Psyntax("no port on address");
-  *p++= 0;
-  memset(sa,0,sizeof(*sa));
-  sa->sin_family= AF_INET;
-  if (!inet_aton(vb2.buf+vb2.used,&sa->sin_addr)) Psyntax("invalid address");
+  if (vb2.buf[vb2.used] == '[') {
+    assert(*lenr >= sizeof(*sa6));
+    p= strchr(vb2.buf+vb2.used,']');
+    if (!p || p[1] != ':') Psyntax("no port on address");
+    *p= 0; p+= 2;
+    memset(sa6,0,sizeof(*sa6));
+    sa6->sin6_family= AF_INET6;
+    if (inet_pton(AF_INET6,vb2.buf+vb2.used+1,&sa6->sin6_addr) != 1)
+      Psyntax("invalid address");
+  } else {
+    assert(*lenr >= sizeof(*sa));
+    p= strchr(vb2.buf+vb2.used,':');
+    if (!p) Psyntax("no port on address");
+    *p++= 0;
+    memset(sa,0,sizeof(*sa));
+    sa->sin_family= AF_INET;
+    if (!inet_aton(vb2.buf+vb2.used,&sa->sin_addr)) Psyntax("invalid address");
+  }
   ul= strtoul(p,&ep,10);
   if (*ep && *ep != ' ') Psyntax("invalid port (bad syntax)");
   if (ul >= 65536) Psyntax("port too large");
-  sa->sin_port= htons(ul);
-  *lenr= sizeof(*sa);
+  if (sa->sin_family == AF_INET6) {
+    sa6->sin6_port= htons(ul);
+    *lenr= sizeof(*sa6);
+  } else {
+    sa->sin_port= htons(ul);
+    *lenr= sizeof(*sa);
+  }
   vb2.used= ep - (char*)vb2.buf;
 }
 static int Pbytes(byte *buf, int maxlen) {
@@ -194,10 +211,11 @@ static int Pbytes(byte *buf, int maxlen) {
   }
 }
 void Q_vb(void) {
+  int r;
   const char *nl;
   Tensurerecordfile();
   if (!adns__vbuf_ensure(&vb2,vb.used+2)) Tnomem();
-  fread(vb2.buf,1,vb.used+2,Tinputfile);
+  r= fread(vb2.buf,1,vb.used+2,Tinputfile);
   if (feof(Tinputfile)) {
     fprintf(stderr,"adns test harness: input ends prematurely; program did:\n %.*s\n",
            vb.used,vb.buf);
@@ -282,9 +300,9 @@ int Hpoll(	struct pollfd *fds , int nfds , int timeout 	) {
 int Hsocket(	int domain , int type , int protocol 	) {
  int r, amtread;
  char *ep;
-	Tmust("socket","domain",domain==AF_INET);
+  Tmust("socket","domain",domain==AF_INET || domain==AF_INET6);
   Tmust("socket","type",type==SOCK_STREAM || type==SOCK_DGRAM);
- Qsocket(	 type 	);
+ Qsocket(	domain , type 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
  Tensurereportfile();
@@ -411,6 +429,33 @@ int Hbind(	int fd , const struct sockaddr *addr , int addrlen 	) {
  P_updatetime();
  return r;
 }
+int Hsetsockopt(	int fd , int level , int optname , const void *optval , int optlen 	) {
+ int r, amtread;
+ Qsetsockopt(	fd , level , optname , optval , optlen 	);
+ if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
+ fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
+ Tensurereportfile();
+ fprintf(Treportfile,"%s",vb2.buf);
+ amtread= strlen(vb2.buf);
+ if (amtread<=0 || vb2.buf[--amtread]!='\n')
+  Psyntax("badly formed line");
+ vb2.buf[amtread]= 0;
+ if (memcmp(vb2.buf," setsockopt=",12)) Psyntax("syscall reply mismatch");
+ if (vb2.buf[12] == 'E') {
+  int e;
+  e= Perrno(vb2.buf+12);
+  P_updatetime();
+  errno= e;
+  return -1;
+ }
+  if (memcmp(vb2.buf+12,"OK",2)) Psyntax("success/fail not E* or OK");
+  vb2.used= 12+2;
+  r= 0;
+ assert(vb2.used <= amtread);
+ if (vb2.used != amtread) Psyntax("junk at end of line");
+ P_updatetime();
+ return r;
+}
 int Hlisten(	int fd , int backlog 	) {
  int r, amtread;
  Qlisten(	fd , backlog 	);
@@ -553,6 +598,34 @@ int Hread(	int fd , void *buf , size_t buflen 	) {
  P_updatetime();
  return r;
 }
+int Hrxqovfl(	int fd 	) {
+ int r, amtread;
+ char *ep;
+ Qrxqovfl(	fd 	);
+ if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
+ fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
+ Tensurereportfile();
+ fprintf(Treportfile,"%s",vb2.buf);
+ amtread= strlen(vb2.buf);
+ if (amtread<=0 || vb2.buf[--amtread]!='\n')
+  Psyntax("badly formed line");
+ vb2.buf[amtread]= 0;
+ if (memcmp(vb2.buf," rxqovfl=",9)) Psyntax("syscall reply mismatch");
+ if (vb2.buf[9] == 'E') {
+  int e;
+  e= Perrno(vb2.buf+9);
+  P_updatetime();
+  errno= e;
+  return -1;
+ }
+  r= strtoul(vb2.buf+9,&ep,10);
+  if (*ep && *ep!=' ') Psyntax("return value not E* or positive number");
+  vb2.used= ep - (char*)vb2.buf;
+ assert(vb2.used <= amtread);
+ if (vb2.used != amtread) Psyntax("junk at end of line");
+ P_updatetime();
+ return r;
+}
 int Hwrite(	int fd , const void *buf , size_t len 	) {
  int r, amtread;
  char *ep;
@@ -151,9 +151,9 @@ static void Pfdset(fd_set *set, int max) {
   int r, c;
   char *ep;
   
-  if (vb2.buf[vb2.used++] != hm_squote[hm_squote) Psyntax("fd set start not [");
+  if (vb2.buf[vb2.used++] != '[') Psyntax("fd set start not [");
   FD_ZERO(set);
-  if (vb2.buf[vb2.used] == hm_squote]hm_squote) { vb2.used++; return; }
+  if (vb2.buf[vb2.used] == ']') { vb2.used++; return; }
   for (;;) {
     r= strtoul(vb2.buf+vb2.used,&ep,10);
     if (r>=max) Psyntax("fd set member > max");
@@ -161,7 +161,7 @@ static void Pfdset(fd_set *set, int max) {
     FD_SET(r,set);
     vb2.used= ep - (char*)vb2.buf;
     c= vb2.buf[vb2.used++];
-    if (c == hm_squote]hm_squote) break;
+    if (c == ']') break;
     if (c != hm_squote,hm_squote) Psyntax("fd set separator not ,");
   }
 }
@@ -192,7 +192,7 @@ static void Ppollfds(struct pollfd *fds, int nfds) {
   char *ep;
   const char *comma= "";
   
-  if (vb2.buf[vb2.used++] != hm_squote[hm_squote) Psyntax("pollfds start not [");
+  if (vb2.buf[vb2.used++] != '[') Psyntax("pollfds start not [");
   for (i=0; i<nfds; i++) {
     Pstring("{fd=","{fd= in pollfds");
     fds->fd= strtoul(vb2.buf+vb2.used,&ep,10);
@@ -205,27 +205,44 @@ static void Ppollfds(struct pollfd *fds, int nfds) {
     Pstring(comma,"separator in pollfds");
     comma= ", ";
   }
-  if (vb2.buf[vb2.used++] != hm_squote]hm_squote) Psyntax("pollfds end not ]");
+  if (vb2.buf[vb2.used++] != ']') Psyntax("pollfds end not ]");
 }
 #endif
 
 static void Paddr(struct sockaddr *addr, int *lenr) {
   struct sockaddr_in *sa= (struct sockaddr_in*)addr;
+  struct sockaddr_in6 *sa6= (struct sockaddr_in6*)addr;
   char *p, *ep;
   long ul;
   
-  assert(*lenr >= sizeof(*sa));
-  p= strchr(vb2.buf+vb2.used,':');
-  if (!p) Psyntax("no port on address");
-  *p++= 0;
-  memset(sa,0,sizeof(*sa));
-  sa->sin_family= AF_INET;
-  if (!inet_aton(vb2.buf+vb2.used,&sa->sin_addr)) Psyntax("invalid address");
+  if (vb2.buf[vb2.used] == '[') {
+    assert(*lenr >= sizeof(*sa6));
+    p= strchr(vb2.buf+vb2.used,']');
+    if (!p || p[1] != ':') Psyntax("no port on address");
+    *p= 0; p+= 2;
+    memset(sa6,0,sizeof(*sa6));
+    sa6->sin6_family= AF_INET6;
+    if (inet_pton(AF_INET6,vb2.buf+vb2.used+1,&sa6->sin6_addr) != 1)
+      Psyntax("invalid address");
+  } else {
+    assert(*lenr >= sizeof(*sa));
+    p= strchr(vb2.buf+vb2.used,':');
+    if (!p) Psyntax("no port on address");
+    *p++= 0;
+    memset(sa,0,sizeof(*sa));
+    sa->sin_family= AF_INET;
+    if (!inet_aton(vb2.buf+vb2.used,&sa->sin_addr)) Psyntax("invalid address");
+  }
   ul= strtoul(p,&ep,10);
   if (*ep && *ep != hm_squote hm_squote) Psyntax("invalid port (bad syntax)");
   if (ul >= 65536) Psyntax("port too large");
-  sa->sin_port= htons(ul);
-  *lenr= sizeof(*sa);
+  if (sa->sin_family == AF_INET6) {
+    sa6->sin6_port= htons(ul);
+    *lenr= sizeof(*sa6);
+  } else {
+    sa->sin_port= htons(ul);
+    *lenr= sizeof(*sa);
+  }
 
   vb2.used= ep - (char*)vb2.buf;
 }
@@ -33,6 +33,10 @@ m4_include(hmacros.i4)
 #include <unistd.h>
 #include <fcntl.h>
 
+/* The recording routines must call the real system calls, so the
+ * redirections in hredirect.h (pulled in by internal.h) are not
+ * wanted here. */
+#undef ADNS_REGRESS_TEST
 #include "harness.h"
 
 static FILE *Toutputfile;
@@ -82,6 +86,38 @@ static void R_vb(void) {
   Q_vb();
 }
 
+static int rxqovfl(int fd) {
+  /* Peeks at the next datagram for fd, for the count of datagrams
+   * dropped by the kernel which comes with it; see hsyscalls.i4. */
+#ifdef SO_RXQ_OVFL
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(unsigned int))];
+  } control;
+  unsigned int count;
+  char dummy;
+
+  memset(&msg,0,sizeof(msg));
+  iov.iov_base= &dummy;
+  iov.iov_len= 1;
+  msg.msg_iov= &iov;
+  msg.msg_iovlen= 1;
+  msg.msg_control= &control;
+  msg.msg_controllen= sizeof(control);
+  if (recvmsg(fd,&msg,MSG_PEEK|MSG_DONTWAIT) < 0) return 0;
+  for (cm= CMSG_FIRSTHDR(&msg); cm; cm= CMSG_NXTHDR(&msg,cm)) {
+    if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_RXQ_OVFL)
+      continue;
+    memcpy(&count,CMSG_DATA(cm),sizeof(count));
+    return count & 0x7fffffff;
+  }
+#endif
+  return 0;
+}
+
 m4_define(`hm_syscall', `
  hm_create_proto_h
 int H$1(hm_args_massage($3,void)) {
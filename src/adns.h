@@ -80,6 +80,7 @@ extern "C" { /* I really dislike this - iwj. */
 
 typedef struct adns__state *adns_state;
 typedef struct adns__query *adns_query;
+typedef struct adns__prepared *adns_prepared;
 
 typedef enum { /* In general, or together the desired flags: */
  adns_if_none=        0x0000,/* no flags.  nicer than 0 for some compilers */
@@ -93,8 +94,19 @@ typedef enum { /* In general, or together the desired flags: */
  adns_if_nosigpipe=   0x0040,/* applic has SIGPIPE ignored, do not protect */
  adns_if_checkc_entex=0x0100,/* consistency checks on entry/exit to adns fns */
  adns_if_checkc_freq= 0x0300,/* consistency checks very frequently (slow!) */
- adns_if_tormode=     0x1000 /* route all trafic via TOR.  */
+ adns_if_tormode=     0x1000,/* route all trafic via TOR.  */
+ adns_if_hosts=       0x2000,/* answer from hosts file and literals */
+ adns_if_connectudp=  0x4000,/* a connect()ed UDP socket per server */
+ adns_if_tcpfastopen= 0x8000,/* TCP Fast Open where the OS has it */
+ adns_if_udpdrops=   0x10000,/* notice replies dropped by the kernel */
+ adns_if_monotonic=  0x20000 /* use CLOCK_MONOTONIC, not gettimeofday */
 } adns_initflags;
+/* With adns_if_monotonic, adns's idea of the time, including any now
+ * you pass in and the expires field of answers, comes from
+ * clock_gettime(CLOCK_MONOTONIC) (as a struct timeval) so that
+ * timeouts are not upset by the system clock being stepped.  Where
+ * the OS lacks it adns uses gettimeofday regardless.
+ */
 
 typedef enum { /* In general, or together the desired flags: */
  adns_qf_none=           0x00000000,/* no flags */
@@ -107,6 +119,12 @@ typedef enum { /* In general, or together the desired flags: */
  adns_qf_quotefail_cname=0x00000080,/* refuse if quote-req chars in CNAME we go via */
  adns_qf_cname_loose=    0x00000100,/* allow refs to CNAMEs - without, get _s_cname */
  adns_qf_cname_forbid=   0x00000200,/* don't follow CNAMEs, instead give _s_cname */
+ adns_qf_fakeptr=        0x00000400,/* PTR failure gives numeric address */
+ adns_qf_search_parallel=0x00000800,/* with _search, try all at once */
+ adns_qf_dualstack=      0x00001000,/* _addr and +addr look up AAAA too */
+ adns_qf_dualstack_first=0x00002000,/*  ... finishing when one family has some */
+ adns_qf_interactive=    0x00004000,/* schedule ahead of other queries */
+ adns_qf_bulk=           0x00008000,/* schedule behind other queries */
  adns__qf_internalmask=  0x0ff00000
 } adns_queryflags;
 
@@ -159,6 +177,7 @@ typedef enum {
  adns_r_rp=                  adns_r_rp_raw|adns__qtf_mail822,
 
  adns_r_aaaa=            28, /* RFC3596 */
+ adns_r_addr6=               adns_r_aaaa|adns__qtf_deref,
 
  /* For SRV records, query domain without _qf_quoteok_query must look
   * as expected from SRV RFC with hostname-like Name.  _With_
@@ -170,6 +189,25 @@ typedef enum {
 
 } adns_rrtype;
 
+/*
+ * With adns_qf_dualstack, adns_r_addr and the +addr types (ns, mx,
+ * srv) look up A and AAAA records at the same time and give both
+ * kinds of address in a single list, ordered by the sortlist.  If
+ * adns_qf_dualstack_first is given too, whichever lookup first finds
+ * some addresses is used and the other is abandoned.  adns_r_addr6
+ * gives only the IPv6 addresses, as adns_rr_addr.
+ */
+
+/*
+ * adns_qf_interactive and adns_qf_bulk put a query (and any queries
+ * adns makes on its behalf) in a better or worse priority class than
+ * the default.  Where queries wait for one another - for room in the
+ * adns_cwnd congestion window, for retransmission, and to be written
+ * to a new TCP connection - the better class goes first.  So that
+ * bulk queries are not starved, the longest waiting query is let
+ * through after every few that overtake it.  Give at most one.
+ */
+
 /*
  * In queries without qf_quoteok_*, all domains must have standard
  * legal syntax, or you get adns_s_querydomainvalid (if the query
@@ -297,6 +335,7 @@ typedef struct {
   union {
     struct sockaddr sa;
     struct sockaddr_in inet;
+    struct sockaddr_in6 inet6;
   } addr;
 } adns_rr_addr;
 
@@ -363,7 +402,7 @@ typedef struct {
     unsigned char *bytes;
     char *(*str);                    /* ns_raw, cname, ptr, ptr_raw */
     adns_rr_intstr *(*manyistr);     /* txt (list strs ends with i=-1, str=0)*/
-    adns_rr_addr *addr;              /* addr */
+    adns_rr_addr *addr;              /* addr, addr6 */
     struct in_addr *inaddr;          /* a */
     struct in6_addr *in6addr;        /* aaaa */
     adns_rr_hostaddr *hostaddr;      /* ns */
@@ -443,6 +482,53 @@ int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
 		    adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
 		    void *logfndata /*0 with logfn==0 => discard*/);
 
+typedef struct {
+  void *(*mallocfn)(void *context, size_t sz);
+  void *(*reallocfn)(void *context, void *p, size_t sz);
+  void (*freefn)(void *context, void *p);
+  void *context;
+} adns_allocator;
+  /* Like malloc, realloc and free, except that each is passed
+   * context.  reallocfn may be passed a null p; freefn is never. */
+
+int adns_init_alloc(adns_state *newstate_r, adns_initflags flags,
+		    const char *configtext /*0=>use default config files*/,
+		    adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
+		    void *logfndata /*0 with logfn==0 => discard*/,
+		    const adns_allocator *alloc /*0=>malloc etc.*/);
+  /* As adns_init_logfn, but the adns_state, its queries and the
+   * answers they produce are allocated with *alloc, which is copied.
+   * Answers must then be freed with adns_freeanswer, not free.
+   * Strings from adns_rr_info and prepared questions still come from
+   * malloc, since they may outlive the adns_state. */
+
+typedef struct {
+  int (*udpsendfn)(void *context, int serv, const void *msg, int len);
+  int (*tcpsendfn)(void *context, int serv, const void *msg, int len);
+  void *context;
+} adns_transport;
+  /* Each is passed context, the index of the nameserver (in the
+   * order given in the configuration) and one complete DNS message,
+   * without the TCP length prefix, and returns 0 or an errno value.
+   * A failed udpsendfn is treated like a failed sendto; a failed
+   * tcpsendfn like a broken connection, so the query times out. */
+
+int adns_init_transport(adns_state *newstate_r, adns_initflags flags,
+			const char *configtext /*0=>use default config files*/,
+			adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
+			void *logfndata /*0 with logfn==0 => discard*/,
+			const adns_allocator *alloc /*0=>malloc etc.*/,
+			const adns_transport *transport /*0=>sockets*/);
+  /* As adns_init_alloc, but if transport is non-0 adns opens no
+   * sockets: queries are handed to *transport (which is copied) and
+   * replies must be given back with adns_inject_reply.  Both
+   * functions must be supplied, or EINVAL is returned.  Such a state
+   * has no file descriptors, so drive it with adns_check,
+   * adns_firsttimeout and adns_processtimeouts rather than adns_wait
+   * or the select/poll calls.  TCP connections are not modelled:
+   * there is no connect and nothing to close, and each tcpsendfn call
+   * is one query. */
+
 /* Configuration:
  *  adns_init reads /etc/resolv.conf, which is expected to be (broadly
  *  speaking) in the format expected by libresolv, and then
@@ -453,18 +539,22 @@ int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
  *
  * Standard directives understood in resolv[-adns].conf:
  *
- *  nameserver <address>
- *   Must be followed by the IP address of a nameserver.  Several
- *   nameservers may be specified, and they will be tried in the order
- *   found.  There is a compiled in limit, currently 5, on the number
- *   of nameservers.  (libresolv supports only 3 nameservers.)
+ *  nameserver <address> [adns_weight:<n>]
+ *   Must be followed by the IPv4 or IPv6 address of a nameserver.
+ *   Several nameservers, of either family, may be specified, and they
+ *   will be tried in the order found.  There is no limit on the
+ *   number of nameservers.  (libresolv supports only 3 nameservers.)
+ *   adns_weight (1 to 1000, default 1) is an adns extension giving
+ *   the server's share of the load with adns_serverselect.
  *
  *  search <domain> ...
  *   Specifies the search list for queries which specify
  *   adns_qf_search.  This is a list of domains to append to the query
  *   domain.  The query domain will be tried as-is either before all
  *   of these or after them, depending on the ndots option setting
- *   (see below).
+ *   (see below).  With adns_qf_search_parallel all the candidates are
+ *   asked at once; the answer is still that of the first one, in this
+ *   order, which does not give NXDOMAIN.
  *
  *  domain <domain>
  *   This is present only for backward compatibility with obsolete
@@ -519,11 +609,86 @@ int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
  *
  *  adns_tormode
  *   Forces the use of virtual circuits over a SOCKS5 proxy running at
- *   port 9050.  No UDP based communication is done.
+ *   port 9050 (or, failing that, 9150).  No UDP based communication is
+ *   done.  The SOCKS5 negotiation does not block; it is part of making
+ *   the TCP connection and is subject to the same timeout.
  *
  *  adns_sockscred:username:password
  *   Use username and password for SOCKS5 authentication.  Default is
- *   no authentication.
+ *   no authentication.  May be given more than once (up to 8 times),
+ *   in which case the TCP connections (see adns_tcpconns) use the
+ *   credentials in turn; Tor uses a separate circuit for each.
+ *
+ *  adns_tcpconns:<n>
+ *   Use up to n (1 to 8, default 1) TCP connections at once.  Each
+ *   query that needs TCP goes on the connection with the fewest
+ *   outstanding queries.  This is mainly useful with adns_tormode,
+ *   where every query uses TCP.
+ *
+ *  adns_serverselect:first
+ *  adns_serverselect:weighted
+ *  adns_serverselect:leastload
+ *   How to choose the nameserver for a query's first datagram;
+ *   retries go on to the following servers in turn as usual.  The
+ *   default, first, always starts with the first nameserver.
+ *   weighted shares queries out in proportion to the adns_weight of
+ *   each server, evenly interleaved.  leastload picks the server with
+ *   fewest outstanding queries relative to its weight.
+ *
+ *  adns_hosts
+ *  adns_hosts:<filename>
+ *   Answer A, AAAA, address and PTR queries from the hosts file
+ *   (/etc/hosts by default) where it has an entry for the name or
+ *   address, and answer forward queries for address literals
+ *   directly, without asking a nameserver.  The file is reread when
+ *   it changes.  This is the same as the adns_if_hosts init flag.
+ *
+ *  adns_connectudp
+ *   Give each of the first 8 nameservers its own connected UDP
+ *   socket.  The kernel then discards datagrams from anywhere else,
+ *   and an ICMP error from a server makes adns go on to the next one
+ *   at once rather than waiting for the retry timeout.  This is the
+ *   same as the adns_if_connectudp init flag.
+ *
+ *  adns_tcpfastopen
+ *   Use TCP Fast Open (on Linux, TCP_FASTOPEN_CONNECT) for TCP
+ *   connections to nameservers, so that after the first connection
+ *   the queued queries go out with the SYN.  Servers which do not
+ *   support it just get an ordinary handshake.  Ignored where the OS
+ *   lacks it, and in Tor mode.  This is the same as the
+ *   adns_if_tcpfastopen init flag.
+ *
+ *  adns_rcvbuf:<bytes>
+ *  adns_sndbuf:<bytes>
+ *   Set the kernel receive or send buffer size (SO_RCVBUF or
+ *   SO_SNDBUF) of adns's UDP sockets.  A program sending many
+ *   queries at once may need a larger receive buffer, or replies
+ *   will be dropped and the queries only retried after a timeout.
+ *   The kernel may round or limit the value.
+ *
+ *  adns_cwnd:<max>
+ *   Limit the number of UDP queries outstanding at once to a
+ *   congestion window of at most <max> (at least 4), which starts at
+ *   16, grows while replies come back promptly and is halved when
+ *   queries time out.  Further new queries wait inside adns until
+ *   there is room, so a program can submit as many as it likes
+ *   without swamping the nameservers.  The default is no limit.
+ *
+ *  adns_udpdrops
+ *   Ask the kernel (on Linux, with SO_RXQ_OVFL) to report how many
+ *   datagrams it has dropped for lack of buffer space, which are
+ *   counted by adns_udpdrops.  When it reports some, queries which
+ *   were sent more than a fraction of the retry timeout ago are sent
+ *   again at once, since their replies may have been among those
+ *   lost.  Ignored where the OS lacks it.  This is the same as the
+ *   adns_if_udpdrops init flag.
+ *
+ *  adns_maxmem:<bytes>
+ *   Refuse new queries, with ENOBUFS from adns_submit and friends,
+ *   while the memory held by outstanding queries and by answers not
+ *   yet collected (as reported by adns_memused) is at least <bytes>.
+ *   Queries already submitted, and the queries adns makes on their
+ *   behalf, are not affected.  The default is no limit.
  *
  * There are a number of environment variables which can modify the
  * behaviour of adns.  They take effect only if adns_init is used, and
@@ -571,6 +736,22 @@ int adns_submit(adns_state ads,
 
 /* The owner should be quoted in master file format. */
 
+int adns_submit_deadline(adns_state ads,
+			 const char *owner,
+			 adns_rrtype type,
+			 adns_queryflags flags,
+			 void *context,
+			 const struct timeval *deadline,
+			 adns_query *query_r);
+/* Like adns_submit, but if deadline is not 0 the query will give up
+ * and complete with adns_s_timeout at that (absolute) time, on the
+ * same clock as now (see adns_if_monotonic), if it has not finished
+ * by then.  This includes any further lookups adns makes on the
+ * query's behalf (eg for adns_r_ptr or adns_r_addr).  The deadline is
+ * honoured by adns_firsttimeout and friends, as for adns's own
+ * timeouts, so it is met only as well as the event loop calls adns.
+ */
+
 int adns_check(adns_state ads,
 	       adns_query *query_io,
 	       adns_answer **answer_r,
@@ -598,7 +779,7 @@ void adns_cancel(adns_query query);
  * query handles until you next call _query or _transact.
  *
  * _submit and _synchronous return ENOSYS if they don't understand the
- * query type.
+ * query type, and ENOBUFS if the adns_maxmem limit has been reached.
  */
 
 int adns_submit_reverse(adns_state ads,
@@ -624,11 +805,122 @@ int adns_submit_reverse_any(adns_state ads,
  * addr->sa_family must be AF_INET or you get ENOSYS.
  */
 
+int adns_prepare(adns_state ads,
+		 const char *owner,
+		 adns_rrtype type,
+		 adns_queryflags flags,
+		 adns_prepared *prepared_r);
+int adns_prepare_wire(adns_state ads,
+		      const unsigned char *qname, int qnamelen,
+		      adns_rrtype type,
+		      adns_queryflags flags,
+		      adns_prepared *prepared_r);
+int adns_submit_prepared(adns_state ads,
+			 adns_prepared prepared,
+			 void *context,
+			 adns_query *query_r);
+void adns_prepared_free(adns_prepared prepared);
+/* For applications which look up the same names over and over again.
+ * adns_prepare checks and encodes the question once; each
+ * adns_submit_prepared then only needs to allocate a new query id, so
+ * it is much cheaper than adns_submit.  The result is otherwise just
+ * as if adns_submit had been called with the same arguments, except
+ * that _qf_search is ignored.
+ *
+ * adns_prepare_wire is the same, but takes the owner as a domain in
+ * DNS wire format (a sequence of length-prefixed labels ending with
+ * the root label, qnamelen bytes in all, with no compression).
+ *
+ * If the owner is not valid this is not reported by _prepare; instead
+ * every query submitted with the prepared question will fail, as it
+ * would with adns_submit.  _prepare and _prepare_wire return ENOSYS
+ * if they don't understand the query type, or ENOMEM.
+ *
+ * A prepared question may only be used with the adns_state it was
+ * prepared for, but may be submitted any number of times and remains
+ * valid until passed to adns_prepared_free (which may be done at any
+ * time, even after adns_finish).
+ */
+
 void adns_finish(adns_state ads);
 /* You may call this even if you have queries outstanding;
  * they will be cancelled.
  */
 
+unsigned long adns_udpdrops(adns_state ads);
+/* Returns the number of datagrams which the kernel has so far
+ * reported dropping on adns's UDP sockets, because the receive
+ * buffer was full.  Always 0 unless adns_if_udpdrops (or the
+ * adns_udpdrops option) is in effect and the OS supports it.  See
+ * also the adns_rcvbuf option.  Never fails or blocks.
+ */
+
+#define ADNS_STATS_NCLASSES 7
+#define ADNS_STATS_LATBUCKETS 16
+
+typedef struct {
+  unsigned long submitted, completed[ADNS_STATS_NCLASSES];
+  unsigned long udpsends, udpretries, tcpfallbacks;
+  unsigned long tcpconnects, tcpfailures, unmatched;
+  int nudpw, ncwndw, ntcpw, nchildw, noutput, nservers;
+} adns_stats;
+
+typedef struct {
+  unsigned long udpsends, replies, latency[ADNS_STATS_LATBUCKETS];
+} adns_serverstats;
+
+void adns_getstats(adns_state ads, adns_stats *stats_r);
+int adns_getserverstats(adns_state ads, int serv, adns_serverstats *stats_r);
+/* Counters since adns_init.  submitted and completed count the
+ * queries submitted by the caller (not those adns makes for itself)
+ * and those which have finished, indexed by status class in the
+ * order ok, localfail, remotefail, tempfail, misconfig, misquery,
+ * permfail (see adns_errtypeabbrev).  udpsends includes the
+ * udpretries which were retransmissions; tcpfallbacks counts
+ * truncated replies which made a query switch to TCP; unmatched
+ * counts replies which did not match any outstanding query.  The
+ * n... fields are the current lengths of the internal queues, and
+ * the number of nameservers.
+ *
+ * adns_getserverstats gives the figures for nameserver serv (from 0,
+ * in the order they were configured), or returns EINVAL if there is
+ * no such server.  latency[0] counts replies which took less than
+ * 1ms after the datagram they answer was sent; latency[i] those
+ * which took at least 2^(i-1)ms but less than 2^i ms, except that
+ * the last bucket has no upper limit.  Only replies from the server
+ * to which the query was last sent are timed.
+ *
+ * Neither function blocks; the counters cost only an increment each.
+ */
+
+unsigned long adns_memused(adns_state ads);
+/* Returns the number of bytes adns currently holds for outstanding
+ * queries, including finished ones whose answers have not yet been
+ * collected with adns_check or adns_wait.  Its scratch buffers are
+ * not counted.  See also the adns_maxmem option.  Never fails or
+ * blocks.
+ */
+
+int adns_capture(adns_state ads, FILE *file);
+/* Starts recording the queries submitted to ads and the datagrams it
+ * sends and receives to file, in a compact binary form which
+ * adnsreplay can play back; file=0 stops recording.  adns writes
+ * with fwrite and never closes file, but flushes it when recording
+ * stops or ads is finished.  Returns 0, or an errno value if the
+ * header could not be written.  If a later write fails, adns reports
+ * it through the usual diagnostics and stops recording.
+ *
+ * The file is the 8 bytes "ADNSCAP1" followed by records, each a
+ * kind byte, then the time (as adns saw it) as 32-bit seconds and
+ * microseconds, and then:
+ *   'Q' (query submitted): 32-bit type, 32-bit flags, 16-bit owner
+ *       length and the owner, as passed to adns_submit
+ *   'S' (datagram sent), 'R' (datagram received): 16-bit server
+ *       index, 8-bit 1 for TCP or 0 for UDP, 16-bit length and the
+ *       DNS message
+ * All numbers are unsigned and big-endian.
+ */
+
 
 void adns_forallqueries_begin(adns_state ads);
 adns_query adns_forallqueries_next(adns_state ads, void **context_r);
@@ -712,14 +1004,26 @@ void adns_processtimeouts(adns_state ads, const struct timeval *now);
  * which might have happened.  Very like _processreadable/writeable.
  *
  * now may be 0; if it isn't, *now must be the current time, recently
- * obtained from gettimeofday.
+ * obtained from gettimeofday (but see adns_if_monotonic).
+ */
+
+int adns_inject_reply(adns_state ads, int serv, int viatcp,
+		      const void *msg, int len);
+/* Gives adns a reply from nameserver serv, for a state made with
+ * adns_init_transport.  msg is one DNS message (for TCP, without the
+ * length prefix); viatcp says whether it answers a query passed to
+ * tcpsendfn.  The reply is processed as if it had just been read from
+ * a socket, and any queries it completes become available from
+ * adns_check.  Returns EINVAL if serv is out of range or the state
+ * has no transport, otherwise 0.
  */
 
 void adns_firsttimeout(adns_state ads,
 		       struct timeval **tv_mod, struct timeval *tv_buf,
 		       struct timeval now);
 /* Asks adns when it would first like the opportunity to time
- * something out.  now must be the current time, from gettimeofday.
+ * something out.  now must be the current time, from gettimeofday
+ * (but see adns_if_monotonic).
  *
  * If tv_mod points to 0 then tv_buf must be non-null, and
  * _firsttimeout will fill in *tv_buf with the time until the first
@@ -901,8 +1205,9 @@ adns_status adns_rr_info(adns_rrtype type,
  * The representation is in two parts: first, a word for the address
  * family (ie, in AF_XXX, the XXX), and then one or more items for the
  * address itself, depending on the format.  For an IPv4 address the
- * syntax is INET followed by the dotted quad (from inet_ntoa).
- * Currently only IPv4 is supported.
+ * syntax is INET followed by the dotted quad (from inet_ntoa).  For
+ * an IPv6 address it is INET6 followed by the usual textual form
+ * (from inet_ntop).
  *
  * Text strings (as in adns_rr_txt) appear inside double quotes, and
  * use \" and \\ to represent " and \, and \xHH to represent
@@ -942,6 +1247,12 @@ void adns_free(void *p);
  * libraries.
  */
 
+void adns_freeanswer(adns_state ads, adns_answer *answer);
+/* Frees an answer returned by adns_check, adns_wait or
+ * adns_synchronous on ads, using its allocator (see adns_init_alloc).
+ * answer may be 0.  ads must not yet have been passed to adns_finish.
+ */
+
 
 #ifdef __cplusplus
 } /* end of extern "C" */
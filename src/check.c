@@ -63,21 +63,88 @@ static void checkc_query(adns_state ads, adns_query qu) {
   adns_query child;
 
   assert(qu->udpnextserver < ads->nservers);
-  assert(!(qu->udpsent & (~0UL << ads->nservers)));
+  assert(qu->udpfirstserver < ads->nservers);
+  assert(qu->udpserver < ads->nservers);
   assert(qu->search_pos <= ads->nsearchlist);
   if (qu->parent) DLIST_ASSERTON(qu, child, qu->parent->children, siblings.);
 }
 
-static void checkc_notcpbuf(adns_state ads) {
-  assert(!ads->tcpsend.used);
-  assert(!ads->tcprecv.used);
-  assert(!ads->tcprecv_skip);
+static void checkc_notcpbuf(const struct adns__tcpconn *tc) {
+  assert(!tc->tcpsend.used);
+  assert(!tc->tcpsend_skip);
+  assert(!tc->tcprecv.used);
+  assert(!tc->tcprecv_skip);
+}
+
+static void checkc_tcpconn(adns_state ads, const struct adns__tcpconn *tc) {
+  adns_query qu;
+  int n;
+
+  assert(tc->tcpserver >= 0 && tc->tcpserver < ads->nservers);
+
+  switch (tc->tcpstate) {
+  case server_connecting:
+    assert(tc->tcpsocket >= 0);
+    checkc_notcpbuf(tc);
+    assert(tc->sockssent <= tc->sockslen);
+    assert(tc->sockslen <= (int)sizeof(tc->socksbuf));
+    assert(tc->socksgot <= (int)sizeof(tc->socksbuf));
+    assert(!tc->sockslen || !tc->socksgot);
+    break;
+  case server_disconnected:
+  case server_broken:
+    assert(tc->tcpsocket == -1);
+    checkc_notcpbuf(tc);
+    assert(tc->socksstate == socks_none);
+    break;
+  case server_ok:
+    assert(tc->tcpsocket >= 0);
+    assert(tc->tcprecv_skip <= tc->tcprecv.used);
+    assert(tc->tcpsend_skip < tc->tcpsend.used || !tc->tcpsend.used);
+    assert(tc->socksstate == socks_none);
+    break;
+  default:
+    assert(!"tc->tcpstate value");
+  }
+
+  for (n=0, qu= ads->tcpw.head; qu; qu= qu->next)
+    if (&ads->tcpconns[qu->tcpconn] == tc) n++;
+  assert(tc->nqueries == n);
+}
+
+static void checkc_server(adns_state ads, int serv) {
+  const struct server *ss= &ads->servers[serv];
+  adns_query qu;
+  int n;
+
+  if (ss->addr.sa.sa_family == AF_INET6) assert(ads->udpsocket6 >= 0);
+  assert(ss->weight >= 1);
+  if ((ads->iflags & adns_if_connectudp) && serv < MAXUDPCONNS)
+    assert(ss->udpsocket >= 0);
+  else
+    assert(ss->udpsocket == -1);
+
+  for (n=0, qu= ads->udpw.head; qu; qu= qu->next)
+    if (qu->udpserver == serv) n++;
+  assert(ss->nqueries == n);
 }
 
 static void checkc_global(adns_state ads) {
-  int i, j;
+  int i, j, n;
 
   assert(ads->udpsocket >= 0);
+  assert(ads->nservers <= ads->aservers);
+  for (i=0, n=0; i<ads->nservers; i++) {
+    checkc_server(ads,i);
+    n += ads->servers[i].nqueries;
+  }
+  assert(ads->udpinflight == n);
+  assert(ads->serverselectnext < ads->nservers);
+  if (ads->cwndmax)
+    assert(ads->cwnd >= CWNDMIN || ads->cwnd == ads->cwndmax);
+  else
+    assert(!ads->cwndw.head);
+  assert(ads->cwnd <= ads->cwndmax);
 
   for (i=0; i<ads->nsortlist; i++)
     {
@@ -93,25 +160,10 @@ static void checkc_global(adns_state ads) {
                  & ~ads->sortlist[i].mask.u.v4.s_addr));
     }
 
-  assert(ads->tcpserver >= 0 && ads->tcpserver < ads->nservers);
-
-  switch (ads->tcpstate) {
-  case server_connecting:
-    assert(ads->tcpsocket >= 0);
-    checkc_notcpbuf(ads);
-    break;
-  case server_disconnected:
-  case server_broken:
-    assert(ads->tcpsocket == -1);
-    checkc_notcpbuf(ads);
-    break;
-  case server_ok:
-    assert(ads->tcpsocket >= 0);
-    assert(ads->tcprecv_skip <= ads->tcprecv.used);
-    break;
-  default:
-    assert(!"ads->tcpstate value");
-  }
+  assert(ads->ntcpconns >= 1 && ads->ntcpconns <= MAXTCPCONNS);
+  for (i=0; i<ads->ntcpconns; i++)
+    checkc_tcpconn(ads,&ads->tcpconns[i]);
+  assert(ads->nsockscreds >= 0 && ads->nsockscreds <= MAXTCPCONNS);
 
   assert(ads->searchlist || !ads->nsearchlist);
 }
@@ -122,29 +174,64 @@ static void checkc_queue_udpw(adns_state ads) {
   DLIST_CHECK(ads->udpw, qu, , {
     assert(qu->state==query_tosend);
     assert(qu->retries <= UDPMAXRETRIES);
-    assert(qu->udpsent);
+    assert(qu->udpnsent);
     assert(!qu->children.head && !qu->children.tail);
     checkc_query(ads,qu);
     checkc_query_alloc(ads,qu);
   });
 }
 
+static void checkc_queue_cwndw(adns_state ads) {
+  adns_query qu;
+  int n[prio_count], i;
+
+  for (i=0; i<prio_count; i++) n[i]= 0;
+  DLIST_CHECK(ads->cwndw, qu, , {
+    assert(qu->state==query_cwndw);
+    assert(!qu->udpnsent);
+    assert(qu->prio >= 0 && qu->prio < prio_count);
+    n[qu->prio]++;
+    assert(!qu->children.head && !qu->children.tail);
+    checkc_query(ads,qu);
+    checkc_query_alloc(ads,qu);
+  });
+  for (i=0; i<prio_count; i++) {
+    assert(n[i] == ads->cwndwprio[i]);
+    n[i]= 0;
+    DLIST_CHECK(ads->cwndwq[i], qu, cwndwclass., {
+      assert(qu->state==query_cwndw);
+      assert(qu->prio == i);
+      n[i]++;
+    });
+    assert(n[i] == ads->cwndwprio[i]);
+  }
+  assert(ads->cwndskips <= PRIOSKIPMAX);
+}
+
 static void checkc_queue_tcpw(adns_state ads) {
   adns_query qu;
+  int n;
 
+  n= 0;
   DLIST_CHECK(ads->tcpw, qu, , {
+    n++;
     assert(qu->state==query_tcpw);
+    assert(qu->tcpconn >= 0 && qu->tcpconn < ads->ntcpconns);
     assert(!qu->children.head && !qu->children.tail);
     assert(qu->retries <= ads->nservers+1);
     checkc_query(ads,qu);
     checkc_query_alloc(ads,qu);
   });
+  assert(n == ads->ntcpw);
 }
 
 static void checkc_queue_childw(adns_state ads) {
   adns_query parent, child;
+  int n;
 
+  n= 0;
   DLIST_CHECK(ads->childw, parent, , {
+    n++;
     assert(parent->state == query_childw);
     assert(parent->children.head);
     DLIST_CHECK(parent->children, child, siblings., {
@@ -154,18 +241,45 @@ static void checkc_queue_childw(adns_state ads) {
     checkc_query(ads,parent);
     checkc_query_alloc(ads,parent);
   });
+  assert(n == ads->nchildw);
 }
 
 static void checkc_queue_output(adns_state ads) {
   adns_query qu;
+  int n;
 
+  n= 0;
   DLIST_CHECK(ads->output, qu, , {
+    n++;
     assert(qu->state == query_done);
     assert(!qu->children.head && !qu->children.tail);
     assert(!qu->parent);
     assert(!qu->allocations.head && !qu->allocations.tail);
     checkc_query(ads,qu);
   });
+  assert(n == ads->noutput);
+}
+
+static size_t checkc_queue_mem(const struct query_queue *queue) {
+  adns_query qu;
+  allocnode *an;
+  size_t n;
+
+  n= 0;
+  for (qu= queue->head; qu; qu= qu->next) {
+    n += qu->memused;
+    for (an= qu->allocations.head; an; an= an->next) n += an->sz;
+  }
+  return n;
+}
+
+static void checkc_memused(adns_state ads) {
+  /* Not equality: a child query which has just finished is on no
+   * queue while its parent's callback runs, and that may cancel
+   * another query. */
+  assert(checkc_queue_mem(&ads->udpw) + checkc_queue_mem(&ads->cwndw) +
+	 checkc_queue_mem(&ads->tcpw) + checkc_queue_mem(&ads->childw) +
+	 checkc_queue_mem(&ads->output) <= ads->memused);
 }
 
 void adns__consistency(adns_state ads, adns_query qu, consistency_checks cc) {
@@ -186,15 +300,20 @@ void adns__consistency(adns_state ads, adns_query qu, consistency_checks cc) {
 
   checkc_global(ads);
   checkc_queue_udpw(ads);
+  checkc_queue_cwndw(ads);
   checkc_queue_tcpw(ads);
   checkc_queue_childw(ads);
   checkc_queue_output(ads);
+  checkc_memused(ads);
 
   if (qu) {
     switch (qu->state) {
     case query_tosend:
       DLIST_ASSERTON(qu, search, ads->udpw, );
       break;
+    case query_cwndw:
+      DLIST_ASSERTON(qu, search, ads->cwndw, );
+      break;
     case query_tcpw:
       DLIST_ASSERTON(qu, search, ads->tcpw, );
       break;
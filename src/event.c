@@ -31,12 +31,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <time.h>
+
 #include <sys/types.h>
 #include <sys/time.h>
 #ifndef HAVE_W32_SYSTEM
 # include <netdb.h>
 # include <sys/socket.h>
 # include <netinet/in.h>
+# include <netinet/tcp.h>
 # include <arpa/inet.h>
 #endif
 
@@ -75,56 +78,74 @@
 
 /* TCP connection management. */
 
-static void tcp_close(adns_state ads) {
-  adns__sock_close(ads->tcpsocket);
-  ads->tcpsocket= -1;
-  ads->tcprecv.used= ads->tcprecv_skip= ads->tcpsend.used= 0;
+static void tcp_close(struct adns__tcpconn *tc) {
+  adns__sock_close(tc->tcpsocket);
+  tc->tcpsocket= -1;
+  tc->tcprecv.used= tc->tcprecv_skip= 0;
+  tc->tcpsend.used= tc->tcpsend_skip= 0;
+  WIPEMEMORY(tc->socksbuf,sizeof(tc->socksbuf));
+  tc->socksstate= socks_none;
+  tc->sockslen= tc->sockssent= tc->socksgot= 0;
 }
 
-void adns__tcp_broken(adns_state ads, const char *what, const char *why) {
+void adns__tcp_broken(adns_state ads, struct adns__tcpconn *tc,
+		      const char *what, const char *why) {
   int serv;
   adns_query qu;
 
-  assert(ads->tcpstate == server_connecting || ads->tcpstate == server_ok);
-  serv= ads->tcpserver;
-  if (what) adns__warn(ads,serv,0,"TCP connection failed: %s: %s",what,why);
+  assert(tc->tcpstate == server_connecting || tc->tcpstate == server_ok);
+  serv= tc->tcpserver;
+  if (what) {
+    adns__warn(ads,serv,0,"TCP connection failed: %s: %s",what,why);
+    ads->stats.tcpfailures++;
+  }
 
-  if (ads->tcpstate == server_connecting) {
-    /* Counts as a retry for all the queries waiting for TCP. */
+  if (tc->tcpstate == server_connecting) {
+    /* Counts as a retry for all the queries waiting for it. */
     for (qu= ads->tcpw.head; qu; qu= qu->next)
-      qu->retries++;
+      if (&ads->tcpconns[qu->tcpconn] == tc) qu->retries++;
   }
 
-  tcp_close(ads);
-  ads->tcpstate= server_broken;
-  ads->tcpserver= (serv+1)%ads->nservers;
+  tcp_close(tc);
+  tc->tcpstate= server_broken;
+  tc->tcpserver= (serv+1)%ads->nservers;
 }
 
-static void tcp_connected(adns_state ads, struct timeval now) {
+static void tcp_connected(adns_state ads, struct adns__tcpconn *tc,
+			  struct timeval now) {
   adns_query qu, nqu;
-
-  adns__debug(ads,ads->tcpserver,0,"TCP connected");
-  ads->tcpstate= server_ok;
-  for (qu= ads->tcpw.head; qu && ads->tcpstate == server_ok; qu= nqu) {
-    nqu= qu->next;
-    assert(qu->state == query_tcpw);
-    adns__querysend_tcp(qu,now);
+  query_prio prio;
+
+  adns__debug(ads,tc->tcpserver,0,"TCP connected");
+  tc->tcpstate= server_ok;
+  ads->stats.tcpconnects++;
+  /* Best priority class first: they go out in this order. */
+  for (prio= prio_interactive; prio < prio_count; prio++) {
+    for (qu= ads->tcpw.head; qu && tc->tcpstate == server_ok; qu= nqu) {
+      nqu= qu->next;
+      assert(qu->state == query_tcpw);
+      if (&ads->tcpconns[qu->tcpconn] != tc || qu->prio != prio) continue;
+      adns__querysend_tcp(qu,now);
+    }
   }
 }
 
-static void tcp_broken_events(adns_state ads) {
+static void tcp_broken_events(adns_state ads, struct adns__tcpconn *tc) {
   adns_query qu, nqu;
 
-  assert(ads->tcpstate == server_broken);
+  assert(tc->tcpstate == server_broken);
   for (qu= ads->tcpw.head; qu; qu= nqu) {
     nqu= qu->next;
     assert(qu->state == query_tcpw);
+    if (&ads->tcpconns[qu->tcpconn] != tc) continue;
     if (qu->retries > ads->nservers) {
       LIST_UNLINK(ads->tcpw,qu);
+      ads->ntcpw--;
+      tc->nqueries--;
       adns__query_fail(qu,adns_s_allservfail);
     }
   }
-  ads->tcpstate= server_disconnected;
+  tc->tcpstate= server_disconnected;
 }
 
 
@@ -164,233 +185,317 @@ use_socks_p (adns_state ads, const struct sockaddr *addr)
     return 0;
 }
 
+static int tcp_socket(adns_state ads, int af) {
+  /* Returns a new nonblocking TCP socket in address family af, or -1
+   * having reported the problem.
+   */
+  struct protoent *proto;
+  int fd, r;
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+  int one;
+#endif
 
-/* Connect to TOR using the SOCKS5 protocol.  We assume that the
-   connection to the SOCKS proxy (TOR server) does not block; if it
-   would block we return and the the usual retry logic of the caller
-   kicks in.  */
-static int
-socks_connect (adns_state ads, int fd,
-               const struct sockaddr *addr, socklen_t length)
-{
-  int ret;
-  struct sockaddr_in  proxyaddr_in;
-  struct sockaddr *proxyaddr;
-  size_t proxyaddrlen;
-  struct sockaddr_in6 *addr_in6;
-  struct sockaddr_in  *addr_in;
-  unsigned char buffer[22+512]; /* The extra 512 bytes is used as
-                                   space for username:password.  */
-  size_t buflen;
-  int method;
-
-  memset (&proxyaddr_in, 0, sizeof proxyaddr_in);
-
-  /* Connect to local host.  */
-  /* Fixme: First try to use IPv6.  */
-  proxyaddr_in.sin_family = AF_INET;
-  proxyaddr_in.sin_port = htons (9050);
-  proxyaddr_in.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
-  proxyaddr = (struct sockaddr *)&proxyaddr_in;
-  proxyaddrlen = sizeof proxyaddr_in;
-  ret = adns__sock_connect(fd, proxyaddr, proxyaddrlen);
-  if (ret && errno == ECONNREFUSED)
-    {
-      /* Assume the Tor browser is used.  */
-      proxyaddr_in.sin_port = htons (9150);
-      ret = adns__sock_connect(fd, proxyaddr, proxyaddrlen);
-    }
-  if (ret)
-    return ret;
-
-  /* Negotiate method.  */
-  buffer[0] = 5; /* RFC-1928 VER field.  */
-  buffer[1] = 1; /* NMETHODS */
-  if (ads->sockscred)
-    method = 2;  /* Method: username/password authentication. */
-  else
-    method = 0;  /* Method: No authentication required. */
-  buffer[2] = method;
-  adns__sigpipe_protect(ads);
-  ret = adns__sock_write(fd, buffer, 3);
-  adns__sigpipe_unprotect(ads);
-  if (ret != 3)
-    {
-      if (ret >= 0)
-        errno = EIO;
-      return -1;
-    }
-  ret = adns__sock_read(fd, buffer, 2);
-  if (ret < 0)
-    return ret;
-  if (ret != 2 || buffer[0] != 5 || buffer[1] != method )
-    {
-      /* Socks server returned wrong version or does not support our
-         requested method.  */
-      errno = ENOTSUP; /* Fixme: Is there a better errno? */
+  if (ads->tcpproto < 0) {
+    proto= getprotobyname("tcp");
+    if (!proto) {
+      adns__diag(ads,-1,0,"unable to find protocol no. for TCP !");
       return -1;
     }
+    ads->tcpproto= proto->p_proto;
+  }
+  fd= adns__sock_socket(af,SOCK_STREAM,ads->tcpproto);
+  if (fd<0) {
+    adns__diag(ads,-1,0,"cannot create TCP socket: %s",strerror(errno));
+    return -1;
+  }
+  r= adns__setnonblock(ads,fd);
+  if (r) {
+    adns__diag(ads,-1,0,"cannot make TCP socket nonblocking:"
+	       " %s",strerror(r));
+    adns__sock_close(fd);
+    return -1;
+  }
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+  one= 1;
+  if (adns__sock_setsockopt(fd,SOL_SOCKET,SO_NOSIGPIPE,&one,sizeof(one))) {
+    adns__diag(ads,-1,0,"cannot set SO_NOSIGPIPE on TCP socket:"
+	       " %s",strerror(errno));
+    adns__sock_close(fd);
+    return -1;
+  }
+#endif
+  return fd;
+}
 
-  if (ads->sockscred)
-    {
-      /* Username/Password sub-negotiation.  */
-      const char *password;
-      int ulen, plen;
-
-      password = strchr (ads->sockscred, ':');
-      if (!password)
-        {
-          errno = EINVAL; /* No password given.  */
-          return -1;
-        }
-      ulen = password - ads->sockscred;
-      password++;
-      plen = strlen (password);
-      if (!ulen || ulen > 255 || !plen || plen > 255)
-        {
-          errno = EINVAL; /* Credentials too long or too short.  */
-          return -1;
-        }
-
-      buffer[0] = 1; /* VER of the sub-negotiation. */
-      buffer[1] = ulen;
-      buflen = 2;
-      memcpy (buffer+buflen, ads->sockscred, ulen);
-      buflen += ulen;
-      buffer[buflen++] = plen;
-      memcpy (buffer+buflen, password, plen);
-      buflen += plen;
-      adns__sigpipe_protect(ads);
-      ret = adns__sock_write(fd, buffer, buflen);
-      adns__sigpipe_unprotect(ads);
-      WIPEMEMORY (buffer, buflen);
-      if (ret != buflen)
-        {
-          if (ret >= 0)
-            errno = EIO;
-          return -1;
-        }
-      ret = adns__sock_read(fd, buffer, 2);
-      if (ret != 2)
-        {
-          if (ret >= 0)
-            errno = EIO;
-          return -1;
-        }
-      if (buffer[0] != 1)
-        {
-          /* SOCKS server returned wrong version.  */
-          errno = EPROTO;
-          return -1;
-        }
-      if (buffer[1])
-        {
-          /* SOCKS server denied access.  */
-          errno = EACCES;
-          return -1;
-        }
+/* SOCKS5 (RFC-1928) handshake with the Tor proxy.  This runs while
+   tcpstate is server_connecting, one message at a time, driven by
+   adns_processwriteable and adns_processreadable; see the comment on
+   socksstate in internal.h.  */
+
+static int socks_awaitingreply(const struct adns__tcpconn *tc) {
+  return (tc->socksstate != socks_none &&
+	  tc->socksstate != socks_connecting &&
+	  !tc->sockslen);
+}
+
+static int socks_send(adns_state ads, struct adns__tcpconn *tc) {
+  /* Returns 0 or an errno value for resource exhaustion, like
+   * adns_processwriteable. */
+  int r;
+
+  while (tc->sockssent < tc->sockslen) {
+    r= adns__tcp_write(ads,tc->tcpsocket,tc->socksbuf+tc->sockssent,
+		       tc->sockslen-tc->sockssent);
+    if (r<0) {
+      if (errno==EINTR) continue;
+      if (errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+      if (errno_resources(errno)) return errno;
+      adns__tcp_broken(ads,tc,"SOCKS5 write",strerror(errno));
+      return 0;
     }
+    tc->sockssent+= r;
+  }
+  /* The message may have contained the credentials. */
+  WIPEMEMORY(tc->socksbuf,tc->sockslen);
+  tc->sockslen= tc->sockssent= 0;
+  return 0;
+}
 
-  /* Send request details (rfc-1928, 4).  */
-  buffer[0] = 5; /* VER  */
-  buffer[1] = 1; /* CMD = CONNECT  */
-  buffer[2] = 0; /* RSV  */
-  if (addr->sa_family == AF_INET6)
-    {
-      addr_in6 = (struct sockaddr_in6 *)addr;
+static const char *socks_cred(adns_state ads,
+			      const struct adns__tcpconn *tc) {
+  if (!ads->nsockscreds) return 0;
+  return ads->sockscred[(tc - ads->tcpconns) % ads->nsockscreds];
+}
 
-      buffer[3] = 4; /* ATYP = IPv6 */
-      memcpy (buffer+ 4, &addr_in6->sin6_addr.s6_addr, 16); /* DST.ADDR */
-      memcpy (buffer+20, &addr_in6->sin6_port, 2);          /* DST.PORT */
-      buflen = 22;
+static void socks_message(adns_state ads, struct adns__tcpconn *tc) {
+  /* Composes the message for the current socksstate and starts
+   * sending it. */
+  byte *buf= tc->socksbuf;
+  const char *cred= socks_cred(ads,tc), *password;
+  const struct server *ss;
+  int ulen, plen;
+
+  switch (tc->socksstate) {
+  case socks_method:
+    buf[0]= 5; /* VER */
+    buf[1]= 1; /* NMETHODS */
+    buf[2]= cred ? 2 /* username/password */ : 0 /* none */;
+    tc->sockslen= 3;
+    break;
+  case socks_auth:
+    /* Username/password sub-negotiation (RFC-1929). */
+    password= strchr(cred,':');
+    ulen= password ? password - cred : 0;
+    plen= password ? strlen(password+1) : 0;
+    if (!ulen || ulen > 255 || !plen || plen > 255) {
+      adns__tcp_broken(ads,tc,"SOCKS5","unusable adns_sockscred");
+      return;
     }
-  else
-    {
-      addr_in = (struct sockaddr_in *)addr;
+    buf[0]= 1; /* VER */
+    buf[1]= ulen;
+    memcpy(buf+2,cred,ulen);
+    buf[2+ulen]= plen;
+    memcpy(buf+3+ulen,password+1,plen);
+    tc->sockslen= 3+ulen+plen;
+    break;
+  case socks_request:
+    ss= &ads->servers[tc->tcpserver];
+    buf[0]= 5; /* VER */
+    buf[1]= 1; /* CMD = CONNECT */
+    buf[2]= 0; /* RSV */
+    if (ss->addr.sa.sa_family == AF_INET6) {
+      buf[3]= 4; /* ATYP = IPv6 */
+      memcpy(buf+4,&ss->addr.inet6.sin6_addr,16);
+      memcpy(buf+20,&ss->addr.inet6.sin6_port,2);
+      tc->sockslen= 22;
+    } else {
+      buf[3]= 1; /* ATYP = IPv4 */
+      memcpy(buf+4,&ss->addr.inet.sin_addr,4);
+      memcpy(buf+8,&ss->addr.inet.sin_port,2);
+      tc->sockslen= 10;
+    }
+    break;
+  default:
+    abort();
+  }
+  tc->sockssent= tc->socksgot= 0;
+  socks_send(ads,tc);
+}
+
+static int socks_replylen(const struct adns__tcpconn *tc) {
+  /* Returns the length of the reply we are waiting for, as far as we
+   * can tell from the socksgot bytes we have so far. */
+  if (tc->socksstate != socks_request) return 2;
+  if (tc->socksgot < 5) return 5;
+  switch (tc->socksbuf[3]) { /* ATYP */
+  case 1: return 10;
+  case 3: return 7+tc->socksbuf[4];
+  case 4: return 22;
+  default: return 5;
+  }
+}
+
+static const char *socks_strerror(int rep) {
+  switch (rep) {
+  case 0x01: return "general SOCKS server failure";
+  case 0x02: return "connection not allowed by ruleset";
+  case 0x03: return "network unreachable";
+  case 0x04: return "host unreachable";
+  case 0x05: return "connection refused";
+  case 0x06: return "TTL expired";
+  case 0x07: return "command not supported";
+  case 0x08: return "address type not supported";
+  default: return "unknown SOCKS5 reply code";
+  }
+}
 
-      buffer[3] = 1; /* ATYP = IPv4 */
-      memcpy (buffer+4, &addr_in->sin_addr.s_addr, 4); /* DST.ADDR */
-      memcpy (buffer+8, &addr_in->sin_port, 2);        /* DST.PORT */
-      buflen = 10;
+static void socks_reply(adns_state ads, struct adns__tcpconn *tc,
+			struct timeval now) {
+  const byte *buf= tc->socksbuf;
+  const char *cred= socks_cred(ads,tc);
+
+  switch (tc->socksstate) {
+  case socks_method:
+    if (buf[0] != 5 || buf[1] != (cred ? 2 : 0)) {
+      adns__tcp_broken(ads,tc,"SOCKS5","proxy refused our method");
+      return;
     }
-  adns__sigpipe_protect(ads);
-  ret = adns__sock_write(fd, buffer, buflen);
-  adns__sigpipe_unprotect(ads);
-  if (ret != buflen)
-    {
-      if (ret >= 0)
-        errno = EIO;
-      return -1;
+    tc->socksstate= cred ? socks_auth : socks_request;
+    break;
+  case socks_auth:
+    if (buf[0] != 1) {
+      adns__tcp_broken(ads,tc,"SOCKS5","bad authentication reply");
+      return;
     }
-  ret = adns__sock_read(fd, buffer, 10 /*(v4 length)*/);
-  if (ret < 0)
-    return ret;
-  if (ret != buflen || buffer[0] != 5 || buffer[2] != 0 )
-    {
-      /* Socks server returned wrong version or the reserved field is
-         not zero.  */
-      errno = EPROTO;
-      return -1;
+    if (buf[1]) {
+      adns__tcp_broken(ads,tc,"SOCKS5","proxy denied access");
+      return;
     }
-  if (buffer[1])
-    {
-      switch (buffer[1])
-        {
-        case 0x01: /* general SOCKS server failure.  */
-          errno = ENETDOWN;
-          break;
-        case 0x02: /* connection not allowed by ruleset.  */
-          errno = EACCES;
-          break;
-        case 0x03: /* Network unreachable */
-          errno = ENETUNREACH;
-          break;
-        case 0x04: /* Host unreachable */
-          errno = EHOSTUNREACH;
-          break;
-        case 0x05: /* Connection refused */
-          errno = ECONNREFUSED;
-          break;
-        case 0x06: /* TTL expired */
-          errno = ETIMEDOUT;
-          break;
-        case 0x08: /* Address type not supported */
-          errno = EPROTONOSUPPORT;
-          break;
-        case 0x07: /* Command not supported */
-        default:
-          errno = ENOTSUP; /* Fixme: Is there a better errno? */
-          break;
-        }
-      return -1;
+    tc->socksstate= socks_request;
+    break;
+  case socks_request:
+    if (buf[0] != 5 || buf[2]) {
+      adns__tcp_broken(ads,tc,"SOCKS5","bad reply to CONNECT");
+      return;
     }
-  if (buffer[3] == 4)
-    {
-      /* ATYP indicates a v6 address.  We need to read the remaining
-         12 bytes to finialize the SOCKS5 intro.  */
-      ret = adns__sock_read(fd, buffer, 12 /*(v6-v4 length)*/);
-      if (ret != 12)
-        {
-          if (ret >= 0)
-            errno = EIO;
-          return -1;
-        }
+    if (buf[1]) {
+      adns__tcp_broken(ads,tc,"SOCKS5 CONNECT",socks_strerror(buf[1]));
+      return;
     }
+    if (buf[3] != 1 && buf[3] != 3 && buf[3] != 4) {
+      adns__tcp_broken(ads,tc,"SOCKS5","bad address type in reply");
+      return;
+    }
+    tc->socksstate= socks_none;
+    tc->socksgot= 0;
+    tcp_connected(ads,tc,now);
+    return;
+  default:
+    abort();
+  }
+  socks_message(ads,tc);
+}
 
-  /* FIXME: We have not way to store the actual address used by the
-     server.  */
+static int socks_recv(adns_state ads, struct adns__tcpconn *tc,
+		      struct timeval now) {
+  /* Returns 0 or an errno value for resource exhaustion, like
+   * adns_processreadable. */
+  int want, r;
 
-  return 0;
+  for (;;) {
+    want= socks_replylen(tc);
+    if (tc->socksgot >= want) {
+      socks_reply(ads,tc,now);
+      return 0;
+    }
+    r= adns__sock_read(tc->tcpsocket,tc->socksbuf+tc->socksgot,
+		       want-tc->socksgot);
+    if (r>0) {
+      tc->socksgot+= r;
+      continue;
+    }
+    if (r) {
+      if (errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+      if (errno==EINTR) continue;
+      if (errno_resources(errno)) return errno;
+    }
+    adns__tcp_broken(ads,tc,"SOCKS5 read",r?strerror(errno):"closed");
+    return 0;
+  }
+}
+
+static void socks_connected(adns_state ads, struct adns__tcpconn *tc) {
+  adns__debug(ads,tc->tcpserver,0,"connected to SOCKS5 proxy on port %d",
+	      tc->socksport);
+  tc->socksstate= socks_method;
+  socks_message(ads,tc);
 }
 
+static void socks_connect(adns_state ads, struct adns__tcpconn *tc);
 
-void adns__tcp_tryconnect(adns_state ads, struct timeval now) {
-  int r, fd, tries;
+static void socks_connectfailed(adns_state ads, struct adns__tcpconn *tc,
+				int e) {
+  int fd;
+
+  if (e == ECONNREFUSED && tc->socksport == SOCKS_PORT) {
+    /* Perhaps it is the Tor Browser's proxy instead. */
+    fd= tcp_socket(ads,AF_INET);
+    if (fd >= 0) {
+      adns__sock_close(tc->tcpsocket);
+      tc->tcpsocket= fd;
+      tc->socksport= SOCKS_ALTPORT;
+      socks_connect(ads,tc);
+      return;
+    }
+  }
+  adns__tcp_broken(ads,tc,"connect to SOCKS5 proxy",strerror(e));
+}
+
+static void socks_connect(adns_state ads, struct adns__tcpconn *tc) {
+  /* Starts connecting tcpsocket to the proxy on socksport. */
   struct sockaddr_in addr;
-  struct protoent *proto;
+  int r;
+
+  /* Fixme: First try to use IPv6.  */
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family= AF_INET;
+  addr.sin_port= htons(tc->socksport);
+  addr.sin_addr.s_addr= htonl(INADDR_LOOPBACK);
+  r= adns__sock_connect(tc->tcpsocket,(const struct sockaddr*)&addr,
+			sizeof(addr));
+  if (r==0) socks_connected(ads,tc);
+  else if (errno != EWOULDBLOCK && errno != EINPROGRESS)
+    socks_connectfailed(ads,tc,errno);
+}
+
+
+static void tcp_fastopen(adns_state ads, struct adns__tcpconn *tc) {
+  /* With TCP_FASTOPEN_CONNECT, if the kernel has a cookie for the
+   * server then connect succeeds at once and our first write goes out
+   * with the SYN; if it has none the connect is an ordinary one which
+   * also asks for a cookie.  A write can get EINPROGRESS, in which
+   * case it is retried when the socket becomes writeable.
+   */
+#ifdef TCP_FASTOPEN_CONNECT
+  int one= 1;
+
+  if (!(ads->iflags & adns_if_tcpfastopen)) return;
+  if (adns__sock_setsockopt(tc->tcpsocket,IPPROTO_TCP,TCP_FASTOPEN_CONNECT,
+			    &one,sizeof(one)))
+    adns__debug(ads,tc->tcpserver,0,"TCP fast open not available: %s",
+		strerror(errno));
+#else
+  (void)ads; (void)tc;
+#endif
+}
+
+void adns__tcp_tryconnect(adns_state ads, struct adns__tcpconn *tc,
+			  struct timeval now) {
+  int r, fd, tries, socks;
+  const struct server *ss;
 
   for (tries=0; tries<ads->nservers; tries++) {
-    switch (ads->tcpstate) {
+    switch (tc->tcpstate) {
     case server_connecting:
     case server_ok:
     case server_broken:
@@ -401,67 +506,55 @@ void adns__tcp_tryconnect(adns_state ads, struct timeval now) {
       abort();
     }
 
-    assert(!ads->tcpsend.used);
-    assert(!ads->tcprecv.used);
-    assert(!ads->tcprecv_skip);
-
-    proto= getprotobyname("tcp");
-    if (!proto) {
-      adns__diag(ads,-1,0,"unable to find protocol no. for TCP !");
-      return;
-    }
-    fd= adns__sock_socket(AF_INET,SOCK_STREAM,proto->p_proto);
-    if (fd<0) {
-      adns__diag(ads,-1,0,"cannot create TCP socket: %s",strerror(errno));
-      return;
-    }
-    memset(&addr,0,sizeof(addr));
-    addr.sin_family= AF_INET;
-    addr.sin_port= htons(DNS_PORT);
-    addr.sin_addr= ads->servers[ads->tcpserver].addr;
-    if (use_socks_p(ads, (const struct sockaddr*)&addr))
-      {
-        r= socks_connect(ads, fd,(const struct sockaddr*)&addr,sizeof(addr));
-        if (!r)
-          {
-            r= adns__setnonblock(ads,fd);
-            if (r) {
-              adns__diag(ads,-1,0,"cannot make TCP socket nonblocking:"
-                         " %s",strerror(r));
-              adns__sock_close(fd);
-              return;
-            }
-          }
-      }
-    else
-      {
-        r= adns__setnonblock(ads,fd);
-        if (r) {
-          adns__diag(ads,-1,0,"cannot make TCP socket nonblocking:"
-                     " %s",strerror(r));
-          adns__sock_close(fd);
-          return;
-        }
-        r= adns__sock_connect(fd,(const struct sockaddr*)&addr,sizeof(addr));
+    assert(!tc->tcpsend.used);
+    assert(!tc->tcprecv.used);
+    assert(!tc->tcprecv_skip);
+    assert(tc->socksstate == socks_none);
+
+    ss= &ads->servers[tc->tcpserver];
+    socks= use_socks_p(ads,&ss->addr.sa);
+    /* The SOCKS5 proxy is always reached over IPv4 loopback. */
+    fd= tcp_socket(ads, socks ? AF_INET : ss->addr.sa.sa_family);
+    if (fd<0) return;
+    tc->tcpsocket= fd;
+    tc->tcpstate= server_connecting;
+    tc->tcptimeout= now;
+    timevaladd(&tc->tcptimeout,TCPCONNMS);
+    if (socks) {
+      tc->socksstate= socks_connecting;
+      tc->socksport= SOCKS_PORT;
+      socks_connect(ads,tc);
+      if (tc->tcpstate != server_broken) return;
+    } else {
+      tcp_fastopen(ads,tc);
+      r= adns__sock_connect(fd,&ss->addr.sa,ss->len);
+      if (r==0) {
+	tcp_connected(ads,tc,now);
+	return;
       }
-    ads->tcpsocket= fd;
-    ads->tcpstate= server_connecting;
-    if (r==0) {
-      tcp_connected(ads,now);
-      return;
-    }
-    if (errno == EWOULDBLOCK || errno == EINPROGRESS) {
-      ads->tcptimeout= now;
-      timevaladd(&ads->tcptimeout,TCPCONNMS);
-      return;
+      if (errno == EWOULDBLOCK || errno == EINPROGRESS) return;
+      adns__tcp_broken(ads,tc,"connect",strerror(errno));
     }
-    adns__tcp_broken(ads,"connect",strerror(errno));
-    tcp_broken_events(ads);
+    tcp_broken_events(ads,tc);
   }
 }
 
 /* Timeout handling functions. */
 
+int adns__gettimeofday(adns_state ads, struct timeval *tv) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (ads->iflags & adns_if_monotonic) {
+    if (clock_gettime(CLOCK_MONOTONIC,&ts)) return -1;
+    tv->tv_sec= ts.tv_sec;
+    tv->tv_usec= ts.tv_nsec / 1000;
+    return 0;
+  }
+#endif
+  return gettimeofday(tv,0);
+}
+
 void adns__must_gettimeofday(adns_state ads, const struct timeval **now_io,
 			     struct timeval *tv_buf) {
   const struct timeval *now;
@@ -469,7 +562,7 @@ void adns__must_gettimeofday(adns_state ads, const struct timeval **now_io,
 
   now= *now_io;
   if (now) return;
-  r= gettimeofday(tv_buf,0); if (!r) { *now_io= tv_buf; return; }
+  r= adns__gettimeofday(ads,tv_buf); if (!r) { *now_io= tv_buf; return; }
   adns__diag(ads,-1,0,"gettimeofday failed: %s",strerror(errno));
   adns_globalsystemfailure(ads);
   return;
@@ -521,58 +614,115 @@ static void inter_maxtoabs(struct timeval **tv_io, struct timeval *tvbuf,
 static void timeouts_queue(adns_state ads, int act,
 			   struct timeval **tv_io, struct timeval *tvbuf,
 			   struct timeval now, struct query_queue *queue) {
+  /* Timed-out queries are dealt with one priority class at a time,
+   * best first, so that retransmissions of interactive queries are
+   * not stuck behind a run of bulk ones if sending starts failing.
+   *
+   * Dealing with a query may cancel others, but only children (whose
+   * parent has finished), so after each one we carry on from the
+   * last query we left in place which has no parent; queries we have
+   * already looked at before that cannot have changed. */
+  adns_query qu, nqu, last;
+  query_prio prio, skipped;
+
+  for (prio= prio_interactive; prio < prio_count; prio= skipped) {
+    skipped= prio_count;
+    last= 0;
+    for (qu= queue->head; qu; qu= nqu) {
+      nqu= qu->next;
+      if (!timercmp(&now,&qu->timeout,>)) {
+	inter_maxtoabs(tv_io,tvbuf,now,qu->timeout);
+	if (!qu->parent) last= qu;
+	continue;
+      }
+      if (!act) { inter_immed(tv_io,tvbuf); return; }
+      if (qu->prio > prio) {
+	if (qu->prio < skipped) skipped= qu->prio;
+	if (!qu->parent) last= qu;
+	continue;
+      }
+      LIST_UNLINK(*queue,qu);
+      ADNS_QPROBE(timeout,qu,qu->state == query_tcpw
+		  ? qu->tcpconn : qu->udpserver,now);
+      if (qu->state == query_tcpw) {
+	ads->tcpconns[qu->tcpconn].nqueries--;
+	ads->ntcpw--;
+      } else {
+	ads->servers[qu->udpserver].nqueries--;
+	ads->udpinflight--;
+	adns__cwnd_loss(ads,now);
+      }
+      if (qu->state != query_tosend ||
+	  (timerisset(&qu->deadline) && !timercmp(&now,&qu->deadline,<))) {
+	adns__query_fail(qu,adns_s_timeout);
+      } else {
+	adns__query_send(qu,now);
+      }
+      nqu= last ? last->next : queue->head;
+    }
+  }
+}
+
+static void timeouts_deadline(adns_state ads, int act,
+			      struct timeval **tv_io, struct timeval *tvbuf,
+			      struct timeval now, struct query_queue *queue) {
+  /* For queues whose queries are not themselves timing out: childw,
+   * where a parent's deadline has to cut its children short, and
+   * cwndw. */
   adns_query qu, nqu;
 
   for (qu= queue->head; qu; qu= nqu) {
     nqu= qu->next;
-    if (!timercmp(&now,&qu->timeout,>)) {
-      inter_maxtoabs(tv_io,tvbuf,now,qu->timeout);
+    if (!timerisset(&qu->deadline)) continue;
+    if (timercmp(&now,&qu->deadline,<)) {
+      inter_maxtoabs(tv_io,tvbuf,now,qu->deadline);
     } else {
       if (!act) { inter_immed(tv_io,tvbuf); return; }
-      LIST_UNLINK(*queue,qu);
-      if (qu->state != query_tosend) {
-	adns__query_fail(qu,adns_s_timeout);
+      if (qu->state == query_cwndw) {
+	adns__cwndw_unlink(ads,qu);
       } else {
-	adns__query_send(qu,now);
+	LIST_UNLINK(*queue,qu);
+	ads->nchildw--;
       }
+      adns__query_fail(qu,adns_s_timeout);
       nqu= queue->head;
     }
   }
 }
 
-static void tcp_events(adns_state ads, int act,
+static void tcp_events(adns_state ads, struct adns__tcpconn *tc, int act,
 		       struct timeval **tv_io, struct timeval *tvbuf,
 		       struct timeval now) {
   for (;;) {
-    switch (ads->tcpstate) {
+    switch (tc->tcpstate) {
     case server_broken:
       if (!act) { inter_immed(tv_io,tvbuf); return; }
-      tcp_broken_events(ads);
+      tcp_broken_events(ads,tc);
     case server_disconnected: /* fall through */
-      if (!ads->tcpw.head) return;
+      if (!tc->nqueries) return;
       if (!act) { inter_immed(tv_io,tvbuf); return; }
-      adns__tcp_tryconnect(ads,now);
+      adns__tcp_tryconnect(ads,tc,now);
       break;
     case server_ok:
-      if (ads->tcpw.head) return;
-      if (!ads->tcptimeout.tv_sec) {
-	assert(!ads->tcptimeout.tv_usec);
-	ads->tcptimeout= now;
-	timevaladd(&ads->tcptimeout,TCPIDLEMS);
+      if (tc->nqueries) return;
+      if (!tc->tcptimeout.tv_sec) {
+	assert(!tc->tcptimeout.tv_usec);
+	tc->tcptimeout= now;
+	timevaladd(&tc->tcptimeout,TCPIDLEMS);
       }
     case server_connecting: /* fall through */
-      if (!act || !timercmp(&now,&ads->tcptimeout,>)) {
-	inter_maxtoabs(tv_io,tvbuf,now,ads->tcptimeout);
+      if (!act || !timercmp(&now,&tc->tcptimeout,>)) {
+	inter_maxtoabs(tv_io,tvbuf,now,tc->tcptimeout);
 	return;
       } {
 	/* TCP timeout has happened */
-	switch (ads->tcpstate) {
+	switch (tc->tcpstate) {
 	case server_connecting: /* failed to connect */
-	  adns__tcp_broken(ads,"unable to make connection","timed out");
+	  adns__tcp_broken(ads,tc,"unable to make connection","timed out");
 	  break;
 	case server_ok: /* idle timeout */
-	  tcp_close(ads);
-	  ads->tcpstate= server_disconnected;
+	  tcp_close(tc);
+	  tc->tcpstate= server_disconnected;
 	  return;
 	default:
 	  abort();
@@ -589,9 +739,16 @@ static void tcp_events(adns_state ads, int act,
 void adns__timeouts(adns_state ads, int act,
 		    struct timeval **tv_io, struct timeval *tvbuf,
 		    struct timeval now) {
+  int i;
+
+  timeouts_deadline(ads,act,tv_io,tvbuf,now, &ads->childw);
+  timeouts_deadline(ads,act,tv_io,tvbuf,now, &ads->cwndw);
   timeouts_queue(ads,act,tv_io,tvbuf,now, &ads->udpw);
+  if (adns__cwnd_release(ads,act,now) && !act) inter_immed(tv_io,tvbuf);
   timeouts_queue(ads,act,tv_io,tvbuf,now, &ads->tcpw);
-  tcp_events(ads,act,tv_io,tvbuf,now);
+  if (ads->transport.udpsendfn) return; /* no connections to manage */
+  for (i=0; i<ads->ntcpconns; i++)
+    tcp_events(ads,&ads->tcpconns[i],act,tv_io,tvbuf,now);
 }
 
 void adns_firsttimeout(adns_state ads,
@@ -617,55 +774,214 @@ void adns_processtimeouts(adns_state ads, const struct timeval *now) {
 
 int adns__pollfds(adns_state ads, struct pollfd pollfds_buf[MAX_POLLFDS]) {
   /* Returns the number of entries filled in.  Always zeroes revents. */
+  struct adns__tcpconn *tc;
+  int i, n;
 
-  assert(MAX_POLLFDS==2);
+  assert(MAX_POLLFDS==2+MAXUDPCONNS+MAXTCPCONNS);
 
-  pollfds_buf[0].fd= ads->udpsocket;
-  pollfds_buf[0].events= POLLIN;
-  pollfds_buf[0].revents= 0;
+  n= 0;
+  if (ads->udpsocket >= 0) {
+    pollfds_buf[n].fd= ads->udpsocket;
+    pollfds_buf[n].events= POLLIN;
+    pollfds_buf[n].revents= 0;
+    n++;
+  }
 
-  switch (ads->tcpstate) {
-  case server_disconnected:
-  case server_broken:
-    return 1;
-  case server_connecting:
-    pollfds_buf[1].events= POLLOUT;
-    break;
-  case server_ok:
-    pollfds_buf[1].events=
-      ads->tcpsend.used ? POLLIN|POLLOUT|POLLPRI : POLLIN|POLLPRI;
-    break;
-  default:
-    abort();
+  if (ads->udpsocket6 >= 0) {
+    pollfds_buf[n].fd= ads->udpsocket6;
+    pollfds_buf[n].events= POLLIN;
+    pollfds_buf[n].revents= 0;
+    n++;
+  }
+
+  for (i=0; i<ads->nservers && i<MAXUDPCONNS; i++) {
+    if (ads->servers[i].udpsocket < 0) continue;
+    pollfds_buf[n].fd= ads->servers[i].udpsocket;
+    pollfds_buf[n].events= POLLIN;
+    pollfds_buf[n].revents= 0;
+    n++;
   }
-  pollfds_buf[1].fd= ads->tcpsocket;
-  return 2;
+
+  for (i=0; i<ads->ntcpconns; i++) {
+    tc= &ads->tcpconns[i];
+    switch (tc->tcpstate) {
+    case server_disconnected:
+    case server_broken:
+      continue;
+    case server_connecting:
+      pollfds_buf[n].events= socks_awaitingreply(tc) ? POLLIN : POLLOUT;
+      break;
+    case server_ok:
+      pollfds_buf[n].events=
+	tc->tcpsend.used ? POLLIN|POLLOUT|POLLPRI : POLLIN|POLLPRI;
+      break;
+    default:
+      abort();
+    }
+    pollfds_buf[n].fd= tc->tcpsocket;
+    pollfds_buf[n].revents= 0;
+    n++;
+  }
+  return n;
+}
+
+static struct adns__tcpconn *tcp_findfd(adns_state ads, int fd) {
+  /* Returns the connection using fd, if any. */
+  struct adns__tcpconn *tc;
+  int i;
+
+  for (i=0; i<ads->ntcpconns; i++) {
+    tc= &ads->tcpconns[i];
+    if ((tc->tcpstate == server_connecting || tc->tcpstate == server_ok) &&
+	tc->tcpsocket == fd)
+      return tc;
+  }
+  return 0;
+}
+
+static int udp_findfd(adns_state ads, int fd) {
+  /* Returns the server whose connected UDP socket is fd, or -1. */
+  int serv;
+
+  for (serv=0; serv<ads->nservers && serv<MAXUDPCONNS; serv++)
+    if (ads->servers[serv].udpsocket == fd) return serv;
+  return -1;
+}
+
+static void udp_unreachable(adns_state ads, int serv, const char *why,
+			    struct timeval now) {
+  /* Sends the queries waiting for serv on to the next server now,
+   * rather than when they time out.  As in udp_dropped, after each
+   * we carry on from the last parentless query left in place. */
+  adns_query qu, nqu, last;
+
+  adns__debug(ads,serv,0,"server unreachable: %s",why);
+  if (ads->nservers < 2) return;
+  last= 0;
+  for (qu= ads->udpw.head; qu; qu= nqu) {
+    nqu= qu->next;
+    if (qu->udpserver != serv) {
+      if (!qu->parent) last= qu;
+      continue;
+    }
+    LIST_UNLINK(ads->udpw,qu);
+    ads->servers[serv].nqueries--;
+    ads->udpinflight--;
+    adns__query_send(qu,now);
+    nqu= last ? last->next : ads->udpw.head;
+  }
+}
+
+static void udp_dropped(adns_state ads, unsigned long n,
+			struct timeval now) {
+  /* The kernel has dropped n datagrams, which may have included
+   * replies.  Sends again at once those queries which were last sent
+   * at least UDPDROPRETRYMS ago, rather than leaving them until they
+   * time out.  Those sent again go to the end of udpw as young
+   * queries, so the scan passes over them.  As in timeouts_queue,
+   * after each we carry on from the last parentless query left in
+   * place. */
+  adns_query qu, nqu, last;
+  struct timeval due;
+
+  ads->udpdrops += n;
+  adns__debug(ads,-1,0,"kernel dropped %lu datagram(s)",n);
+  adns__cwnd_loss(ads,now);
+  last= 0;
+  for (qu= ads->udpw.head; qu; qu= nqu) {
+    nqu= qu->next;
+    due= qu->udpsent;
+    timevaladd(&due,UDPDROPRETRYMS);
+    if (timercmp(&due,&now,>)) {
+      if (!qu->parent) last= qu;
+      continue;
+    }
+    LIST_UNLINK(ads->udpw,qu);
+    ads->servers[qu->udpserver].nqueries--;
+    ads->udpinflight--;
+    adns__query_send(qu,now);
+    nqu= last ? last->next : ads->udpw.head;
+  }
+}
+
+static int udp_recv(adns_state ads, int fd, byte *buf, int buflen,
+		    adns__sockaddr *addr, int *addrlen_io,
+		    unsigned long *dropslast_io, struct timeval now) {
+  /* Like adns__sock_recvfrom, or adns__sock_read if addr is 0, but
+   * with adns_if_udpdrops also notices datagrams the kernel dropped,
+   * keeping the socket's count in *dropslast_io. */
+#ifdef SO_RXQ_OVFL
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  union {
+    struct cmsghdr align;
+    byte buf[CMSG_SPACE(sizeof(unsigned int))];
+  } control;
+  unsigned int count;
+  unsigned long n;
+  int r;
+
+  if (ads->iflags & adns_if_udpdrops) {
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base= buf;
+    iov.iov_len= buflen;
+    msg.msg_iov= &iov;
+    msg.msg_iovlen= 1;
+    if (addr) {
+      msg.msg_name= addr;
+      msg.msg_namelen= *addrlen_io;
+    }
+    msg.msg_control= &control;
+    msg.msg_controllen= sizeof(control);
+    r= adns__sock_recvmsg(fd,&msg,0);
+    if (r<0) return r;
+    if (addr) *addrlen_io= msg.msg_namelen;
+    for (cm= CMSG_FIRSTHDR(&msg); cm; cm= CMSG_NXTHDR(&msg,cm)) {
+      if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_RXQ_OVFL ||
+	  cm->cmsg_len < CMSG_LEN(sizeof(count)))
+	continue;
+      memcpy(&count,CMSG_DATA(cm),sizeof(count));
+      n= (count - *dropslast_io) & 0xffffffffUL;
+      *dropslast_io= count;
+      if (n) udp_dropped(ads,n,now);
+    }
+    return r;
+  }
+#endif
+  if (addr)
+    return adns__sock_recvfrom(fd,buf,buflen,0,&addr->sa,addrlen_io);
+  return adns__sock_read(fd,buf,buflen);
 }
 
 int adns_processreadable(adns_state ads, int fd, const struct timeval *now) {
   int want, dgramlen, r, udpaddrlen, serv, old_skip;
   byte udpbuf[DNS_MAXUDP];
-  struct sockaddr_in udpaddr;
+  adns__sockaddr udpaddr;
+  int af, addrlen, port;
+  char addrbuf[INET6_ADDRSTRLEN];
+  struct adns__tcpconn *tc;
+  unsigned long *dropslast;
 
   adns__consistency(ads,0,cc_entex);
 
-  switch (ads->tcpstate) {
-  case server_disconnected:
-  case server_broken:
+  tc= tcp_findfd(ads,fd);
+  if (tc) switch (tc->tcpstate) {
   case server_connecting:
-    break;
+    if (!socks_awaitingreply(tc)) break;
+    r= socks_recv(ads,tc,*now);
+    goto xit;
   case server_ok:
-    if (fd != ads->tcpsocket) break;
-    assert(!ads->tcprecv_skip);
+    assert(!tc->tcprecv_skip);
     do {
-      if (ads->tcprecv.used >= ads->tcprecv_skip+2) {
-	dgramlen= ((ads->tcprecv.buf[ads->tcprecv_skip]<<8) |
-	           ads->tcprecv.buf[ads->tcprecv_skip+1]);
-	if (ads->tcprecv.used >= ads->tcprecv_skip+2+dgramlen) {
-	  old_skip= ads->tcprecv_skip;
-	  ads->tcprecv_skip += 2+dgramlen;
-	  adns__procdgram(ads, ads->tcprecv.buf+old_skip+2,
-			  dgramlen, ads->tcpserver, 1,*now);
+      if (tc->tcprecv.used >= tc->tcprecv_skip+2) {
+	dgramlen= ((tc->tcprecv.buf[tc->tcprecv_skip]<<8) |
+	           tc->tcprecv.buf[tc->tcprecv_skip+1]);
+	if (tc->tcprecv.used >= tc->tcprecv_skip+2+dgramlen) {
+	  old_skip= tc->tcprecv_skip;
+	  tc->tcprecv_skip += 2+dgramlen;
+	  adns__procdgram(ads, tc->tcprecv.buf+old_skip+2,
+			  dgramlen, tc->tcpserver, 1,*now);
 	  continue;
 	} else {
 	  want= 2+dgramlen;
@@ -673,36 +989,69 @@ int adns_processreadable(adns_state ads, int fd, const struct timeval *now) {
       } else {
 	want= 2;
       }
-      ads->tcprecv.used -= ads->tcprecv_skip;
-      memmove(ads->tcprecv.buf, ads->tcprecv.buf+ads->tcprecv_skip,
-	      ads->tcprecv.used);
-      ads->tcprecv_skip= 0;
-      if (!adns__vbuf_ensure(&ads->tcprecv,want)) { r= ENOMEM; goto xit; }
-      assert(ads->tcprecv.used <= ads->tcprecv.avail);
-      if (ads->tcprecv.used == ads->tcprecv.avail) continue;
-      r= adns__sock_read(ads->tcpsocket,
-                         ads->tcprecv.buf+ads->tcprecv.used,
-                         ads->tcprecv.avail-ads->tcprecv.used);
+      if (tc->tcprecv_skip) {
+	/* Only the incomplete message left after those we have already
+	 * processed in place is moved, so each byte moves at most once. */
+	tc->tcprecv.used -= tc->tcprecv_skip;
+	memmove(tc->tcprecv.buf, tc->tcprecv.buf+tc->tcprecv_skip,
+		tc->tcprecv.used);
+	tc->tcprecv_skip= 0;
+      }
+      if (!adns__vbuf_ensure(&tc->tcprecv,want)) { r= ENOMEM; goto xit; }
+      assert(tc->tcprecv.used <= tc->tcprecv.avail);
+      if (tc->tcprecv.used == tc->tcprecv.avail) continue;
+      r= adns__sock_read(tc->tcpsocket,
+                         tc->tcprecv.buf+tc->tcprecv.used,
+                         tc->tcprecv.avail-tc->tcprecv.used);
       if (r>0) {
-	ads->tcprecv.used+= r;
+	tc->tcprecv.used+= r;
       } else {
 	if (r) {
 	  if (errno==EAGAIN || errno==EWOULDBLOCK) { r= 0; goto xit; }
 	  if (errno==EINTR) continue;
 	  if (errno_resources(errno)) { r= errno; goto xit; }
 	}
-	adns__tcp_broken(ads,"read",r?strerror(errno):"closed");
+	adns__tcp_broken(ads,tc,"read",r?strerror(errno):"closed");
       }
-    } while (ads->tcpstate == server_ok);
+    } while (tc->tcpstate == server_ok);
     r= 0; goto xit;
   default:
     abort();
   }
-  if (fd == ads->udpsocket) {
+  serv= udp_findfd(ads,fd);
+  if (serv >= 0) {
+    for (;;) {
+      r= udp_recv(ads,fd,udpbuf,sizeof(udpbuf),0,0,
+		  &ads->servers[serv].udpdropslast,*now);
+      if (r<0) {
+	if (errno == EAGAIN || errno == EWOULDBLOCK) { r= 0; goto xit; }
+	if (errno == EINTR) continue;
+	if (errno_resources(errno)) { r= errno; goto xit; }
+	if (errno == ECONNREFUSED || errno == EHOSTUNREACH ||
+	    errno == ENETUNREACH) {
+	  udp_unreachable(ads,serv,strerror(errno),*now);
+	  continue;
+	}
+	adns__warn(ads,serv,0,"datagram receive error: %s",strerror(errno));
+	r= 0; goto xit;
+      }
+      adns__procdgram(ads,udpbuf,r,serv,0,*now);
+    }
+  }
+  if (fd == ads->udpsocket || fd == ads->udpsocket6) {
+    if (fd == ads->udpsocket) {
+      af= AF_INET;
+      addrlen= sizeof(udpaddr.inet);
+      dropslast= &ads->udpdropslast;
+    } else {
+      af= AF_INET6;
+      addrlen= sizeof(udpaddr.inet6);
+      dropslast= &ads->udpdropslast6;
+    }
     for (;;) {
-      udpaddrlen= sizeof(udpaddr);
-      r= adns__sock_recvfrom(ads->udpsocket,udpbuf,sizeof(udpbuf),0,
-                             (struct sockaddr*)&udpaddr,&udpaddrlen);
+      udpaddrlen= addrlen;
+      r= udp_recv(ads,fd,udpbuf,sizeof(udpbuf),&udpaddr,&udpaddrlen,
+		  dropslast,*now);
       if (r<0) {
 	if (errno == EAGAIN || errno == EWOULDBLOCK) { r= 0; goto xit; }
 	if (errno == EINTR) continue;
@@ -710,29 +1059,30 @@ int adns_processreadable(adns_state ads, int fd, const struct timeval *now) {
 	adns__warn(ads,-1,0,"datagram receive error: %s",strerror(errno));
 	r= 0; goto xit;
       }
-      if (udpaddrlen != sizeof(udpaddr)) {
+      if (udpaddrlen != addrlen) {
 	adns__diag(ads,-1,0,"datagram received with wrong address length %d"
-		   " (expected %lu)", udpaddrlen,
-		   (unsigned long)sizeof(udpaddr));
+		   " (expected %d)", udpaddrlen,addrlen);
 	continue;
       }
-      if (udpaddr.sin_family != AF_INET) {
+      if (udpaddr.sa.sa_family != af) {
 	adns__diag(ads,-1,0,"datagram received with wrong protocol family"
-		   " %u (expected %u)",udpaddr.sin_family,AF_INET);
+		   " %u (expected %u)",udpaddr.sa.sa_family,af);
 	continue;
       }
-      if (ntohs(udpaddr.sin_port) != DNS_PORT) {
+      port= ntohs(af == AF_INET ? udpaddr.inet.sin_port
+		  : udpaddr.inet6.sin6_port);
+      if (port != DNS_PORT) {
 	adns__diag(ads,-1,0,"datagram received from wrong port"
-		   " %u (expected %u)", ntohs(udpaddr.sin_port),DNS_PORT);
+		   " %u (expected %u)", port,DNS_PORT);
 	continue;
       }
       for (serv= 0;
 	   serv < ads->nservers &&
-	     ads->servers[serv].addr.s_addr != udpaddr.sin_addr.s_addr;
+	     !adns__sockaddr_equal(&ads->servers[serv].addr.sa,&udpaddr.sa);
 	   serv++);
       if (serv >= ads->nservers) {
 	adns__warn(ads,-1,0,"datagram received from unknown nameserver %s",
-		   inet_ntoa(udpaddr.sin_addr));
+		   adns__sockaddr_ntoa(&udpaddr.sa,addrbuf));
 	continue;
       }
       adns__procdgram(ads,udpbuf,r,serv,0,*now);
@@ -740,54 +1090,84 @@ int adns_processreadable(adns_state ads, int fd, const struct timeval *now) {
   }
   r= 0;
 xit:
+  /* Replies may have made room in the congestion window. */
+  adns__cwnd_release(ads,1,*now);
   adns__consistency(ads,0,cc_entex);
   return r;
 }
 
+int adns_inject_reply(adns_state ads, int serv, int viatcp,
+		      const void *msg, int len) {
+  struct timeval tv_buf;
+  const struct timeval *now;
+
+  adns__consistency(ads,0,cc_entex);
+  if (!ads->transport.udpsendfn || serv < 0 || serv >= ads->nservers ||
+      len < 0) {
+    adns__consistency(ads,0,cc_entex);
+    return EINVAL;
+  }
+  now= 0;
+  adns__must_gettimeofday(ads,&now,&tv_buf);
+  if (now) {
+    adns__procdgram(ads,msg,len,serv,!!viatcp,*now);
+    adns__cwnd_release(ads,1,*now);
+  }
+  adns__consistency(ads,0,cc_entex);
+  return 0;
+}
+
 int adns_processwriteable(adns_state ads, int fd, const struct timeval *now) {
+  struct adns__tcpconn *tc;
   int r;
 
   adns__consistency(ads,0,cc_entex);
 
-  switch (ads->tcpstate) {
-  case server_disconnected:
-  case server_broken:
-    break;
+  tc= tcp_findfd(ads,fd);
+  if (tc) switch (tc->tcpstate) {
   case server_connecting:
-    if (fd != ads->tcpsocket) break;
-    assert(ads->tcprecv.used==0);
-    assert(ads->tcprecv_skip==0);
+    assert(tc->tcprecv.used==0);
+    assert(tc->tcprecv_skip==0);
+    if (tc->socksstate != socks_none && tc->socksstate != socks_connecting) {
+      r= socks_send(ads,tc);
+      goto xit;
+    }
     for (;;) {
-      if (!adns__vbuf_ensure(&ads->tcprecv,1)) { r= ENOMEM; goto xit; }
-      r= adns__sock_read(ads->tcpsocket,&ads->tcprecv.buf,1);
+      if (!adns__vbuf_ensure(&tc->tcprecv,1)) { r= ENOMEM; goto xit; }
+      r= adns__sock_read(tc->tcpsocket,tc->tcprecv.buf,1);
       if (r==0 || (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK))) {
-	tcp_connected(ads,*now);
+	if (tc->socksstate == socks_connecting) socks_connected(ads,tc);
+	else tcp_connected(ads,tc,*now);
 	r= 0; goto xit;
       }
       if (r>0) {
-	adns__tcp_broken(ads,"connect/read","sent data before first request");
+	adns__tcp_broken(ads,tc,"connect/read",
+			 "sent data before first request");
 	r= 0; goto xit;
       }
       if (errno==EINTR) continue;
       if (errno_resources(errno)) { r= errno; goto xit; }
-      adns__tcp_broken(ads,"connect/read",strerror(errno));
+      if (tc->socksstate == socks_connecting)
+	socks_connectfailed(ads,tc,errno);
+      else
+	adns__tcp_broken(ads,tc,"connect/read",strerror(errno));
       r= 0; goto xit;
     } /* not reached */
   case server_ok:
-    if (fd != ads->tcpsocket) break;
-    while (ads->tcpsend.used) {
-      adns__sigpipe_protect(ads);
-      r= adns__sock_write(ads->tcpsocket,ads->tcpsend.buf,ads->tcpsend.used);
-      adns__sigpipe_unprotect(ads);
+    while (tc->tcpsend.used) {
+      r= adns__tcp_write(ads,tc->tcpsocket,tc->tcpsend.buf+tc->tcpsend_skip,
+			 tc->tcpsend.used-tc->tcpsend_skip);
       if (r<0) {
 	if (errno==EINTR) continue;
-	if (errno==EAGAIN || errno==EWOULDBLOCK) { r= 0; goto xit; }
+	if (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINPROGRESS)
+	  { r= 0; goto xit; }
 	if (errno_resources(errno)) { r= errno; goto xit; }
-	adns__tcp_broken(ads,"write",strerror(errno));
+	adns__tcp_broken(ads,tc,"write",strerror(errno));
 	r= 0; goto xit;
       } else if (r>0) {
-	ads->tcpsend.used -= r;
-	memmove(ads->tcpsend.buf,ads->tcpsend.buf+r,ads->tcpsend.used);
+	tc->tcpsend_skip += r;
+	if (tc->tcpsend_skip == tc->tcpsend.used)
+	  tc->tcpsend.used= tc->tcpsend_skip= 0;
       }
     }
     r= 0;
@@ -803,19 +1183,12 @@ xit:
 
 int adns_processexceptional(adns_state ads, int fd,
 			    const struct timeval *now) {
+  struct adns__tcpconn *tc;
+
   adns__consistency(ads,0,cc_entex);
-  switch (ads->tcpstate) {
-  case server_disconnected:
-  case server_broken:
-    break;
-  case server_connecting:
-  case server_ok:
-    if (fd != ads->tcpsocket) break;
-    adns__tcp_broken(ads,"poll/select","exceptional condition detected");
-    break;
-  default:
-    abort();
-  }
+  tc= tcp_findfd(ads,fd);
+  if (tc)
+    adns__tcp_broken(ads,tc,"poll/select","exceptional condition detected");
   adns__consistency(ads,0,cc_entex);
   return 0;
 }
@@ -921,25 +1294,70 @@ xit:
 /* General helpful functions. */
 
 void adns_globalsystemfailure(adns_state ads) {
+  adns_query qu;
+  struct adns__tcpconn *tc;
+  int i;
+
   adns__consistency(ads,0,cc_entex);
 
-  while (ads->udpw.head) adns__query_fail(ads->udpw.head, adns_s_systemfail);
-  while (ads->tcpw.head) adns__query_fail(ads->tcpw.head, adns_s_systemfail);
+  while ((qu= ads->udpw.head)) {
+    LIST_UNLINK(ads->udpw,qu);
+    ads->servers[qu->udpserver].nqueries--;
+    ads->udpinflight--;
+    adns__query_fail(qu, adns_s_systemfail);
+  }
+  while ((qu= ads->cwndw.head)) {
+    adns__cwndw_unlink(ads,qu);
+    adns__query_fail(qu, adns_s_systemfail);
+  }
+  while ((qu= ads->tcpw.head)) {
+    LIST_UNLINK(ads->tcpw,qu);
+    ads->ntcpw--;
+    ads->tcpconns[qu->tcpconn].nqueries--;
+    adns__query_fail(qu, adns_s_systemfail);
+  }
 
-  switch (ads->tcpstate) {
-  case server_connecting:
-  case server_ok:
-    adns__tcp_broken(ads,0,0);
-    break;
-  case server_disconnected:
-  case server_broken:
-    break;
-  default:
-    abort();
+  for (i=0; i<ads->ntcpconns; i++) {
+    tc= &ads->tcpconns[i];
+    switch (tc->tcpstate) {
+    case server_connecting:
+    case server_ok:
+      adns__tcp_broken(ads,tc,0,0);
+      break;
+    case server_disconnected:
+    case server_broken:
+      break;
+    default:
+      abort();
+    }
   }
   adns__consistency(ads,0,cc_entex);
 }
 
+unsigned long adns_udpdrops(adns_state ads) {
+  return ads->udpdrops;
+}
+
+void adns_getstats(adns_state ads, adns_stats *stats_r) {
+  query_prio prio;
+
+  *stats_r= ads->stats;
+  stats_r->nudpw= ads->udpinflight;
+  stats_r->ncwndw= 0;
+  for (prio= prio_interactive; prio < prio_count; prio++)
+    stats_r->ncwndw += ads->cwndwprio[prio];
+  stats_r->ntcpw= ads->ntcpw;
+  stats_r->nchildw= ads->nchildw;
+  stats_r->noutput= ads->noutput;
+  stats_r->nservers= ads->nservers;
+}
+
+int adns_getserverstats(adns_state ads, int serv, adns_serverstats *stats_r) {
+  if (serv < 0 || serv >= ads->nservers) return EINVAL;
+  *stats_r= ads->servers[serv].stats;
+  return 0;
+}
+
 int adns_processany(adns_state ads) {
   int r, i;
   struct timeval now;
@@ -948,7 +1366,7 @@ int adns_processany(adns_state ads) {
 
   adns__consistency(ads,0,cc_entex);
 
-  r= gettimeofday(&now,0);
+  r= adns__gettimeofday(ads,&now);
   if (!r) adns_processtimeouts(ads,&now);
 
   /* We just use adns__fdevents to loop over the fd's trying them.
@@ -981,7 +1399,7 @@ int adns__internal_check(adns_state ads,
   if (!qu) {
     if (ads->output.head) {
       qu= ads->output.head;
-    } else if (ads->udpw.head || ads->tcpw.head) {
+    } else if (ads->udpw.head || ads->cwndw.head || ads->tcpw.head) {
       return EAGAIN;
     } else {
       return ESRCH;
@@ -990,10 +1408,12 @@ int adns__internal_check(adns_state ads,
     if (qu->id>=0) return EAGAIN;
   }
   LIST_UNLINK(ads->output,qu);
+  ads->noutput--;
+  adns__mem_uncharge(qu,qu->memused); /* the answer is now the caller's */
   *answer= qu->answer;
   if (context_r) *context_r= qu->ctx.ext;
   *query_io= qu;
-  free(qu);
+  adns__free(ads,qu);
   return 0;
 }
 
@@ -1038,7 +1458,7 @@ int adns_check(adns_state ads,
   int r;
 
   adns__consistency(ads,*query_io,cc_entex);
-  r= gettimeofday(&now,0);
+  r= adns__gettimeofday(ads,&now);
   if (!r) adns__autosys(ads,now);
 
   r= adns__internal_check(ads,query_io,answer_r,context_r);
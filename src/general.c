@@ -53,6 +53,7 @@ void adns__vdiag(adns_state ads, const char *pfx, adns_initflags prevent,
 		 int serv, adns_query qu, const char *fmt, va_list al) {
   const char *bef, *aft;
   vbuf vb;
+  char nsbuf[INET6_ADDRSTRLEN];
 
   if (!ads->logfn ||
       (!(ads->iflags & adns_if_debug)
@@ -84,7 +85,8 @@ void adns__vdiag(adns_state ads, const char *pfx, adns_initflags prevent,
   }
 
   if (serv>=0) {
-    adns__lprintf(ads,"%sNS=%s",bef,inet_ntoa(ads->servers[serv].addr));
+    adns__lprintf(ads,"%sNS=%s",bef,
+		  adns__sockaddr_ntoa(&ads->servers[serv].addr.sa,nsbuf));
     bef=", "; aft=")\n";
   }
 
@@ -252,6 +254,114 @@ void adns_free(void *p) {
     free(p);
 }
 
+void adns_freeanswer(adns_state ads, adns_answer *answer) {
+  adns__free(ads,answer);
+}
+
+/* Allocation */
+
+static void *stdalloc_malloc(void *context, size_t sz) {
+  return malloc(sz);
+}
+
+static void *stdalloc_realloc(void *context, void *p, size_t sz) {
+  return realloc(p,sz);
+}
+
+static void stdalloc_free(void *context, void *p) {
+  free(p);
+}
+
+const adns_allocator adns__stdalloc= {
+  stdalloc_malloc, stdalloc_realloc, stdalloc_free, 0
+};
+
+void *adns__malloc(adns_state ads, size_t sz) {
+  void *p;
+
+  p= ads->alloc.mallocfn(ads->alloc.context,sz);
+  if (!p) errno= ENOMEM;
+  return p;
+}
+
+void *adns__realloc(adns_state ads, void *p, size_t sz) {
+  void *np;
+
+  np= ads->alloc.reallocfn(ads->alloc.context,p,sz);
+  if (!np) errno= ENOMEM;
+  return np;
+}
+
+void adns__free(adns_state ads, void *p) {
+  if (p) ads->alloc.freefn(ads->alloc.context,p);
+}
+
+/* Traffic capture; see adns_capture for the format. */
+
+#define CAPTURE_MAGIC "ADNSCAP1"
+
+int adns_capture(adns_state ads, FILE *file) {
+  int r;
+
+  adns__consistency(ads,0,cc_entex);
+  r= 0;
+  if (ads->capture && fflush(ads->capture)) r= errno;
+  ads->capture= 0;
+  if (file) {
+    if (fwrite(CAPTURE_MAGIC,8,1,file) != 1) r= errno ? errno : EIO;
+    else ads->capture= file;
+  }
+  adns__consistency(ads,0,cc_entex);
+  return r;
+}
+
+static byte *capture_l(byte *p, unsigned long v) {
+  *p++= v>>24; *p++= v>>16; *p++= v>>8; *p++= v;
+  return p;
+}
+
+static void capture_write(adns_state ads, const byte *head, int headlen,
+			  const void *data, int len) {
+  if (fwrite(head,headlen,1,ads->capture) == 1 &&
+      (!len || fwrite(data,len,1,ads->capture) == 1))
+    return;
+  adns__diag(ads,-1,0,"capture write failed, no longer recording: %s",
+	     strerror(errno));
+  ads->capture= 0;
+}
+
+void adns__capture_query(adns_state ads, const char *owner, int ol,
+			 adns_rrtype type, adns_queryflags flags,
+			 struct timeval now) {
+  byte head[19], *p;
+
+  if (ol > 0xffff) ol= 0xffff;
+  p= head;
+  *p++= 'Q';
+  p= capture_l(p,now.tv_sec);
+  p= capture_l(p,now.tv_usec);
+  p= capture_l(p,type);
+  p= capture_l(p,flags);
+  *p++= ol>>8; *p++= ol;
+  assert(p == head+sizeof(head));
+  capture_write(ads,head,sizeof(head),owner,ol);
+}
+
+void adns__capture_dgram(adns_state ads, int kind, int serv, int viatcp,
+			 const byte *dgram, int len, struct timeval now) {
+  byte head[14], *p;
+
+  p= head;
+  *p++= kind;
+  p= capture_l(p,now.tv_sec);
+  p= capture_l(p,now.tv_usec);
+  *p++= serv>>8; *p++= serv;
+  *p++= !!viatcp;
+  *p++= len>>8; *p++= len;
+  assert(p == head+sizeof(head));
+  capture_write(ads,head,sizeof(head),dgram,len);
+}
+
 
 #define STINFO(max) { adns_s_max_##max, #max }
 
@@ -308,6 +418,42 @@ void adns__isort(void *array, int nobjs, int sz, void *tempbuf,
   }
 }
 
+/* Socket addresses. */
+
+const char *adns__sockaddr_ntoa(const struct sockaddr *sa,
+				char buf[INET6_ADDRSTRLEN]) {
+  const char *r;
+
+  switch (sa->sa_family) {
+  case AF_INET:
+    r= adns__inet_ntop(AF_INET,&((const struct sockaddr_in*)sa)->sin_addr,
+		       buf,INET6_ADDRSTRLEN);
+    break;
+  case AF_INET6:
+    r= adns__inet_ntop(AF_INET6,&((const struct sockaddr_in6*)sa)->sin6_addr,
+		       buf,INET6_ADDRSTRLEN);
+    break;
+  default:
+    r= 0;
+  }
+  return r ? r : "<bad address>";
+}
+
+int adns__sockaddr_equal(const struct sockaddr *a, const struct sockaddr *b) {
+  if (a->sa_family != b->sa_family) return 0;
+  switch (a->sa_family) {
+  case AF_INET:
+    return (((const struct sockaddr_in*)a)->sin_addr.s_addr ==
+	    ((const struct sockaddr_in*)b)->sin_addr.s_addr);
+  case AF_INET6:
+    return !memcmp(&((const struct sockaddr_in6*)a)->sin6_addr,
+		   &((const struct sockaddr_in6*)b)->sin6_addr,
+		   sizeof(struct in6_addr));
+  default:
+    return 0;
+  }
+}
+
 /* SIGPIPE protection. */
 
 void adns__sigpipe_protect(adns_state ads) {
@@ -346,3 +492,43 @@ void adns__sigpipe_unprotect(adns_state ads) {
   r= sigprocmask(SIG_SETMASK,&ads->stdsigmask,0); assert(!r);
 #endif
 }
+
+int adns__tcp_write(adns_state ads, int fd, const void *buf, int len) {
+#if defined(MSG_NOSIGNAL)
+  (void)ads;
+  return adns__sock_send(fd,buf,len,MSG_NOSIGNAL);
+#elif defined(SO_NOSIGPIPE)
+  (void)ads;
+  return adns__sock_write(fd,buf,len);
+#else
+  int r;
+
+  adns__sigpipe_protect(ads);
+  r= adns__sock_write(fd,buf,len);
+  adns__sigpipe_unprotect(ads);
+  return r;
+#endif
+}
+
+int adns__tcp_writev(adns_state ads, int fd,
+		     const struct iovec *iov, int iovcnt) {
+#if defined(MSG_NOSIGNAL)
+  struct msghdr msg;
+
+  (void)ads;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov= (struct iovec*)iov;
+  msg.msg_iovlen= iovcnt;
+  return adns__sock_sendmsg(fd,&msg,MSG_NOSIGNAL);
+#elif defined(SO_NOSIGPIPE)
+  (void)ads;
+  return adns__sock_writev(fd,iov,iovcnt);
+#else
+  int r;
+
+  adns__sigpipe_protect(ads);
+  r= adns__sock_writev(fd,iov,iovcnt);
+  adns__sigpipe_unprotect(ads);
+  return r;
+#endif
+}
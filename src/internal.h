@@ -45,6 +45,11 @@ typedef unsigned char byte;
 #include "adns.h"
 #include "dlist.h"
 
+#ifdef ENABLE_USDT
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+#endif
+
 #ifdef ADNS_REGRESS_TEST
 # include "hredirect.h"
 #endif
@@ -53,16 +58,23 @@ typedef unsigned char byte;
 
 /* Configuration and constants */
 
-#define MAXSERVERS 5
 #define MAXSORTLIST 15
+#define MAXTCPCONNS 8
+#define MAXUDPCONNS 8
 #define UDPMAXRETRIES 15
 #define UDPRETRYMS 2000
+#define UDPDROPRETRYMS 250
+#define CWNDINITIAL 16
+#define CWNDMIN 4
+#define PRIOSKIPMAX 8 /* releases before the oldest query goes anyway */
 #define TCPWAITMS 30000
 #define TCPCONNMS 14000
 #define TCPIDLEMS 30000
 #define MAXTTLBELIEVE (7*86400) /* any TTL > 7 days is capped */
 
 #define DNS_PORT 53
+#define SOCKS_PORT 9050 /* Tor */
+#define SOCKS_ALTPORT 9150 /* Tor Browser */
 #define DNS_MAXUDP 512
 #define DNS_MAXLABEL 63
 #define DNS_MAXDOMAIN 255
@@ -72,7 +84,7 @@ typedef unsigned char byte;
 
 #define DNS_INADDR_ARPA "in-addr", "arpa"
 
-#define MAX_POLLFDS  ADNS_POLLFDS_RECOMMENDED
+#define MAX_POLLFDS  (2+MAXUDPCONNS+MAXTCPCONNS)
 
 typedef enum {
   cc_user,
@@ -80,6 +92,13 @@ typedef enum {
   cc_freq
 } consistency_checks;
 
+typedef enum {
+  prio_interactive,
+  prio_normal,
+  prio_bulk,
+  prio_count
+} query_prio;
+
 typedef enum {
   rcode_noerror,
   rcode_formaterror,
@@ -94,6 +113,7 @@ typedef enum {
 typedef struct {
   int used, avail;
   byte *buf;
+  adns_state ads; /* whose allocator to use, or 0 for malloc */
 } vbuf;
 
 typedef struct {
@@ -167,8 +187,15 @@ adns_status adns__qdpl_normal(adns_state ads,
   /* implemented in transmit.c, used by types.c as default
    * and as part of implementation for some fancier types */
 
+typedef union {
+  struct sockaddr sa;
+  struct sockaddr_in inet;
+  struct sockaddr_in6 inet6;
+} adns__sockaddr;
+
 typedef struct allocnode {
   struct allocnode *next, *back;
+  size_t sz; /* including this header, as charged to ads->memused */
 } allocnode;
 
 union maxalign {
@@ -180,24 +207,52 @@ union maxalign {
   union maxalign *up;
 } data;
 
+typedef struct dualaddr {
+  adns_rr_hostaddr *ha; /* 0 if the addresses are the answer itself */
+  adns_query child[2]; /* A and AAAA lookups; 0 once finished */
+  adns_status status[2];
+  int naddrs[2];
+  adns_rr_addr *addrs[2];
+  char *cname;
+} dualaddr;
+
 typedef struct {
   void *ext;
   void (*callback)(adns_query parent, adns_query child);
   union {
     adns_rr_addr ptr_parent_addr;
     adns_rr_hostaddr *hostaddr;
+    int search_slot;
+    struct { dualaddr *da; int fam; } dual;
   } info;
 } qcontext;
 
+typedef struct {
+  enum { slot_pending, slot_continue, slot_final } state;
+  int entry; /* index into ads->searchlist, or -1 for the bare domain */
+  adns_status status;
+  int nrrs, interim_allocd, preserved_allocd;
+  void *rrs;
+  char *cname;
+  time_t expires;
+} searchslot;
+
 struct adns__query {
   adns_state ads;
-  enum { query_tosend, query_tcpw, query_childw, query_done } state;
+  enum {
+    query_tosend, query_cwndw, query_tcpw, query_childw, query_done
+  } state;
   adns_query back, next, parent;
   struct { adns_query head, tail; } children;
   struct { adns_query back, next; } siblings;
+  struct { adns_query back, next; } cwndwclass; /* in cwndwq[prio] */
   struct { allocnode *head, *tail; } allocations;
   int interim_allocd, preserved_allocd;
   void *final_allocspace;
+  size_t memused;
+  /* What we have charged to ads->memused for the query structure,
+   * the answer and query_dgram; allocations are charged separately,
+   * since they may move to another query. */
 
   const typeinfo *typei;
   byte *query_dgram;
@@ -235,17 +290,36 @@ struct adns__query {
    * the vbuf is initialised but empty and everything else is zero.
    */
 
+  searchslot *search_slots;
+  int search_nslots;
+  /* Used instead of _pos and _doneabs with adns_qf_search_parallel.
+   * One slot per candidate, in the order sequential searching would
+   * try them; each is pending until its child query finishes, then
+   * records whether to continue to the next or the child's final
+   * answer (whose memory has been moved to our allocations).
+   */
+
   int id, flags, retries;
-  int udpnextserver;
-  unsigned long udpsent; /* bitmap indexed by server */
+  query_prio prio;
+  /* From adns_qf_interactive or adns_qf_bulk, or the parent's.  Lower
+   * is better; see adns__cwnd_release. */
+  int udpnextserver, udpfirstserver, udpnsent, udpserver;
+  /* We have sent udpnsent datagrams, to servers udpfirstserver,
+   * udpfirstserver+1, ... (mod nservers); udpserver is the one we
+   * sent to last, while we are in udpw. */
+  int tcpconn; /* index into ads->tcpconns, if in tcpw */
   struct timeval timeout;
+  struct timeval udpsent; /* when we last sent to udpserver */
+  struct timeval deadline;
+  /* From adns_submit_deadline, inherited by children; if set, timeout
+   * is never later, and we fail with adns_s_timeout when it passes. */
   time_t expires; /* Earliest expiry time of any record we used. */
 
   qcontext ctx;
 
   /* Possible states:
    *
-   *  state   Queue   child  id   nextudpserver  udpsent     tcpfailed
+   *  state   Queue   child  id   nextudpserver  udpnsent    tcpfailed
    *
    *  tosend  NONE    null   >=0  0              zero        zero
    *  tosend  udpw    null   >=0  any            nonzero     zero
@@ -259,7 +333,7 @@ struct adns__query {
    *
    * Queries are only not on a queue when they are actually being processed.
    * Queries in state tcpw/tcpw have been sent (or are in the to-send buffer)
-   * iff the tcp connection is in state server_ok.
+   * iff their tcp connection is in state server_ok.
    *
    *			      +------------------------+
    *             START -----> |      tosend/NONE       |
@@ -297,27 +371,103 @@ struct adns__query {
    */
 };
 
+struct adns__prepared {
+  /* A question encoded once by adns_prepare, for repeated submission.
+   * All of the memory (including qd and owner) is in one block.
+   */
+  const typeinfo *typei;
+  adns_rrtype type;
+  adns_queryflags flags;
+  adns_status status; /* if nonzero, submissions fail with this */
+  byte *qd; /* QNAME, QTYPE, QCLASS */
+  int qdlen;
+  char *owner; /* null-terminated */
+  int ol;
+};
+
 struct query_queue { adns_query head, tail; };
 
 struct adns__state {
   adns_initflags iflags;
   adns_logcallbackfn *logfn;
   void *logfndata;
+  adns_allocator alloc;
+  adns_transport transport;
+  /* transport.udpsendfn is 0 unless made by adns_init_transport. */
   int configerrno;
-  struct query_queue udpw, tcpw, childw, output;
+  struct query_queue udpw, cwndw, tcpw, childw, output;
+  /* cwndw holds new UDP queries (state query_cwndw) for which there
+   * is no room in the congestion window; see adns__cwnd_release. */
   adns_query forallnext;
-  int nextid, udpsocket, tcpsocket;
-  vbuf tcpsend, tcprecv;
-  int nservers, nsortlist, nsearchlist, searchndots, tcpserver, tcprecv_skip;
-  enum adns__tcpstate {
-    server_disconnected, server_connecting,
-    server_ok, server_broken
-  } tcpstate;
-  struct timeval tcptimeout;
-  /* This will have tv_sec==0 if it is not valid.  It will always be
-   * valid if tcpstate _connecting.  When _ok, it will be nonzero if
-   * we are idle (ie, tcpw queue is empty), in which case it is the
-   * absolute time when we will close the connection.
+  int nextid, udpsocket, udpsocket6;
+  /* udpsocket6 is an AF_INET6 socket, or -1 if there are no IPv6
+   * nameservers. */
+  int udprcvbuf, udpsndbuf; /* adns_rcvbuf, adns_sndbuf; 0 to leave */
+  int tcpproto; /* from getprotobyname, or -1 if not yet looked up */
+  int udpinflight; /* number of queries in udpw, ie sum of nqueries */
+  int ntcpw, nchildw, noutput; /* number of queries in those queues */
+  int cwndmax; /* adns_cwnd option, or 0 for no congestion window */
+  int cwnd, cwndssthresh, cwndacks, cwndskips;
+  int cwndwprio[prio_count]; /* number of each class on cwndw */
+  struct query_queue cwndwq[prio_count];
+  /* The queries on cwndw again, a queue per class, via cwndwclass. */
+  struct timeval cwndholdoff;
+  /* With cwndmax, at most cwnd queries may be in udpw.  cwnd grows by
+   * one for each timely reply while below cwndssthresh, and by one
+   * per cwnd timely replies (counted in cwndacks) above it; on a
+   * timeout it is halved, but not again until cwndholdoff.
+   * cwndskips counts releases which passed over the head of cwndw
+   * for a query of a better priority class. */
+  adns_stats stats; /* the counters only; see adns_getstats */
+  FILE *capture; /* see adns_capture; 0 when not recording */
+  size_t memused, memmax;
+  /* memused is the memory held by queries and their unchecked
+   * answers; with memmax (the adns_maxmem option) submitting a query
+   * fails with ENOBUFS while it is at least that. */
+  unsigned long udpdrops, udpdropslast, udpdropslast6;
+  /* With adns_if_udpdrops, udpdrops is the total reported by the
+   * kernel, and udpdropslast[6] are its own counts for udpsocket[6]
+   * (kept modulo 2^32, like the kernel's). */
+  int nservers, aservers, nsortlist, nsearchlist, searchndots;
+  enum adns__serverselect {
+    serverselect_first, serverselect_weighted, serverselect_leastload
+  } serverselect;
+  int serverselectnext;
+  int ntcpconns;
+  struct adns__tcpconn {
+    int tcpsocket, tcpserver, tcprecv_skip, tcpsend_skip;
+    vbuf tcpsend, tcprecv;
+    /* The first tcpsend_skip bytes of tcpsend have been written; if
+     * all of it has been, tcpsend is emptied. */
+    enum adns__tcpstate {
+      server_disconnected, server_connecting,
+      server_ok, server_broken
+    } tcpstate;
+    struct timeval tcptimeout;
+    /* This will have tv_sec==0 if it is not valid.  It will always be
+     * valid if tcpstate _connecting.  When _ok, it will be nonzero if
+     * we are idle (ie, nqueries is 0), in which case it is the
+     * absolute time when we will close the connection.
+     */
+    int nqueries; /* number of queries in tcpw using this connection */
+    enum adns__socksstate {
+      socks_none, socks_connecting, socks_method, socks_auth, socks_request
+    } socksstate;
+    int socksport, sockslen, sockssent, socksgot;
+    byte socksbuf[22+512];
+    /* SOCKS5 handshake with the Tor proxy (adns_if_tormode), which
+     * happens while tcpstate is _connecting and so is covered by the
+     * same TCPCONNMS timeout.  socksstate is _none when there is no
+     * handshake in progress, _connecting until the proxy on port
+     * socksport accepts, and otherwise names the message we are
+     * exchanging.  That message is sent from socksbuf while sockssent
+     * < sockslen; after that sockslen is 0 and the reply is read into
+     * socksbuf, of which socksgot bytes have arrived so far.
+     */
+  } tcpconns[MAXTCPCONNS];
+  /* Only the first ntcpconns (adns_tcpconns option, default 1) are
+   * used.  Each query in tcpw belongs to one of them (qu->tcpconn),
+   * chosen by load when it moves to TCP.
    */
 #ifndef HAVE_W32_SYSTEM
   struct sigaction stdsigpipe;
@@ -325,8 +475,14 @@ struct adns__state {
 #endif
   struct pollfd pollfds_buf[MAX_POLLFDS];
   struct server {
-    struct in_addr addr;
-  } servers[MAXSERVERS];
+    int len;
+    adns__sockaddr addr; /* including the port, DNS_PORT */
+    int weight, wrrcurrent;
+    int nqueries; /* in udpw with qu->udpserver == this one */
+    int udpsocket; /* connected, or -1 to use the shared one */
+    unsigned long udpdropslast; /* for udpsocket, like ads->udpdropslast */
+    adns_serverstats stats;
+  } *servers; /* aservers allocated, nservers used */
   struct sortlist {
     struct {
       union {
@@ -338,7 +494,19 @@ struct adns__state {
   } sortlist[MAXSORTLIST];
   char **searchlist;
   unsigned short rand48xsubi[3];
-  char *sockscred; /* Malloced string with the SOCKS5 credentials or NULL.  */
+  char *sockscred[MAXTCPCONNS];
+  int nsockscreds;
+  /* Malloced SOCKS5 credentials (adns_sockscred option), of which
+   * connection i uses number i % nsockscreds, if any.  */
+  struct {
+    /* The hosts file index, used if adns_if_hosts; see local.c. */
+    char *file;
+    time_t checked, mtime; /* mtime is -1 if the file was absent */
+    off_t size;
+    char *text;
+    struct adns__hostsent *ents, **byname, **byaddr;
+    int nents, nbuckets;
+  } hosts;
 };
 
 /* From setup.c: */
@@ -367,7 +535,16 @@ int adns__vbuf_append(vbuf *vb, const byte *data, int len);
 /* 1=>success, 0=>realloc failed */
 void adns__vbuf_appendq(vbuf *vb, const byte *data, int len);
 void adns__vbuf_init(vbuf *vb);
+void adns__vbuf_initads(vbuf *vb, adns_state ads);
 void adns__vbuf_free(vbuf *vb);
+/* _init makes a vbuf which uses malloc, _initads one which uses
+ * ads's allocator; _free keeps that choice for any further use. */
+
+extern const adns_allocator adns__stdalloc;
+void *adns__malloc(adns_state ads, size_t sz);
+void *adns__realloc(adns_state ads, void *p, size_t sz);
+void adns__free(adns_state ads, void *p);
+/* Use ads->alloc.  On failure errno is ENOMEM; p may be 0. */
 
 const char *adns__diag_domain(adns_state ads, int serv, adns_query qu,
 			      vbuf *vb,
@@ -392,6 +569,14 @@ void adns__isort(void *array, int nobjs, int sz, void *tempbuf,
  * wrong order) 0 if a<=b (ie, order is fine).
  */
 
+const char *adns__sockaddr_ntoa(const struct sockaddr *sa,
+				char buf[INET6_ADDRSTRLEN]);
+/* Returns the address part of sa (AF_INET or AF_INET6) as text, in
+ * buf or as a string literal.  Never fails. */
+
+int adns__sockaddr_equal(const struct sockaddr *a, const struct sockaddr *b);
+/* Returns !0 if a and b are the same address, ignoring the port. */
+
 void adns__sigpipe_protect(adns_state);
 void adns__sigpipe_unprotect(adns_state);
 /* If SIGPIPE protection is not disabled, will block all signals except
@@ -401,6 +586,15 @@ void adns__sigpipe_unprotect(adns_state);
  * is stored in the adns structure.
  */
 
+int adns__tcp_write(adns_state ads, int fd, const void *buf, int len);
+int adns__tcp_writev(adns_state ads, int fd,
+		     const struct iovec *iov, int iovcnt);
+/* Like adns__sock_write[v] but never raise SIGPIPE.  Where there is
+ * MSG_NOSIGNAL this is done with send[msg]; where there is only
+ * SO_NOSIGPIPE it has been set on all our TCP sockets; otherwise the
+ * write is surrounded by adns__sigpipe_[un]protect.
+ */
+
 /* From transmit.c: */
 
 adns_status adns__mkquery(adns_state ads, vbuf *vb, int *id_r,
@@ -410,6 +604,30 @@ adns_status adns__mkquery(adns_state ads, vbuf *vb, int *id_r,
 /* Assembles a query packet in vb.  A new id is allocated and returned.
  */
 
+adns_status adns__mkquery_question(adns_state ads, vbuf *vb,
+				   const char *owner, int ol,
+				   const typeinfo *typei, adns_rrtype type,
+				   adns_queryflags flags);
+/* Appends just the question section (QNAME, QTYPE, QCLASS) for owner
+ * to vb, without touching the header or allocating an id.  Used by
+ * adns__mkquery and to build prepared queries.
+ */
+
+adns_status adns__mkquery_question_wire(adns_state ads, vbuf *vb,
+					const byte *qname, int qnamelen,
+					adns_rrtype type);
+/* Like adns__mkquery_question but the owner is already in wire
+ * format; it is checked (no compression, sane lengths, exactly
+ * qnamelen bytes) and copied.
+ */
+
+adns_status adns__mkquery_prepared(adns_state ads, vbuf *vb, int *id_r,
+				   const byte *qd, int qdlen);
+/* Assembles a query packet in vb from a question section which has
+ * already been encoded (by adns__mkquery_question); only the header
+ * is built afresh.  A new id is allocated and returned.
+ */
+
 adns_status adns__mkquery_frdgram(adns_state ads, vbuf *vb, int *id_r,
 				  const byte *qd_dgram, int qd_dglen,
 				  int qd_begin,
@@ -424,6 +642,9 @@ void adns__querysend_tcp(adns_query qu, struct timeval now);
  * might be broken, but no reconnect will be attempted.
  */
 
+void adns__query_settimeout(adns_query qu, struct timeval now, long ms);
+/* Sets qu->timeout to ms after now, or to its deadline if sooner. */
+
 void adns__query_send(adns_query qu, struct timeval now);
 /* Query must be in state tosend/NONE; it will be moved to a new state,
  * and no further processing can be done on it for now.
@@ -431,12 +652,34 @@ void adns__query_send(adns_query qu, struct timeval now);
  * connected), tcpsent/timew, child/childw or done/output.)
  * __query_send may decide to use either UDP or TCP depending whether
  * _qf_usevc is set (or has become set) and whether the query is too
- * large.
+ * large.  A new UDP query may instead have to wait on cwndw.
+ */
+
+void adns__cwnd_ack(adns_query qu);
+void adns__cwnd_loss(adns_state ads, struct timeval now);
+/* Adjust the congestion window (if any) for a UDP reply to qu, just
+ * taken off udpw, or for a timeout or other sign of loss. */
+
+void adns__cwndw_unlink(adns_state ads, adns_query qu);
+/* Takes qu, which must be in state cwndw, off cwndw and its class's
+ * queue; its state is left for the caller to change. */
+
+int adns__cwnd_release(adns_state ads, int act, struct timeval now);
+/* Sends queries waiting on cwndw for which there is now room, if act,
+ * best priority class first but the oldest after every PRIOSKIPMAX
+ * passed over.  Returns !0 if there are any (or, if act, were any)
+ * to send.
  */
 
 /* From query.c: */
 
+void adns__mem_charge(adns_query qu, size_t sz);
+void adns__mem_uncharge(adns_query qu, size_t sz);
+/* Adjust qu->memused and ads->memused, for memory which belongs to
+ * qu other than through its allocations. */
+
 adns_status adns__internal_submit(adns_state ads, adns_query *query_r,
+				  adns_query parent,
 				  const typeinfo *typei, vbuf *qumsg_vb,
 				  int id,
 				  adns_queryflags flags, struct timeval now,
@@ -444,6 +687,8 @@ adns_status adns__internal_submit(adns_state ads, adns_query *query_r,
 /* Submits a query (for internal use, called during external submits).
  *
  * The new query is returned in *query_r, or we return adns_s_nomemory.
+ * It has parent's deadline, but the caller must link it in as one of
+ * parent's children.
  *
  * The query datagram should already have been assembled in qumsg_vb;
  * the memory for it is _taken over_ by this routine whether it
@@ -520,6 +765,13 @@ void *adns__alloc_mine(adns_query qu, size_t sz);
  * will be freed when we're done with the query.
  */
 
+void adns__adopt_allocs(adns_query from, adns_query to);
+/* Moves all of from's allocations to to, as if made there with
+ * _alloc_mine.  Used by child callbacks which keep parts of a child's
+ * answer for a while; they must be copied (or the sizes accounted for)
+ * before becoming part of the parent's own answer.
+ */
+
 void *adns__alloc_final(adns_query qu, size_t sz);
 /* Cannot fail, and cannot return 0.
  */
@@ -538,8 +790,21 @@ void adns__reset_preserved(adns_query qu);
 void adns__query_done(adns_query qu);
 void adns__query_fail(adns_query qu, adns_status stat);
 
+void adns__cancel(adns_query qu);
+/* adns_cancel, except that it does not send queries waiting for room
+ * in the congestion window; for use while processing other queries,
+ * whose caller will do that. */
+
 /* From reply.c: */
 
+void adns__capture_query(adns_state ads, const char *owner, int ol,
+			 adns_rrtype type, adns_queryflags flags,
+			 struct timeval now);
+void adns__capture_dgram(adns_state ads, int kind, int serv, int viatcp,
+			 const byte *dgram, int len, struct timeval now);
+/* Append a record to ads->capture, which must be set.  kind is 'S'
+ * or 'R'. */
+
 void adns__procdgram(adns_state ads, const byte *dgram, int len,
 		     int serv, int viatcp, struct timeval now);
 /* This function is allowed to cause new datagrams to be constructed
@@ -551,10 +816,41 @@ void adns__procdgram(adns_state ads, const byte *dgram, int len,
  * Sending functions may NOT call receiving functions.
  */
 
+/* From local.c: */
+
+int adns__local_answer(adns_state ads, adns_query qu,
+		       const char *owner, int ol, struct timeval now);
+/* Tries to answer a top-level query (or a candidate of a parallel
+ * search, whose parent copes with it finishing straight away) without
+ * going to the network, if adns_if_hosts is set: from an address
+ * literal, or from the hosts file (which is reread if it has changed,
+ * checking at most once a second).  owner is as for adns__mkquery.
+ * Returns 1 if qu has been completed (with adns__query_done or
+ * _fail); 0 if it should be sent as usual.
+ */
+
+int adns__local_fakeptr(adns_query qu);
+/* Called by adns__query_fail.  If qu is a top-level PTR query with
+ * adns_qf_fakeptr, completes it successfully with the numeric form of
+ * the address and returns 1.  Otherwise returns 0.
+ */
+
+void adns__local_init(adns_state ads);
+int adns__local_setfile(adns_state ads, const char *file, int l);
+void adns__local_finish(adns_state ads);
+/* _setfile copies the filename and returns 0 or an errno value. */
+
 /* From types.c: */
 
 const typeinfo *adns__findtype(adns_rrtype type);
 
+void adns__dualaddr_query(adns_state ads, adns_query qu,
+			  const char *owner, int ol, struct timeval now);
+/* Does the work of query_simple for an adns_r_addr query with
+ * adns_qf_dualstack: makes A and AAAA child queries and puts qu on
+ * childw, or fails it.  The children's answers are merged into qu's.
+ */
+
 /* From parse.c: */
 
 typedef struct {
@@ -689,10 +985,12 @@ int vbuf__append_quoted1035(vbuf *vb, const byte *buf, int len);
 
 /* From event.c: */
 
-void adns__tcp_broken(adns_state ads, const char *what, const char *why);
+void adns__tcp_broken(adns_state ads, struct adns__tcpconn *tc,
+		      const char *what, const char *why);
 /* what and why may be both 0, or both non-0. */
 
-void adns__tcp_tryconnect(adns_state ads, struct timeval now);
+void adns__tcp_tryconnect(adns_state ads, struct adns__tcpconn *tc,
+			  struct timeval now);
 
 void adns__autosys(adns_state ads, struct timeval now);
 /* Make all the system calls we want to if the application wants us to.
@@ -700,6 +998,8 @@ void adns__autosys(adns_state ads, struct timeval now);
  * lest we end up in recursive descent !
  */
 
+int adns__gettimeofday(adns_state ads, struct timeval *tv);
+/* Like gettimeofday, but honours adns_if_monotonic. */
 void adns__must_gettimeofday(adns_state ads, const struct timeval **now_io,
 			     struct timeval *tv_buf);
 
@@ -759,6 +1059,31 @@ static inline int errno_resources(int e) { return e==ENOMEM || e==ENOBUFS; }
 		       (tv)|=GETIL_B(cb)		\
 		      )
 
+/* Static probes on the query lifecycle (configure --enable-usdt), for
+ * systemtap or bpftrace; otherwise they compile to nothing.  Each
+ * ADNS_QPROBE fires provider "adns" probe name with arguments: the
+ * query (as an id), its DNS message id, its RR type, a server or
+ * connection index (-1 if none; the status, for done) and the
+ * seconds and microseconds of adns's notion of the current time.
+ * The child probe instead has the parent, the child, its RR type
+ * and the time. */
+#ifdef ENABLE_USDT
+/* Each probe has a semaphore, nonzero while a tracer is attached to
+ * it; they are defined in query.c. */
+extern unsigned short adns_child_semaphore, adns_submit_semaphore,
+  adns_done_semaphore, adns_reply_semaphore, adns_tcp_enqueue_semaphore,
+  adns_udp_send_semaphore, adns_timeout_semaphore;
+# define ADNS_PROBE_ENABLED(name) __builtin_expect(adns_##name##_semaphore,0)
+# define ADNS_PROBE5(name,a,b,c,d,e) DTRACE_PROBE5(adns,name,a,b,c,d,e)
+# define ADNS_QPROBE(name,qu,serv,now)				\
+  DTRACE_PROBE6(adns,name,(qu),(qu)->id,(qu)->typei->typekey,	\
+		(serv),(now).tv_sec,(now).tv_usec)
+#else
+# define ADNS_PROBE_ENABLED(name) 0
+# define ADNS_PROBE5(name,a,b,c,d,e) ((void)0)
+# define ADNS_QPROBE(name,qu,serv,now) ((void)0)
+#endif
+
 
 /* To avoid that a compiler optimizes certain memset calls away, this
    macro may be used instead.  */
@@ -0,0 +1,529 @@
+/*
+ * local.c
+ * - answering queries without asking a nameserver:
+ *   address literals, the hosts file, and numeric reverse answers
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006  Ian Jackson
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+#endif
+
+#include "internal.h"
+
+#ifdef HAVE_W32_SYSTEM
+# define local_inet_pton(af,src,dst) adns__inet_pton((af),(src),(dst))
+# define local_inet_ntop(af,src,dst,cnt) adns__inet_ntop((af),(src),(dst),(cnt))
+#else
+# define local_inet_pton(af,src,dst) inet_pton((af),(src),(dst))
+# define local_inet_ntop(af,src,dst,cnt) inet_ntop((af),(src),(dst),(cnt))
+#endif
+
+/*
+ * The hosts file is read into one buffer, which is then chopped up
+ * in place.  Each name on each line gets a hostsent; they are
+ * indexed by name (all of them) and by address (only the first name
+ * on each line, which is the canonical one).  Both indexes are
+ * chained hash tables with the same number of buckets.
+ */
+
+struct adns__hostsent {
+  struct adns__hostsent *namenext, *addrnext;
+  const char *name, *canon;
+  int af;
+  union {
+    struct in_addr inet;
+    struct in6_addr inet6;
+  } addr;
+};
+
+static unsigned long hash_name(const char *p, int l) {
+  unsigned long h;
+
+  for (h= 5381; l>0; l--, p++) h= h*33 + tolower((unsigned char)*p);
+  return h;
+}
+
+static unsigned long hash_addr(int af, const void *addr) {
+  const byte *p= addr;
+  unsigned long h;
+  int l;
+
+  l= af == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+  for (h= 5381; l>0; l--, p++) h= h*33 + *p;
+  return h;
+}
+
+static int name_eq(const char *name, const char *p, int l) {
+  for (; l>0; l--, p++, name++)
+    if (!*name || tolower((unsigned char)*name) != tolower((unsigned char)*p))
+      return 0;
+  return !*name;
+}
+
+static int addr_eq(const struct adns__hostsent *he, int af, const void *addr) {
+  if (he->af != af) return 0;
+  if (af == AF_INET6)
+    return !memcmp(&he->addr.inet6,addr,sizeof(he->addr.inet6));
+  return !memcmp(&he->addr.inet,addr,sizeof(he->addr.inet));
+}
+
+static int parse_addr(const char *p, int *af_r, void *addr_r) {
+  /* Accepts only the strict dotted quad and RFC4291 forms (so not
+   * 127.1 and friends, which are valid host names too). */
+  if (local_inet_pton(AF_INET,p,addr_r) == 1) {
+    *af_r= AF_INET; return 1;
+  }
+  if (local_inet_pton(AF_INET6,p,addr_r) == 1) {
+    *af_r= AF_INET6; return 1;
+  }
+  return 0;
+}
+
+static void hosts_clear(adns_state ads) {
+  adns__free(ads,ads->hosts.text);
+  adns__free(ads,ads->hosts.ents);
+  adns__free(ads,ads->hosts.byname);
+  ads->hosts.text= 0;
+  ads->hosts.ents= 0;
+  ads->hosts.byname= ads->hosts.byaddr= 0;
+  ads->hosts.nents= ads->hosts.nbuckets= 0;
+}
+
+static char *nextfield(char **p_io) {
+  char *p, *f;
+
+  p= *p_io;
+  while (*p && ctype_whitespace(*p)) p++;
+  if (!*p) { *p_io= p; return 0; }
+  f= p;
+  while (*p && !ctype_whitespace(*p)) p++;
+  if (*p) *p++= 0;
+  *p_io= p;
+  return f;
+}
+
+static void hosts_load(adns_state ads) {
+  vbuf vb;
+  FILE *file;
+  char buf[1024], *p, *line, *eol, *field, *canon;
+  struct adns__hostsent *he, **bucket;
+  union { struct in_addr inet; struct in6_addr inet6; } addr;
+  int n, af, nents, nbuckets, i;
+  unsigned long h;
+
+  hosts_clear(ads);
+
+  file= fopen(ads->hosts.file,"r");
+  if (!file) {
+    if (errno != ENOENT)
+      adns__diag(ads,-1,0,"unable to open hosts file `%s': %s",
+		 ads->hosts.file,strerror(errno));
+    return;
+  }
+  adns__vbuf_initads(&vb,ads);
+  while ((n= fread(buf,1,sizeof(buf),file)) > 0)
+    if (!adns__vbuf_append(&vb,(const byte*)buf,n)) goto x_nomem;
+  if (ferror(file)) {
+    adns__diag(ads,-1,0,"error reading hosts file `%s': %s",
+	       ads->hosts.file,strerror(errno));
+    goto x_free;
+  }
+  if (!adns__vbuf_append(&vb,(const byte*)"",1)) goto x_nomem;
+  fclose(file); file= 0;
+
+  /* First pass: count the names, so that we can allocate once. */
+  nents= 0;
+  for (p= (char*)vb.buf; *p; p++)
+    if (!ctype_whitespace(*p) && (p == (char*)vb.buf ||
+				  ctype_whitespace(p[-1])))
+      nents++;
+
+  ads->hosts.text= (char*)vb.buf;
+  adns__vbuf_initads(&vb,ads);
+  if (!nents) return;
+
+  for (nbuckets= 16; nbuckets < nents; nbuckets <<= 1);
+  ads->hosts.ents= adns__malloc(ads,sizeof(*ads->hosts.ents)*nents);
+  ads->hosts.byname= adns__malloc(ads,
+				  sizeof(*ads->hosts.byname)*nbuckets*2);
+  if (!ads->hosts.ents || !ads->hosts.byname) goto x_nomem;
+  ads->hosts.byaddr= ads->hosts.byname + nbuckets;
+  for (i=0; i<nbuckets*2; i++) ads->hosts.byname[i]= 0;
+  ads->hosts.nbuckets= nbuckets;
+
+  /* Second pass: chop up the lines and build the entries. */
+  nents= 0;
+  for (line= ads->hosts.text; *line; line= eol) {
+    eol= line + strcspn(line,"\n");
+    if (*eol) *eol++= 0;
+    p= strchr(line,'#'); if (p) *p= 0;
+
+    p= line;
+    field= nextfield(&p);
+    if (!field || !parse_addr(field,&af,&addr)) continue;
+
+    canon= 0;
+    while ((field= nextfield(&p))) {
+      n= strlen(field);
+      if (n>1 && field[n-1] == '.') field[--n]= 0;
+      he= &ads->hosts.ents[nents++];
+      if (!canon) canon= field;
+      he->name= field;
+      he->canon= canon;
+      he->af= af;
+      memcpy(&he->addr,&addr,sizeof(he->addr));
+      he->namenext= he->addrnext= 0;
+    }
+  }
+  ads->hosts.nents= nents;
+
+  /* Link the entries in file order, so that the first line wins. */
+  for (i=nents-1; i>=0; i--) {
+    he= &ads->hosts.ents[i];
+    h= hash_name(he->name,strlen(he->name));
+    bucket= &ads->hosts.byname[h & (nbuckets-1)];
+    he->namenext= *bucket; *bucket= he;
+    if (he->name != he->canon) continue;
+    h= hash_addr(he->af,&he->addr);
+    bucket= &ads->hosts.byaddr[h & (nbuckets-1)];
+    he->addrnext= *bucket; *bucket= he;
+  }
+  return;
+
+ x_nomem:
+  adns__diag(ads,-1,0,"out of memory reading hosts file `%s'",
+	     ads->hosts.file);
+ x_free:
+  if (file) fclose(file);
+  adns__vbuf_free(&vb);
+  hosts_clear(ads);
+}
+
+static void hosts_check(adns_state ads, struct timeval now) {
+  struct stat stab;
+
+  if (ads->hosts.checked == now.tv_sec) return;
+  ads->hosts.checked= now.tv_sec;
+
+  if (stat(ads->hosts.file,&stab)) {
+    if (ads->hosts.mtime != -1) hosts_clear(ads);
+    ads->hosts.mtime= -1;
+    return;
+  }
+  if (stab.st_mtime == ads->hosts.mtime && stab.st_size == ads->hosts.size)
+    return;
+
+  adns__debug(ads,-1,0,"(re)reading hosts file `%s'",ads->hosts.file);
+  ads->hosts.mtime= stab.st_mtime;
+  ads->hosts.size= stab.st_size;
+  hosts_load(ads);
+}
+
+/*
+ * Constructing the answers.
+ */
+
+static int local_wants(adns_query qu, int af) {
+  switch (qu->answer->type) {
+  case adns_r_a:
+    return af == AF_INET;
+  case adns_r_aaaa: case adns_r_addr6:
+    return af == AF_INET6;
+  case adns_r_addr:
+    return af == AF_INET ||
+      (af == AF_INET6 && (qu->flags & adns_qf_dualstack));
+  default:
+    return 0;
+  }
+}
+
+static void local_addrs(adns_query qu,
+			const struct adns__hostsent *const *hes, int naddrs) {
+  /* hes is an array of naddrs entries, all of a family the query
+   * wants (see local_wants).  Completes the query. */
+  const struct adns__hostsent *he;
+  adns_answer *ans;
+  adns_rr_addr *rra;
+  byte *rrs;
+  int i;
+
+  ans= qu->answer;
+  rrs= adns__alloc_interim(qu,ans->rrsz*naddrs);
+  if (!rrs) { adns__query_fail(qu,adns_s_nomemory); return; }
+
+  for (i=0; i<naddrs; i++) {
+    he= hes[i];
+    if (ans->type == adns_r_addr || ans->type == adns_r_addr6) {
+      rra= (adns_rr_addr*)(rrs + i*ans->rrsz);
+      memset(rra,0,sizeof(*rra));
+      if (he->af == AF_INET6) {
+	rra->len= sizeof(rra->addr.inet6);
+	rra->addr.inet6.sin6_family= AF_INET6;
+	rra->addr.inet6.sin6_addr= he->addr.inet6;
+      } else {
+	rra->len= sizeof(rra->addr.inet);
+	rra->addr.inet.sin_family= AF_INET;
+	rra->addr.inet.sin_addr= he->addr.inet;
+      }
+    } else {
+      memcpy(rrs + i*ans->rrsz,&he->addr,ans->rrsz);
+    }
+  }
+  ans->rrs.untyped= rrs;
+  ans->nrrs= naddrs;
+  adns__query_done(qu);
+}
+
+static void local_ptr(adns_query qu, const char *name) {
+  adns_answer *ans;
+  char **rrp;
+  int l;
+
+  ans= qu->answer;
+  l= strlen(name);
+  rrp= adns__alloc_interim(qu,sizeof(*rrp));
+  if (!rrp) goto x_nomemory;
+  *rrp= adns__alloc_interim(qu,l+1);
+  if (!*rrp) goto x_nomemory;
+  memcpy(*rrp,name,l+1);
+
+  ans->rrs.str= rrp;
+  ans->nrrs= 1;
+  adns__query_done(qu);
+  return;
+
+ x_nomemory:
+  adns__query_fail(qu,adns_s_nomemory);
+}
+
+#define MAXREVLABELS 34
+
+static int reverse_addr(const char *const *labels, const int *lens,
+			int nlabels, int *af_r, void *addr_r) {
+  /* Extracts the address from the labels of a reverse query domain.
+   * Returns 0 if the domain is not in in-addr.arpa or ip6.arpa, or is
+   * not a complete address. */
+  int i, j, v;
+  byte *out;
+
+#define LABEL_IS(n,s) \
+  (lens[(n)] == sizeof(s)-1 && name_eq((s),labels[(n)],lens[(n)]))
+
+  out= addr_r;
+  if (nlabels == 6 && LABEL_IS(4,"in-addr") && LABEL_IS(5,"arpa")) {
+    for (i=0; i<4; i++) {
+      if (lens[i] < 1 || lens[i] > 3) return 0;
+      if (lens[i] > 1 && labels[i][0] == '0') return 0;
+      for (v=0, j=0; j<lens[i]; j++) {
+	if (!ctype_digit(labels[i][j])) return 0;
+	v= v*10 + labels[i][j]-'0';
+      }
+      if (v > 255) return 0;
+      out[3-i]= v;
+    }
+    *af_r= AF_INET;
+    return 1;
+  }
+  if (nlabels == 34 && LABEL_IS(32,"ip6") && LABEL_IS(33,"arpa")) {
+    memset(out,0,sizeof(struct in6_addr));
+    for (i=0; i<32; i++) {
+      if (lens[i] != 1) return 0;
+      v= tolower((unsigned char)labels[i][0]);
+      if (ctype_digit(v)) v -= '0';
+      else if (v >= 'a' && v <= 'f') v -= 'a'-10;
+      else return 0;
+      out[15 - i/2] |= (i & 1) ? v<<4 : v;
+    }
+    *af_r= AF_INET6;
+    return 1;
+  }
+  return 0;
+
+#undef LABEL_IS
+}
+
+static int reverse_addr_text(const char *owner, int ol,
+			     int *af_r, void *addr_r) {
+  const char *labels[MAXREVLABELS], *p, *pe, *dot;
+  int lens[MAXREVLABELS], nlabels;
+
+  if (memchr(owner,'\\',ol)) return 0;
+  for (nlabels=0, p=owner, pe=owner+ol; p<pe; nlabels++, p=dot+1) {
+    if (nlabels == MAXREVLABELS) return 0;
+    dot= memchr(p,'.',pe-p);
+    if (!dot) dot= pe;
+    labels[nlabels]= p;
+    lens[nlabels]= dot-p;
+  }
+  return reverse_addr(labels,lens,nlabels, af_r,addr_r);
+}
+
+static int reverse_addr_dgram(adns_query qu, int *af_r, void *addr_r) {
+  const char *labels[MAXREVLABELS];
+  int lens[MAXREVLABELS], nlabels, lablen, labstart;
+  findlabel_state fls;
+  adns_status st;
+
+  if (!qu->query_dgram) return 0;
+  adns__findlabel_start(&fls,qu->ads,-1,0,
+			qu->query_dgram,qu->query_dglen,qu->query_dglen,
+			DNS_HDRSIZE,0);
+  for (nlabels=0;; nlabels++) {
+    st= adns__findlabel_next(&fls,&lablen,&labstart);
+    if (st || lablen<0) return 0;
+    if (!lablen) break;
+    if (nlabels == MAXREVLABELS) return 0;
+    labels[nlabels]= (const char*)qu->query_dgram + labstart;
+    lens[nlabels]= lablen;
+  }
+  return reverse_addr(labels,lens,nlabels, af_r,addr_r);
+}
+
+/*
+ * Entry points.
+ */
+
+int adns__local_answer(adns_state ads, adns_query qu,
+		       const char *owner, int ol, struct timeval now) {
+  union { struct in_addr inet; struct in6_addr inet6; } addr;
+  struct adns__hostsent *he, lit;
+  const struct adns__hostsent *hep;
+  vbuf vb;
+  char buf[INET6_ADDRSTRLEN];
+  int af, naddrs;
+  unsigned long h;
+
+  if (!(ads->iflags & adns_if_hosts)) return 0;
+  if (qu->parent && !qu->parent->search_nslots) return 0;
+
+  switch (qu->answer->type) {
+  case adns_r_a: case adns_r_aaaa: case adns_r_addr: case adns_r_addr6:
+    break;
+  case adns_r_ptr: case adns_r_ptr_raw:
+    if (!reverse_addr_text(owner,ol,&af,&addr)) return 0;
+    hosts_check(ads,now);
+    if (!ads->hosts.nbuckets) return 0;
+    h= hash_addr(af,&addr);
+    for (he= ads->hosts.byaddr[h & (ads->hosts.nbuckets-1)];
+	 he && !addr_eq(he,af,&addr);
+	 he= he->addrnext);
+    if (!he) return 0;
+    local_ptr(qu,he->canon);
+    return 1;
+  default:
+    return 0;
+  }
+
+  if (ol>0 && ol<(int)sizeof(buf) && !memchr(owner,'\\',ol)) {
+    memcpy(buf,owner,ol); buf[ol]= 0;
+    if (parse_addr(buf,&lit.af,&lit.addr)) {
+      /* A literal of the other family is not worth asking about. */
+      if (local_wants(qu,lit.af)) {
+	hep= &lit;
+	local_addrs(qu,&hep,1);
+      } else {
+	adns__query_fail(qu,adns_s_nodata);
+      }
+      return 1;
+    }
+  }
+
+  hosts_check(ads,now);
+  if (!ads->hosts.nbuckets) return 0;
+
+  adns__vbuf_initads(&vb,ads);
+  naddrs= 0;
+  h= hash_name(owner,ol);
+  for (he= ads->hosts.byname[h & (ads->hosts.nbuckets-1)];
+       he;
+       he= he->namenext) {
+    if (!local_wants(qu,he->af) || !name_eq(he->name,owner,ol)) continue;
+    hep= he;
+    if (!adns__vbuf_append(&vb,(const byte*)&hep,sizeof(hep))) {
+      adns__vbuf_free(&vb);
+      adns__query_fail(qu,adns_s_nomemory);
+      return 1;
+    }
+    naddrs++;
+  }
+  if (naddrs) local_addrs(qu,(const struct adns__hostsent**)vb.buf,naddrs);
+  adns__vbuf_free(&vb);
+  return naddrs > 0;
+}
+
+int adns__local_fakeptr(adns_query qu) {
+  union { struct in_addr inet; struct in6_addr inet6; } addr;
+  char buf[INET6_ADDRSTRLEN];
+  int af;
+
+  if (!(qu->flags & adns_qf_fakeptr)) return 0;
+  if (qu->parent) return 0;
+  if (qu->answer->type != adns_r_ptr && qu->answer->type != adns_r_ptr_raw)
+    return 0;
+  if (!reverse_addr_dgram(qu,&af,&addr)) return 0;
+  if (!local_inet_ntop(af,&addr,buf,sizeof(buf))) return 0;
+
+  qu->answer->status= adns_s_ok;
+  local_ptr(qu,buf);
+  return 1;
+}
+
+void adns__local_init(adns_state ads) {
+  ads->hosts.file= 0;
+  ads->hosts.checked= 0;
+  ads->hosts.mtime= -1;
+  ads->hosts.size= 0;
+  ads->hosts.text= 0;
+  ads->hosts.ents= 0;
+  ads->hosts.byname= ads->hosts.byaddr= 0;
+  ads->hosts.nents= ads->hosts.nbuckets= 0;
+}
+
+int adns__local_setfile(adns_state ads, const char *file, int l) {
+  char *copy;
+
+  copy= adns__malloc(ads,l+1); if (!copy) return errno;
+  memcpy(copy,file,l);
+  copy[l]= 0;
+  adns__free(ads,ads->hosts.file);
+  ads->hosts.file= copy;
+  ads->hosts.checked= 0;
+  ads->hosts.mtime= -1;
+  hosts_clear(ads);
+  return 0;
+}
+
+void adns__local_finish(adns_state ads) {
+  hosts_clear(ads);
+  adns__free(ads,ads->hosts.file);
+  ads->hosts.file= 0;
+}
@@ -74,6 +74,8 @@ int adns__sock_write (int fd, const void *buffer, size_t size);
 int adns__sock_sendto (int fd, void *buffer, size_t size, int flags, 
                        const struct sockaddr *addr, int length);
 int adns__sock_writev (int fd, const struct iovec *iov, int iovcount);
+int adns__sock_setsockopt (int fd, int level, int optname,
+                           const void *optval, int optlen);
 int adns__sock_close (int fd);
 int adns__sock_select (int nfds, fd_set *rset, fd_set *wset, fd_set *xset,
                        const struct timeval *timeout);
@@ -88,6 +90,7 @@ long int nrand48 (unsigned short int xsubi[3]);
 
 /* w32inet.c:  */
 const char *adns__inet_ntop (int af, const void *src, char *dst, socklen_t cnt);
+int adns__inet_pton (int af, const char *src, void *dst);
 
 #else
 /*
@@ -99,12 +102,18 @@ const char *adns__inet_ntop (int af, const void *src, char *dst, socklen_t cnt);
 #define adns__sock_connect(a,b,c)        connect((a),(b),(c))
 #define adns__sock_read(a,b,c)           read((a),(b),(c))
 #define adns__sock_recvfrom(a,b,c,d,e,f) recvfrom((a),(b),(c),(d),(e),(f))
+#define adns__sock_recvmsg(a,b,c)        recvmsg((a),(b),(c))
 #define adns__sock_write(a,b,c)          write((a),(b),(c))
 #define adns__sock_sendto(a,b,c,d,e,f)   sendto((a),(b),(c),(d),(e),(f))
 #define adns__sock_writev(a, b, c)       writev((a),(b),(c)) 
+#define adns__sock_send(a,b,c,d)         send((a),(b),(c),(d))
+#define adns__sock_sendmsg(a,b,c)        sendmsg((a),(b),(c))
+#define adns__sock_setsockopt(a,b,c,d,e) setsockopt((a),(b),(c),(d),(e))
 #define adns__sock_close(a)              close((a))
 #define adns__sock_select(a,b,c,d,e)     select((a),(b),(c),(d),(e))
 #define adns__inet_aton(a,b)             inet_aton((a),(b))
+#define adns__inet_ntop(a,b,c,d)         inet_ntop((a),(b),(c),(d))
+#define adns__inet_pton(a,b,c)           inet_pton((a),(b),(c))
 
 
 #endif
@@ -36,21 +36,35 @@
 
 #include "internal.h"
 
+#ifdef ENABLE_USDT
+# define PROBE_SEMAPHORE __attribute__((unused,section(".probes")))
+unsigned short adns_child_semaphore PROBE_SEMAPHORE;
+unsigned short adns_submit_semaphore PROBE_SEMAPHORE;
+unsigned short adns_done_semaphore PROBE_SEMAPHORE;
+unsigned short adns_reply_semaphore PROBE_SEMAPHORE;
+unsigned short adns_tcp_enqueue_semaphore PROBE_SEMAPHORE;
+unsigned short adns_udp_send_semaphore PROBE_SEMAPHORE;
+unsigned short adns_timeout_semaphore PROBE_SEMAPHORE;
+#endif
+
 static adns_query query_alloc(adns_state ads,
 			      const typeinfo *typei, adns_rrtype type,
 			      adns_queryflags flags, struct timeval now) {
   /* Allocate a virgin query and return it. */
   adns_query qu;
 
-  qu= malloc(sizeof(*qu));  if (!qu) return 0;
-  qu->answer= malloc(sizeof(*qu->answer));
-  if (!qu->answer) { free(qu); return 0; }
+  qu= adns__malloc(ads,sizeof(*qu));  if (!qu) return 0;
+  qu->answer= adns__malloc(ads,sizeof(*qu->answer));
+  if (!qu->answer) { adns__free(ads,qu); return 0; }
 
   qu->ads= ads;
+  qu->memused= 0;
+  adns__mem_charge(qu, sizeof(*qu) + sizeof(*qu->answer));
   qu->state= query_tosend;
   qu->back= qu->next= qu->parent= 0;
   LIST_INIT(qu->children);
   LINK_INIT(qu->siblings);
+  LINK_INIT(qu->cwndwclass);
   LIST_INIT(qu->allocations);
   qu->interim_allocd= 0;
   qu->preserved_allocd= 0;
@@ -59,20 +73,26 @@ static adns_query query_alloc(adns_state ads,
   qu->typei= typei;
   qu->query_dgram= 0;
   qu->query_dglen= 0;
-  adns__vbuf_init(&qu->vb);
+  adns__vbuf_initads(&qu->vb,ads);
 
   qu->cname_dgram= 0;
   qu->cname_dglen= qu->cname_begin= 0;
 
-  adns__vbuf_init(&qu->search_vb);
+  adns__vbuf_initads(&qu->search_vb,ads);
   qu->search_origlen= qu->search_pos= qu->search_doneabs= 0;
+  qu->search_slots= 0;
+  qu->search_nslots= 0;
 
   qu->id= -2; /* will be overwritten with real id before we leave adns */
   qu->flags= flags;
+  qu->prio= (flags & adns_qf_interactive) ? prio_interactive :
+	    (flags & adns_qf_bulk) ? prio_bulk : prio_normal;
   qu->retries= 0;
-  qu->udpnextserver= 0;
-  qu->udpsent= 0;
+  qu->udpnextserver= qu->udpfirstserver= qu->udpnsent= qu->udpserver= 0;
+  qu->tcpconn= 0;
   timerclear(&qu->timeout);
+  timerclear(&qu->udpsent);
+  timerclear(&qu->deadline);
   qu->expires= now.tv_sec + MAXTTLBELIEVE;
 
   memset(&qu->ctx,0,sizeof(qu->ctx));
@@ -96,19 +116,21 @@ static void query_submit(adns_state ads, adns_query qu,
    */
 
   qu->vb= *qumsg_vb;
-  adns__vbuf_init(qumsg_vb);
+  adns__vbuf_initads(qumsg_vb,ads);
 
-  qu->query_dgram= malloc(qu->vb.used);
+  qu->query_dgram= adns__malloc(ads,qu->vb.used);
   if (!qu->query_dgram) { adns__query_fail(qu,adns_s_nomemory); return; }
 
   qu->id= id;
   qu->query_dglen= qu->vb.used;
   memcpy(qu->query_dgram,qu->vb.buf,qu->vb.used);
+  adns__mem_charge(qu,qu->query_dglen);
 
   adns__query_send(qu,now);
 }
 
 adns_status adns__internal_submit(adns_state ads, adns_query *query_r,
+				  adns_query parent,
 				  const typeinfo *typei, vbuf *qumsg_vb,
 				  int id,
 				  adns_queryflags flags, struct timeval now,
@@ -118,6 +140,9 @@ adns_status adns__internal_submit(adns_state ads, adns_query *query_r,
   qu= query_alloc(ads,typei,typei->typekey,flags,now);
   if (!qu) { adns__vbuf_free(qumsg_vb); return adns_s_nomemory; }
   *query_r= qu;
+  qu->deadline= parent->deadline;
+  qu->prio= parent->prio;
+  ADNS_PROBE5(child,parent,qu,typei->typekey,now.tv_sec,now.tv_usec);
 
   memcpy(&qu->ctx,ctx,sizeof(qu->ctx));
   query_submit(ads,qu, typei,qumsg_vb,id,flags,now);
@@ -128,13 +153,24 @@ adns_status adns__internal_submit(adns_state ads, adns_query *query_r,
 static void query_simple(adns_state ads, adns_query qu,
 			 const char *owner, int ol,
 			 const typeinfo *typei, adns_queryflags flags,
-			 struct timeval now) {
+			 adns_prepared prep, struct timeval now) {
+  /* prep, if not 0, has the question already made for owner. */
   vbuf vb_new;
   int id;
   adns_status stat;
 
-  stat= adns__mkquery(ads,&qu->vb,&id, owner,ol,
-		      typei,qu->answer->type, flags);
+  if (adns__local_answer(ads,qu, owner,ol, now)) return;
+
+  if (typei->typekey == adns_r_addr && (flags & adns_qf_dualstack)) {
+    adns__dualaddr_query(ads,qu, owner,ol, now);
+    return;
+  }
+
+  if (prep)
+    stat= adns__mkquery_prepared(ads,&qu->vb,&id, prep->qd,prep->qdlen);
+  else
+    stat= adns__mkquery(ads,&qu->vb,&id, owner,ol,
+			typei,qu->answer->type, flags);
   if (stat) {
     if (stat == adns_s_querydomaintoolong && (flags & adns_qf_search)) {
       adns__search_next(ads,qu,now);
@@ -146,7 +182,7 @@ static void query_simple(adns_state ads, adns_query qu,
   }
 
   vb_new= qu->vb;
-  adns__vbuf_init(&qu->vb);
+  adns__vbuf_initads(&qu->vb,ads);
   query_submit(ads,qu, typei,&vb_new,id, flags,now);
 }
 
@@ -178,11 +214,12 @@ void adns__search_next(adns_state ads, adns_query qu, struct timeval now) {
       goto x_nomemory;
   }
 
-  free(qu->query_dgram);
+  if (qu->query_dgram) adns__mem_uncharge(qu,qu->query_dglen);
+  adns__free(ads,qu->query_dgram);
   qu->query_dgram= 0; qu->query_dglen= 0;
 
   query_simple(ads,qu, qu->search_vb.buf, qu->search_vb.used,
-	       qu->typei, qu->flags, now);
+	       qu->typei, qu->flags, 0, now);
   return;
 
 x_nomemory:
@@ -191,6 +228,152 @@ x_fail:
   adns__query_fail(qu,stat);
 }
 
+static int search_setname(adns_query qu, int entry) {
+  /* Returns 1 if OK, otherwise there was no memory. */
+  adns_state ads= qu->ads;
+
+  qu->search_vb.used= qu->search_origlen;
+  if (entry < 0) return 1;
+  return adns__vbuf_append(&qu->search_vb,".",1) &&
+    adns__vbuf_appendstr(&qu->search_vb,ads->searchlist[entry]);
+}
+
+static void search_parallel_check(adns_query qu) {
+  /* Called whenever a slot may have been resolved.  If the outcome is
+   * now determined by the earliest slots, finishes the query (which
+   * cancels any remaining children); otherwise puts us back on childw.
+   */
+  searchslot *slot;
+  adns_answer *ans;
+  int i;
+
+  for (i=0; i<qu->search_nslots; i++) {
+    slot= &qu->search_slots[i];
+    if (slot->state == slot_pending) {
+      LIST_LINK_TAIL(qu->ads->childw,qu);
+      qu->ads->nchildw++;
+      return;
+    }
+    /* As if we had tried the candidates one after the other. */
+    if (slot->expires < qu->expires) qu->expires= slot->expires;
+    if (slot->state == slot_final) break;
+  }
+
+  if (i == qu->search_nslots) {
+    qu->search_vb.used= qu->search_origlen;
+    adns__query_fail(qu,adns_s_nxdomain);
+    return;
+  }
+
+  slot= &qu->search_slots[i];
+  if (!search_setname(qu,slot->entry)) {
+    adns__query_fail(qu,adns_s_nomemory);
+    return;
+  }
+  ans= qu->answer;
+  qu->interim_allocd += slot->interim_allocd;
+  qu->preserved_allocd += slot->preserved_allocd;
+  ans->cname= slot->cname;
+  if (slot->status) {
+    adns__query_fail(qu,slot->status);
+    return;
+  }
+  ans->nrrs= slot->nrrs;
+  ans->rrs.untyped= slot->rrs;
+  adns__query_done(qu);
+}
+
+static void icb_search(adns_query parent, adns_query child) {
+  adns_answer *cans= child->answer;
+  searchslot *slot;
+
+  slot= &parent->search_slots[child->ctx.info.search_slot];
+  assert(slot->state == slot_pending);
+
+  slot->expires= child->expires;
+  if ((cans->status == adns_s_nxdomain && !cans->cname) ||
+      cans->status == adns_s_querydomaintoolong) {
+    slot->state= slot_continue;
+  } else {
+    /* Keep the answer: its memory becomes the parent's, to be
+     * accounted for only if this slot turns out to be the winner. */
+    slot->state= slot_final;
+    slot->status= cans->status;
+    slot->nrrs= cans->nrrs;
+    slot->rrs= cans->rrs.untyped;
+    slot->cname= cans->cname;
+    slot->interim_allocd= child->interim_allocd;
+    slot->preserved_allocd= child->preserved_allocd;
+    adns__adopt_allocs(child,parent);
+  }
+  search_parallel_check(parent);
+}
+
+static void search_parallel(adns_state ads, adns_query qu,
+			    struct timeval now) {
+  /* Submits one child query per searchlist candidate, all at once.
+   * The answer is the one sequential searching would have given:
+   * that of the first candidate in search order not to say NXDOMAIN.
+   */
+  searchslot *slot;
+  adns_query cqu;
+  adns_queryflags cflags;
+  int i;
+
+  qu->search_nslots= ads->nsearchlist+1;
+  qu->search_slots=
+    adns__alloc_mine(qu, sizeof(*qu->search_slots)*qu->search_nslots);
+  if (!qu->search_slots) { adns__query_fail(qu,adns_s_nomemory); return; }
+
+  for (i=0; i<qu->search_nslots; i++) {
+    slot= &qu->search_slots[i];
+    memset(slot,0,sizeof(*slot));
+    slot->state= slot_pending;
+    slot->expires= qu->expires;
+    if (qu->search_doneabs<0) slot->entry= i-1;
+    else slot->entry= i<ads->nsearchlist ? i : -1;
+  }
+  qu->search_pos= ads->nsearchlist;
+  qu->search_doneabs= 1;
+
+  cflags= qu->flags &
+    ~(adns_qf_search|adns_qf_search_parallel|adns_qf_owner);
+
+  for (i=0; i<qu->search_nslots; i++) {
+    slot= &qu->search_slots[i];
+    if (!search_setname(qu,slot->entry)) {
+      slot->state= slot_final; slot->status= adns_s_nomemory;
+      continue;
+    }
+    cqu= query_alloc(ads,qu->typei,qu->answer->type,cflags,now);
+    if (!cqu) {
+      slot->state= slot_final; slot->status= adns_s_nomemory;
+      continue;
+    }
+    cqu->ctx.ext= 0;
+    cqu->ctx.callback= icb_search;
+    cqu->ctx.info.search_slot= i;
+    cqu->deadline= qu->deadline;
+    cqu->parent= qu;
+    LIST_LINK_TAIL_PART(qu->children,cqu,siblings.);
+    if (qu->state != query_childw) {
+      qu->state= query_childw;
+      LIST_LINK_TAIL(ads->childw,qu);
+      ads->nchildw++;
+    }
+    query_simple(ads,cqu, qu->search_vb.buf,qu->search_vb.used,
+		 qu->typei,cflags, 0, now);
+    if (qu->state != query_childw) return; /* outcome already decided */
+  }
+
+  if (qu->state == query_childw) {
+    if (qu->children.head) return;
+    LIST_UNLINK(ads->childw,qu);
+    ads->nchildw--;
+  }
+  search_parallel_check(qu);
+}
+
 static int save_owner(adns_query qu, const char *owner, int ol) {
   /* Returns 1 if OK, otherwise there was no memory. */
   adns_answer *ans;
@@ -213,23 +396,33 @@ int adns_submit(adns_state ads,
 		adns_queryflags flags,
 		void *context,
 		adns_query *query_r) {
-  int r, ol, ndots;
+  return adns_submit_deadline(ads,owner,type,flags,context,0,query_r);
+}
+
+static int submit_query(adns_state ads,
+			const typeinfo *typei, adns_rrtype type,
+			adns_queryflags flags, const char *owner, int ol,
+			adns_prepared prep, void *context,
+			const struct timeval *deadline,
+			adns_query *query_r) {
+  /* Does the work for adns_submit_deadline, which has looked up typei
+   * for type, and for adns_submit_prepared, which passes prep and its
+   * owner (and no deadline). */
+  int r, ndots;
   adns_status stat;
-  const typeinfo *typei;
   struct timeval now;
   adns_query qu;
   const char *p;
 
   adns__consistency(ads,0,cc_entex);
+  if (ads->memmax && ads->memused >= ads->memmax) return ENOBUFS;
 
-  if ((ads->iflags & adns_if_tormode))
-    flags |= adns_qf_usevc;
-
-  typei= adns__findtype(type);
-  if (!typei) return ENOSYS;
-
-  r= gettimeofday(&now,0); if (r) goto x_errno;
+  r= adns__gettimeofday(ads,&now); if (r) goto x_errno;
   qu= query_alloc(ads,typei,type,flags,now); if (!qu) goto x_errno;
+  if (deadline) qu->deadline= *deadline;
+  ads->stats.submitted++;
+  ADNS_QPROBE(submit,qu,-1,now);
+  if (ads->capture) adns__capture_query(ads,owner,ol,type,flags,now);
 
   qu->ctx.ext= context;
   qu->ctx.callback= 0;
@@ -237,7 +430,14 @@ int adns_submit(adns_state ads,
 
   *query_r= qu;
 
-  ol= strlen(owner);
+  if (prep) {
+    stat= prep->status;
+    if (stat) goto x_adnsfail;
+    if (!save_owner(qu,owner,ol)) { stat= adns_s_nomemory; goto x_adnsfail; }
+    query_simple(ads,qu, owner,ol, typei,flags, prep, now);
+    goto x_done;
+  }
+
   if (!ol) { stat= adns_s_querydomaininvalid; goto x_adnsfail; }
   if (ol>DNS_MAXDOMAIN+1) { stat= adns_s_querydomaintoolong; goto x_adnsfail; }
 
@@ -254,13 +454,18 @@ int adns_submit(adns_state ads,
     for (ndots=0, p=owner; (p= strchr(p,'.')); p++, ndots++);
     qu->search_doneabs= (ndots >= ads->searchndots) ? -1 : 0;
     qu->search_origlen= ol;
-    adns__search_next(ads,qu,now);
+    if ((flags & adns_qf_search_parallel) && ads->nsearchlist)
+      search_parallel(ads,qu,now);
+    else
+      adns__search_next(ads,qu,now);
   } else {
     if (flags & adns_qf_owner) {
       if (!save_owner(qu,owner,ol)) { stat= adns_s_nomemory; goto x_adnsfail; }
     }
-    query_simple(ads,qu, owner,ol, typei,flags, now);
+    query_simple(ads,qu, owner,ol, typei,flags, 0, now);
   }
+
+ x_done:
   adns__autosys(ads,now);
   adns__consistency(ads,qu,cc_entex);
   return 0;
@@ -277,6 +482,25 @@ int adns_submit(adns_state ads,
   return r;
 }
 
+int adns_submit_deadline(adns_state ads,
+			 const char *owner,
+			 adns_rrtype type,
+			 adns_queryflags flags,
+			 void *context,
+			 const struct timeval *deadline,
+			 adns_query *query_r) {
+  const typeinfo *typei;
+
+  if ((ads->iflags & adns_if_tormode))
+    flags |= adns_qf_usevc;
+
+  typei= adns__findtype(type);
+  if (!typei) return ENOSYS;
+
+  return submit_query(ads,typei,type,flags, owner,strlen(owner),
+		      0,context,deadline,query_r);
+}
+
 int adns_submit_reverse_any(adns_state ads,
 			    const struct sockaddr *addr,
 			    const char *zone,
@@ -328,6 +552,144 @@ int adns_submit_reverse(adns_state ads,
 				 type,flags,context,query_r);
 }
 
+static adns_prepared prepared_alloc(const typeinfo *typei, adns_rrtype type,
+				    adns_queryflags flags, int qdlen, int ol) {
+  adns_prepared prep;
+
+  prep= malloc(MEM_ROUND(sizeof(*prep)) + qdlen + ol+1);
+  if (!prep) return 0;
+
+  prep->typei= typei;
+  prep->type= type;
+  prep->flags= flags;
+  prep->status= adns_s_ok;
+  prep->qd= (byte*)prep + MEM_ROUND(sizeof(*prep));
+  prep->qdlen= qdlen;
+  prep->owner= (char*)prep->qd + qdlen;
+  prep->ol= ol;
+  return prep;
+}
+
+static int prepare_finish(vbuf *qd_vb, adns_status st, vbuf *owner_vb,
+			  const typeinfo *typei, adns_rrtype type,
+			  adns_queryflags flags, adns_prepared *prepared_r) {
+  /* Takes over the memory for qd_vb (and owner_vb if not 0). */
+  adns_prepared prep;
+  int r, ol;
+
+  if (st) qd_vb->used= 0;
+  ol= owner_vb ? owner_vb->used : 0;
+
+  prep= prepared_alloc(typei,type,flags, qd_vb->used,ol);
+  if (!prep) { r= errno; goto x_free; }
+
+  prep->status= st;
+  memcpy(prep->qd,qd_vb->buf,qd_vb->used);
+  if (ol) memcpy(prep->owner,owner_vb->buf,ol);
+  prep->owner[ol]= 0;
+  *prepared_r= prep;
+  r= 0;
+
+ x_free:
+  adns__vbuf_free(qd_vb);
+  if (owner_vb) adns__vbuf_free(owner_vb);
+  return r;
+}
+
+int adns_prepare(adns_state ads,
+		 const char *owner,
+		 adns_rrtype type,
+		 adns_queryflags flags,
+		 adns_prepared *prepared_r) {
+  const typeinfo *typei;
+  adns_status st;
+  vbuf qd_vb, owner_vb;
+  int ol;
+
+  flags &= ~adns_qf_search;
+  if ((ads->iflags & adns_if_tormode))
+    flags |= adns_qf_usevc;
+
+  typei= adns__findtype(type);
+  if (!typei) return ENOSYS;
+
+  adns__vbuf_init(&qd_vb);
+  adns__vbuf_init(&owner_vb);
+
+  ol= strlen(owner);
+  if (!ol) {
+    st= adns_s_querydomaininvalid;
+  } else if (ol>DNS_MAXDOMAIN+1) {
+    st= adns_s_querydomaintoolong;
+  } else {
+    if (owner[ol-1]=='.' && (ol<2 || owner[ol-2]!='\\')) ol--;
+    st= adns__mkquery_question(ads,&qd_vb, owner,ol, typei,type,flags);
+  }
+  if (st == adns_s_nomemory) goto x_nomemory;
+
+  if (!st && !adns__vbuf_append(&owner_vb,owner,ol))
+    goto x_nomemory;
+
+  return prepare_finish(&qd_vb,st,&owner_vb, typei,type,flags, prepared_r);
+
+ x_nomemory:
+  adns__vbuf_free(&qd_vb);
+  adns__vbuf_free(&owner_vb);
+  return ENOMEM;
+}
+
+int adns_prepare_wire(adns_state ads,
+		      const unsigned char *qname, int qnamelen,
+		      adns_rrtype type,
+		      adns_queryflags flags,
+		      adns_prepared *prepared_r) {
+  const typeinfo *typei;
+  adns_status st;
+  vbuf qd_vb, owner_vb;
+  int i, ll;
+
+  flags &= ~adns_qf_search;
+  if ((ads->iflags & adns_if_tormode))
+    flags |= adns_qf_usevc;
+
+  typei= adns__findtype(type);
+  if (!typei) return ENOSYS;
+
+  adns__vbuf_init(&qd_vb);
+  adns__vbuf_init(&owner_vb);
+
+  st= adns__mkquery_question_wire(ads,&qd_vb, qname,qnamelen, type);
+  if (st == adns_s_nomemory) goto x_nomemory;
+
+  if (!st) {
+    for (i=0; (ll= qname[i++]); i+= ll) {
+      if (owner_vb.used && !adns__vbuf_append(&owner_vb,".",1))
+	goto x_nomemory;
+      if (!vbuf__append_quoted1035(&owner_vb,qname+i,ll))
+	goto x_nomemory;
+    }
+  }
+
+  return prepare_finish(&qd_vb,st,&owner_vb, typei,type,flags, prepared_r);
+
+ x_nomemory:
+  adns__vbuf_free(&qd_vb);
+  adns__vbuf_free(&owner_vb);
+  return ENOMEM;
+}
+
+int adns_submit_prepared(adns_state ads,
+			 adns_prepared prep,
+			 void *context,
+			 adns_query *query_r) {
+  return submit_query(ads,prep->typei,prep->type,prep->flags,
+		      prep->owner,prep->ol, prep,context,0,query_r);
+}
+
+void adns_prepared_free(adns_prepared prep) {
+  free(prep);
+}
+
 int adns_synchronous(adns_state ads,
 		     const char *owner,
 		     adns_rrtype type,
@@ -353,8 +715,10 @@ static void *alloc_common(adns_query qu, size_t sz) {
 
   if (!sz) return qu; /* Any old pointer will do */
   assert(!qu->final_allocspace);
-  an= malloc(MEM_ROUND(MEM_ROUND(sizeof(*an)) + sz));
+  an= adns__malloc(qu->ads,MEM_ROUND(MEM_ROUND(sizeof(*an)) + sz));
   if (!an) return 0;
+  an->sz= MEM_ROUND(MEM_ROUND(sizeof(*an)) + sz);
+  qu->ads->memused += an->sz;
   LIST_LINK_TAIL(qu->allocations,an);
   return (byte*)an + MEM_ROUND(sizeof(*an));
 }
@@ -383,6 +747,19 @@ void *adns__alloc_mine(adns_query qu, size_t sz) {
   return alloc_common(qu,MEM_ROUND(sz));
 }
 
+void adns__adopt_allocs(adns_query from, adns_query to) {
+  allocnode *an;
+
+  assert(!to->final_allocspace);
+  assert(!from->final_allocspace);
+
+  while ((an= from->allocations.head)) {
+    LIST_UNLINK(from->allocations,an);
+    LIST_LINK_TAIL(to->allocations,an);
+  }
+  from->interim_allocd= from->preserved_allocd= 0;
+}
+
 void adns__transfer_interim(adns_query from, adns_query to,
 			    void *block, size_t sz) {
   allocnode *an;
@@ -424,7 +801,7 @@ static void cancel_children(adns_query qu) {
 
   for (cqu= qu->children.head; cqu; cqu= ncqu) {
     ncqu= cqu->siblings.next;
-    adns_cancel(cqu);
+    adns__cancel(cqu);
   }
 }
 
@@ -440,15 +817,37 @@ static void free_query_allocs(adns_query qu) {
   allocnode *an, *ann;
 
   cancel_children(qu);
-  for (an= qu->allocations.head; an; an= ann) { ann= an->next; free(an); }
+  for (an= qu->allocations.head; an; an= ann) {
+    ann= an->next;
+    assert(qu->ads->memused >= an->sz);
+    qu->ads->memused -= an->sz;
+    adns__free(qu->ads,an);
+  }
   LIST_INIT(qu->allocations);
   adns__vbuf_free(&qu->vb);
   adns__vbuf_free(&qu->search_vb);
-  free(qu->query_dgram);
+  if (qu->query_dgram) adns__mem_uncharge(qu,qu->query_dglen);
+  adns__free(qu->ads,qu->query_dgram);
   qu->query_dgram= 0;
 }
 
-void adns_cancel(adns_query qu) {
+void adns__mem_charge(adns_query qu, size_t sz) {
+  qu->memused += sz;
+  qu->ads->memused += sz;
+}
+
+void adns__mem_uncharge(adns_query qu, size_t sz) {
+  assert(qu->memused >= sz);
+  assert(qu->ads->memused >= sz);
+  qu->memused -= sz;
+  qu->ads->memused -= sz;
+}
+
+unsigned long adns_memused(adns_state ads) {
+  return ads->memused;
+}
+
+void adns__cancel(adns_query qu) {
   adns_state ads;
 
   ads= qu->ads;
@@ -457,25 +856,50 @@ void adns_cancel(adns_query qu) {
   switch (qu->state) {
   case query_tosend:
     LIST_UNLINK(ads->udpw,qu);
+    ads->servers[qu->udpserver].nqueries--;
+    ads->udpinflight--;
+    break;
+  case query_cwndw:
+    adns__cwndw_unlink(ads,qu);
     break;
   case query_tcpw:
     LIST_UNLINK(ads->tcpw,qu);
+    ads->ntcpw--;
+    ads->tcpconns[qu->tcpconn].nqueries--;
     break;
   case query_childw:
     LIST_UNLINK(ads->childw,qu);
+    ads->nchildw--;
     break;
   case query_done:
     LIST_UNLINK(ads->output,qu);
+    ads->noutput--;
     break;
   default:
     abort();
   }
   free_query_allocs(qu);
-  free(qu->answer);
-  free(qu);
+  adns__mem_uncharge(qu,qu->memused);
+  adns__free(ads,qu->answer);
+  adns__free(ads,qu);
   adns__consistency(ads,0,cc_entex);
 }
 
+void adns_cancel(adns_query qu) {
+  adns_state ads;
+  struct timeval now;
+  int release;
+
+  ads= qu->ads;
+  release= qu->state == query_tosend;
+  adns__cancel(qu);
+  /* If we cannot get the time, adns__timeouts will do this later. */
+  if (release && ads->cwndw.head && !adns__gettimeofday(ads,&now)) {
+    adns__cwnd_release(ads,1,now);
+    adns__consistency(ads,0,cc_entex);
+  }
+}
+
 void adns__update_expires(adns_query qu, unsigned long ttl,
 			  struct timeval now) {
   time_t max;
@@ -493,10 +917,12 @@ static void makefinal_query(adns_query qu) {
   ans= qu->answer;
 
   if (qu->interim_allocd) {
-    ans= realloc(qu->answer,
-		 MEM_ROUND(MEM_ROUND(sizeof(*ans)) + qu->interim_allocd));
+    ans= adns__realloc(qu->ads,qu->answer,
+		       MEM_ROUND(MEM_ROUND(sizeof(*ans)) + qu->interim_allocd));
     if (!ans) goto x_nomem;
     qu->answer= ans;
+    adns__mem_charge(qu, MEM_ROUND(MEM_ROUND(sizeof(*ans)) +
+				   qu->interim_allocd) - sizeof(*ans));
   }
 
   qu->final_allocspace= (byte*)ans + MEM_ROUND(sizeof(*ans));
@@ -523,14 +949,33 @@ static void makefinal_query(adns_query qu) {
   free_query_allocs(qu);
 }
 
+static int status_class(adns_status st) {
+  /* Index into adns_stats.completed. */
+  if (st == adns_s_ok) return 0;
+  if (st <= adns_s_max_localfail) return 1;
+  if (st <= adns_s_max_remotefail) return 2;
+  if (st <= adns_s_max_tempfail) return 3;
+  if (st <= adns_s_max_misconfig) return 4;
+  if (st <= adns_s_max_misquery) return 5;
+  return 6;
+}
+
 void adns__query_done(adns_query qu) {
   adns_answer *ans;
   adns_query parent;
 
   cancel_children(qu);
 
-  qu->id= -1;
   ans= qu->answer;
+#ifdef ENABLE_USDT
+  if (ADNS_PROBE_ENABLED(done)) {
+    /* Only worth asking the time if someone is listening. */
+    struct timeval now;
+    if (!adns__gettimeofday(qu->ads,&now))
+      ADNS_QPROBE(done,qu,ans->status,now);
+  }
+#endif
+  qu->id= -1;
 
   if (qu->flags & adns_qf_search && ans->status != adns_s_nomemory) {
     if (!save_owner(qu, qu->search_vb.buf, qu->search_vb.used)) {
@@ -559,19 +1004,24 @@ void adns__query_done(adns_query qu) {
   if (parent) {
     LIST_UNLINK_PART(parent->children,qu,siblings.);
     LIST_UNLINK(qu->ads->childw,parent);
+    qu->ads->nchildw--;
     qu->ctx.callback(parent,qu);
     free_query_allocs(qu);
-    free(qu->answer);
-    free(qu);
+    adns__mem_uncharge(qu,qu->memused);
+    adns__free(qu->ads,qu->answer);
+    adns__free(qu->ads,qu);
   } else {
     makefinal_query(qu);
     LIST_LINK_TAIL(qu->ads->output,qu);
+    qu->ads->noutput++;
     qu->state= query_done;
+    qu->ads->stats.completed[status_class(qu->answer->status)]++;
   }
 }
 
 void adns__query_fail(adns_query qu, adns_status stat) {
   adns__reset_preserved(qu);
+  if (stat != adns_s_nomemory && adns__local_fakeptr(qu)) return;
   qu->answer->status= stat;
   adns__query_done(qu);
 }
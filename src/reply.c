@@ -28,6 +28,18 @@
 
 #include "internal.h"
 
+static void reply_latency(adns_state ads, int serv,
+			  struct timeval sent, struct timeval now) {
+  adns_serverstats *ss= &ads->servers[serv].stats;
+  long ms;
+  int b;
+
+  ss->replies++;
+  ms= (now.tv_sec - sent.tv_sec)*1000 + (now.tv_usec - sent.tv_usec)/1000;
+  for (b=0; b<ADNS_STATS_LATBUCKETS-1 && ms>0; b++) ms >>= 1;
+  ss->latency[b]++;
+}
+
 void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 		     int serv, int viatcp, struct timeval now) {
   int cbyte, rrstart, wantedrrs, rri, foundsoa, foundns, cname_here;
@@ -45,6 +57,8 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
   byte *newquery, *rrsdata;
   parseinfo pai;
 
+  if (ads->capture) adns__capture_dgram(ads,'R',serv,viatcp,dgram,dglen,now);
+
   if (dglen<DNS_HDRSIZE) {
     adns__diag(ads,serv,0,"received datagram"
 	       " too short for message header (%d)",dglen);
@@ -95,16 +109,28 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 	assert(qu->state == query_tcpw);
       } else {
 	assert(qu->state == query_tosend);
-	if (!(qu->udpsent & (1<<serv))) continue;
+	if ((serv - qu->udpfirstserver + ads->nservers) % ads->nservers
+	    >= qu->udpnsent) continue;
       }
       break;
     }
     if (qu) {
       /* We're definitely going to do something with this query now */
-      if (viatcp) LIST_UNLINK(ads->tcpw,qu);
-      else LIST_UNLINK(ads->udpw,qu);
+      ADNS_QPROBE(reply,qu,serv,now);
+      if (viatcp) {
+	LIST_UNLINK(ads->tcpw,qu);
+	ads->ntcpw--;
+	ads->tcpconns[qu->tcpconn].nqueries--;
+      } else {
+	LIST_UNLINK(ads->udpw,qu);
+	ads->servers[qu->udpserver].nqueries--;
+	ads->udpinflight--;
+	adns__cwnd_ack(qu);
+	if (serv == qu->udpserver) reply_latency(ads,serv,qu->udpsent,now);
+      }
     }
   }
+  if (!qu) ads->stats.unmatched++;
 
   /* If we're going to ignore the packet, we return as soon as we have
    * failed the query (if any) and printed the warning message (if
@@ -353,6 +379,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
   if (qu->children.head) {
     qu->state= query_childw;
     LIST_LINK_TAIL(ads->childw,qu);
+    ads->nchildw++;
     return;
   }
   adns__query_done(qu);
@@ -366,6 +393,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
     return;
   }
   qu->flags |= adns_qf_usevc;
+  ads->stats.tcpfallbacks++;
 
  x_restartquery:
   if (qu->cname_dgram) {
@@ -374,11 +402,13 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 			      qu->answer->type, qu->flags);
     if (st) { adns__query_fail(qu,st); return; }
 
-    newquery= realloc(qu->query_dgram,qu->vb.used);
+    newquery= adns__realloc(qu->ads,qu->query_dgram,qu->vb.used);
     if (!newquery) { adns__query_fail(qu,adns_s_nomemory); return; }
 
+    adns__mem_uncharge(qu,qu->query_dglen);
     qu->query_dgram= newquery;
     qu->query_dglen= qu->vb.used;
+    adns__mem_charge(qu,qu->query_dglen);
     memcpy(newquery,qu->vb.buf,qu->vb.used);
   }
 
@@ -47,31 +47,83 @@
 #include "internal.h"
 
 static void readconfig(adns_state ads, const char *filename, int warnmissing);
+static void saveerr(adns_state ads, int en);
 
-static void addserver(adns_state ads, struct in_addr addr) {
-  int i;
+static void addserver(adns_state ads, const struct sockaddr *sa,
+		      int weight) {
+  /* sa is AF_INET or AF_INET6; its port is ignored. */
+  int i, newa;
   struct server *ss;
+  char buf[INET6_ADDRSTRLEN];
 
   for (i=0; i<ads->nservers; i++) {
-    if (ads->servers[i].addr.s_addr == addr.s_addr) {
-      adns__debug(ads,-1,0,"duplicate nameserver %s ignored",inet_ntoa(addr));
+    if (adns__sockaddr_equal(&ads->servers[i].addr.sa,sa)) {
+      adns__debug(ads,-1,0,"duplicate nameserver %s ignored",
+		  adns__sockaddr_ntoa(sa,buf));
       return;
     }
   }
 
-  if (ads->nservers>=MAXSERVERS) {
-    adns__diag(ads,-1,0,"too many nameservers, ignoring %s",inet_ntoa(addr));
-    return;
+  if (ads->nservers>=ads->aservers) {
+    newa= ads->aservers ? ads->aservers*2 : 4;
+    ss= adns__realloc(ads,ads->servers,sizeof(*ss)*newa);
+    if (!ss) {
+      saveerr(ads,errno);
+      adns__diag(ads,-1,0,"out of memory, ignoring nameserver %s",
+		 adns__sockaddr_ntoa(sa,buf));
+      return;
+    }
+    ads->servers= ss;
+    ads->aservers= newa;
   }
 
   ss= ads->servers+ads->nservers;
-  ss->addr= addr;
+  ss->weight= weight;
+  ss->wrrcurrent= ss->nqueries= 0;
+  ss->udpsocket= -1;
+  ss->udpdropslast= 0;
+  memset(&ss->stats,0,sizeof(ss->stats));
+  memset(&ss->addr,0,sizeof(ss->addr));
+  switch (sa->sa_family) {
+  case AF_INET:
+    ss->len= sizeof(ss->addr.inet);
+    ss->addr.inet.sin_family= AF_INET;
+    ss->addr.inet.sin_addr= ((const struct sockaddr_in*)sa)->sin_addr;
+    ss->addr.inet.sin_port= htons(DNS_PORT);
+    break;
+  case AF_INET6:
+    ss->len= sizeof(ss->addr.inet6);
+    ss->addr.inet6.sin6_family= AF_INET6;
+    ss->addr.inet6.sin6_addr= ((const struct sockaddr_in6*)sa)->sin6_addr;
+    ss->addr.inet6.sin6_port= htons(DNS_PORT);
+    break;
+  default:
+    abort();
+  }
   ads->nservers++;
 }
 
+static void addserver_inet(adns_state ads, struct in_addr ia) {
+  struct sockaddr_in sin;
+
+  memset(&sin,0,sizeof(sin));
+  sin.sin_family= AF_INET;
+  sin.sin_addr= ia;
+  addserver(ads,(const struct sockaddr*)&sin,1);
+}
+
 static void freesearchlist(adns_state ads) {
-  if (ads->nsearchlist) free(*ads->searchlist);
-  free(ads->searchlist);
+  if (ads->nsearchlist) adns__free(ads,*ads->searchlist);
+  adns__free(ads,ads->searchlist);
+}
+
+static void freesockscreds(adns_state ads) {
+  while (ads->nsockscreds > 0) {
+    ads->nsockscreds--;
+    WIPEMEMORY(ads->sockscred[ads->nsockscreds],
+	       strlen(ads->sockscred[ads->nsockscreds]));
+    adns__free(ads,ads->sockscred[ads->nsockscreds]);
+  }
 }
 
 static void saveerr(adns_state ads, int en) {
@@ -112,14 +164,49 @@ static int nextword(const char **bufp_io, const char **word_r, int *l_r) {
 
 static void ccf_nameserver(adns_state ads, const char *fn,
 			   int lno, const char *buf) {
-  struct in_addr ia;
+  adns__sockaddr addr;
+  char abuf[INET6_ADDRSTRLEN];
+  const char *word;
+  char *ep;
+  unsigned long weight;
+  int l;
 
-  if (!adns__inet_aton(buf,&ia)) {
-    configparseerr(ads,fn,lno,"invalid nameserver address `%s'",buf);
+  if (!nextword(&buf,&word,&l)) { word= buf; l= 0; }
+  if (l >= sizeof(abuf)) {
+    configparseerr(ads,fn,lno,"invalid nameserver address `%.*s'",l,word);
+    return;
+  }
+  memcpy(abuf,word,l);
+  abuf[l]= 0;
+
+  memset(&addr,0,sizeof(addr));
+  if (adns__inet_aton(abuf,&addr.inet.sin_addr)) {
+    addr.inet.sin_family= AF_INET;
+  } else if (adns__inet_pton(AF_INET6,abuf,&addr.inet6.sin6_addr) == 1) {
+    addr.inet6.sin6_family= AF_INET6;
+  } else {
+    configparseerr(ads,fn,lno,"invalid nameserver address `%s'",abuf);
     return;
   }
-  adns__debug(ads,-1,0,"using nameserver %s",inet_ntoa(ia));
-  addserver(ads,ia);
+
+  weight= 1;
+  while (nextword(&buf,&word,&l)) {
+    if (l>=12 && !memcmp(word,"adns_weight:",12)) {
+      weight= strtoul(word+12,&ep,10);
+      if (l==12 || ep != word+l || weight < 1 || weight > 1000) {
+	configparseerr(ads,fn,lno,"nameserver option `%.*s' malformed"
+		       " or has bad value (must be 1..1000)",l,word);
+	weight= 1;
+      }
+      continue;
+    }
+    adns__diag(ads,-1,0,"%s:%d: unknown nameserver option `%.*s'",
+	       fn,lno, l,word);
+  }
+
+  adns__debug(ads,-1,0,"using nameserver %s",
+	      adns__sockaddr_ntoa(&addr.sa,abuf));
+  addserver(ads,&addr.sa,(int)weight);
 }
 
 static void ccf_search(adns_state ads, const char *fn,
@@ -135,11 +222,11 @@ static void ccf_search(adns_state ads, const char *fn,
   tl= 0;
   while (nextword(&bufp,&word,&l)) { count++; tl += l+1; }
 
-  newptrs= malloc(sizeof(char*)*count);
+  newptrs= adns__malloc(ads,sizeof(char*)*count);
   if (!newptrs) { saveerr(ads,errno); return; }
 
-  newchars= malloc(tl);
-  if (!newchars) { saveerr(ads,errno); free(newptrs); return; }
+  newchars= adns__malloc(ads,tl);
+  if (!newchars) { saveerr(ads,errno); adns__free(ads,newptrs); return; }
 
   bufp= buf;
   pp= newptrs;
@@ -233,9 +320,9 @@ static void ccf_sortlist(adns_state ads, const char *fn,
 static void ccf_options(adns_state ads, const char *fn,
 			int lno, const char *buf) {
   const char *word;
-  char *ep;
+  char *ep, *cred;
   unsigned long v;
-  int l;
+  int l, r;
 
   if (!buf) return;
 
@@ -273,15 +360,99 @@ static void ccf_options(adns_state ads, const char *fn,
       ads->iflags |= adns_if_tormode;
       continue;
     }
+    if (l==15 && !memcmp(word,"adns_connectudp",15)) {
+      ads->iflags |= adns_if_connectudp;
+      continue;
+    }
+    if (l==16 && !memcmp(word,"adns_tcpfastopen",16)) {
+      ads->iflags |= adns_if_tcpfastopen;
+      continue;
+    }
+    if (l>=10 && !memcmp(word,"adns_cwnd:",10)) {
+      v= strtoul(word+10,&ep,10);
+      if (l==10 || ep != word+l || v < CWNDMIN || v > INT_MAX) {
+	configparseerr(ads,fn,lno,"option `%.*s' malformed"
+		       " or has bad value",l,word);
+	continue;
+      }
+      ads->cwndmax= v;
+      ads->cwndssthresh= v;
+      ads->cwnd= v < CWNDINITIAL ? v : CWNDINITIAL;
+      continue;
+    }
+    if (l>=12 && !memcmp(word,"adns_maxmem:",12)) {
+      v= strtoul(word+12,&ep,10);
+      if (l==12 || ep != word+l || !v) {
+	configparseerr(ads,fn,lno,"option `%.*s' malformed"
+		       " or has bad value",l,word);
+	continue;
+      }
+      ads->memmax= v;
+      continue;
+    }
+    if (l==13 && !memcmp(word,"adns_udpdrops",13)) {
+      ads->iflags |= adns_if_udpdrops;
+      continue;
+    }
+    if (l>=12 && (!memcmp(word,"adns_rcvbuf:",12) ||
+		  !memcmp(word,"adns_sndbuf:",12))) {
+      v= strtoul(word+12,&ep,10);
+      if (l==12 || ep != word+l || !v || v > INT_MAX) {
+	configparseerr(ads,fn,lno,"option `%.*s' malformed"
+		       " or has bad value",l,word);
+	continue;
+      }
+      if (word[5]=='r') ads->udprcvbuf= v;
+      else ads->udpsndbuf= v;
+      continue;
+    }
     if (l>=15 && !memcmp(word,"adns_sockscred:",15)) {
+      if (ads->nsockscreds >= MAXTCPCONNS) {
+	configparseerr(ads,fn,lno,"too many adns_sockscred options,"
+		       " ignoring `%.*s'",l,word);
+	continue;
+      }
       l -= 15;
-      ads->sockscred = malloc (l + 1);
-      if (!ads->sockscred) {
+      cred= adns__malloc(ads,l+1);
+      if (!cred) {
         saveerr(ads,errno);
         continue;
       }
-      memcpy (ads->sockscred, word+15, l);
-      ads->sockscred[l] = 0;
+      memcpy(cred,word+15,l);
+      cred[l]= 0;
+      ads->sockscred[ads->nsockscreds++]= cred;
+      continue;
+    }
+    if (l>=14 && !memcmp(word,"adns_tcpconns:",14)) {
+      v= strtoul(word+14,&ep,10);
+      if (l==14 || ep != word+l || v < 1 || v > MAXTCPCONNS) {
+	configparseerr(ads,fn,lno,"option `%.*s' malformed"
+		       " or has bad value (must be 1..%d)",l,word,MAXTCPCONNS);
+	continue;
+      }
+      ads->ntcpconns= v;
+      continue;
+    }
+    if (l>=18 && !memcmp(word,"adns_serverselect:",18)) {
+      if (l==23 && !memcmp(word+18,"first",5)) {
+	ads->serverselect= serverselect_first;
+      } else if (l==26 && !memcmp(word+18,"weighted",8)) {
+	ads->serverselect= serverselect_weighted;
+      } else if (l==27 && !memcmp(word+18,"leastload",9)) {
+	ads->serverselect= serverselect_leastload;
+      } else {
+	configparseerr(ads,fn,lno,"option `%.*s' has bad value (must be"
+		       " first, weighted or leastload)",l,word);
+      }
+      continue;
+    }
+    if (l>=10 && !memcmp(word,"adns_hosts",10) &&
+	(l==10 || (word[10]==':' && l>11))) {
+      ads->iflags |= adns_if_hosts;
+      if (l>10) {
+	r= adns__local_setfile(ads,word+11,l-11);
+	if (r) saveerr(ads,r);
+      }
       continue;
     }
     adns__diag(ads,-1,0,"%s:%d: unknown option `%.*s'", fn,lno, l,word);
@@ -541,30 +712,66 @@ int adns__setnonblock(adns_state ads, int fd) {
 }
 
 static int init_begin(adns_state *ads_r, adns_initflags flags,
-		      adns_logcallbackfn *logfn, void *logfndata) {
+		      adns_logcallbackfn *logfn, void *logfndata,
+		      const adns_allocator *alloc,
+		      const adns_transport *transport) {
   adns_state ads;
+  struct adns__tcpconn *tc;
   pid_t pid;
+  int i;
 
-  ads= malloc(sizeof(*ads)); if (!ads) return errno;
+  if (!alloc) alloc= &adns__stdalloc;
+  if (transport && (!transport->udpsendfn || !transport->tcpsendfn))
+    return EINVAL;
+  ads= alloc->mallocfn(alloc->context,sizeof(*ads));
+  if (!ads) return ENOMEM;
 
+  ads->alloc= *alloc;
+  if (transport) ads->transport= *transport;
+  else memset(&ads->transport,0,sizeof(ads->transport));
   ads->iflags= flags;
   ads->logfn= logfn;
   ads->logfndata= logfndata;
   ads->configerrno= 0;
   LIST_INIT(ads->udpw);
+  LIST_INIT(ads->cwndw);
   LIST_INIT(ads->tcpw);
   LIST_INIT(ads->childw);
   LIST_INIT(ads->output);
   ads->forallnext= 0;
   ads->nextid= 0x311f;
-  ads->udpsocket= ads->tcpsocket= -1;
-  adns__vbuf_init(&ads->tcpsend);
-  adns__vbuf_init(&ads->tcprecv);
-  ads->tcprecv_skip= 0;
-  ads->nservers= ads->nsortlist= ads->nsearchlist= ads->tcpserver= 0;
+  ads->udpsocket= ads->udpsocket6= -1;
+  ads->udprcvbuf= ads->udpsndbuf= 0;
+  ads->tcpproto= -1;
+  ads->udpinflight= 0;
+  ads->ntcpw= ads->nchildw= ads->noutput= 0;
+  ads->cwndmax= ads->cwnd= ads->cwndssthresh= ads->cwndacks= 0;
+  ads->cwndskips= 0;
+  memset(ads->cwndwprio,0,sizeof(ads->cwndwprio));
+  for (i=0; i<prio_count; i++) LIST_INIT(ads->cwndwq[i]);
+  timerclear(&ads->cwndholdoff);
+  memset(&ads->stats,0,sizeof(ads->stats));
+  ads->capture= 0;
+  ads->memused= ads->memmax= 0;
+  ads->udpdrops= ads->udpdropslast= ads->udpdropslast6= 0;
+  ads->nservers= ads->nsortlist= ads->nsearchlist= 0;
+  ads->servers= 0;
+  ads->aservers= 0;
+  ads->serverselect= serverselect_first;
+  ads->serverselectnext= 0;
   ads->searchndots= 1;
-  ads->tcpstate= server_disconnected;
-  timerclear(&ads->tcptimeout);
+  ads->ntcpconns= 1;
+  for (i=0; i<MAXTCPCONNS; i++) {
+    tc= &ads->tcpconns[i];
+    tc->tcpsocket= -1;
+    adns__vbuf_initads(&tc->tcpsend,ads);
+    adns__vbuf_initads(&tc->tcprecv,ads);
+    tc->tcprecv_skip= tc->tcpsend_skip= tc->tcpserver= tc->nqueries= 0;
+    tc->tcpstate= server_disconnected;
+    timerclear(&tc->tcptimeout);
+    tc->socksstate= socks_none;
+    tc->socksport= tc->sockslen= tc->sockssent= tc->socksgot= 0;
+  }
   ads->searchlist= 0;
 
   pid= getpid();
@@ -572,48 +779,116 @@ static int init_begin(adns_state *ads_r, adns_initflags flags,
   ads->rand48xsubi[1]= (unsigned long)pid >> 16;
   ads->rand48xsubi[2]= pid ^ ((unsigned long)pid >> 16);
 
-  ads->sockscred = NULL;
+  ads->nsockscreds= 0;
+  adns__local_init(ads);
 
   *ads_r= ads;
   return 0;
 }
 
+static void udp_setbuf(adns_state ads, int fd, int optname,
+		       const char *what, int value) {
+  if (!value) return;
+  if (adns__sock_setsockopt(fd,SOL_SOCKET,optname,&value,sizeof(value)))
+    adns__diag(ads,-1,0,"could not set %s to %d: %s",
+	       what,value,strerror(errno));
+}
+
+static int udp_setup(adns_state ads, int fd) {
+  /* Prepares a new UDP socket.  Returns 0 or an errno value. */
+  int r;
+#ifdef SO_RXQ_OVFL
+  int one;
+#endif
+
+  r= adns__setnonblock(ads,fd);
+  if (r) return r;
+  udp_setbuf(ads,fd,SO_RCVBUF,"SO_RCVBUF",ads->udprcvbuf);
+  udp_setbuf(ads,fd,SO_SNDBUF,"SO_SNDBUF",ads->udpsndbuf);
+#ifdef SO_RXQ_OVFL
+  if (ads->iflags & adns_if_udpdrops) {
+    one= 1;
+    if (adns__sock_setsockopt(fd,SOL_SOCKET,SO_RXQ_OVFL,&one,sizeof(one)))
+      adns__debug(ads,-1,0,"could not enable SO_RXQ_OVFL: %s",
+		  strerror(errno));
+  }
+#endif
+  return 0;
+}
+
 static int init_finish(adns_state ads) {
   struct in_addr ia;
   struct protoent *proto;
-  int r;
+  struct server *ss;
+  int r, i;
 
   if (!ads->nservers) {
     if (ads->logfn && ads->iflags & adns_if_debug)
       adns__lprintf(ads,"adns: no nameservers, using localhost\n");
     ia.s_addr= htonl(INADDR_LOOPBACK);
-    addserver(ads,ia);
+    addserver_inet(ads,ia);
   }
 
+  if ((ads->iflags & adns_if_hosts) && !ads->hosts.file) {
+    r= adns__local_setfile(ads,"/etc/hosts",10);
+    if (r) goto x_free;
+  }
+
+  if (ads->transport.udpsendfn) return 0;
+
   proto= getprotobyname("udp"); if (!proto) {r= ENOPROTOOPT; goto x_free; }
   ads->udpsocket= adns__sock_socket(AF_INET,SOCK_DGRAM,proto->p_proto);
   if (ads->udpsocket<0) { r= errno; goto x_free; }
 
-  r= adns__setnonblock(ads,ads->udpsocket);
-  if (r) { r= errno; goto x_closeudp; }
+  r= udp_setup(ads,ads->udpsocket);
+  if (r) goto x_closeudp;
+
+  for (i=0; i<ads->nservers; i++) {
+    if (ads->servers[i].addr.sa.sa_family != AF_INET6) continue;
+    ads->udpsocket6= adns__sock_socket(AF_INET6,SOCK_DGRAM,proto->p_proto);
+    if (ads->udpsocket6<0) { r= errno; goto x_closeudp; }
+    r= udp_setup(ads,ads->udpsocket6);
+    if (r) goto x_closeudp;
+    break;
+  }
+
+  if (ads->iflags & adns_if_connectudp) {
+    for (i=0; i<ads->nservers && i<MAXUDPCONNS; i++) {
+      ss= &ads->servers[i];
+      ss->udpsocket= adns__sock_socket(ss->addr.sa.sa_family,SOCK_DGRAM,
+				       proto->p_proto);
+      if (ss->udpsocket<0) { r= errno; goto x_closeudp; }
+      r= udp_setup(ads,ss->udpsocket);
+      if (r) goto x_closeudp;
+      r= adns__sock_connect(ss->udpsocket,&ss->addr.sa,ss->len);
+      if (r) { r= errno; goto x_closeudp; }
+    }
+  }
 
   return 0;
 
  x_closeudp:
-  close(ads->udpsocket);
+  for (i=0; i<ads->nservers; i++)
+    if (ads->servers[i].udpsocket >= 0) close(ads->servers[i].udpsocket);
+  if (ads->udpsocket6 >= 0) close(ads->udpsocket6);
+  if (ads->udpsocket >= 0) close(ads->udpsocket);
  x_free:
-  if (ads->sockscred)
-    free (ads->sockscred);
-  free(ads);
+  freesockscreds(ads);
+  adns__local_finish(ads);
+  adns__free(ads,ads->servers);
+  adns__free(ads,ads);
   return r;
 }
 
 static void init_abort(adns_state ads) {
   if (ads->nsearchlist) {
-    free(ads->searchlist[0]);
-    free(ads->searchlist);
+    adns__free(ads,ads->searchlist[0]);
+    adns__free(ads,ads->searchlist);
   }
-  free(ads);
+  freesockscreds(ads);
+  adns__local_finish(ads);
+  adns__free(ads,ads->servers);
+  adns__free(ads,ads);
 }
 
 static void logfn_file(adns_state ads, void *logfndata,
@@ -663,7 +938,7 @@ read_w32_init_files (adns_state ads) {
                    pip->IpAddress.String);
       addr.s_addr = inet_addr(pip->IpAddress.String);
       if ((addr.s_addr != INADDR_ANY) && (addr.s_addr != INADDR_NONE))
-        addserver(ads, addr);
+        addserver_inet(ads, addr);
     }
   }
 }
@@ -671,12 +946,14 @@ read_w32_init_files (adns_state ads) {
 
 
 static int init_files(adns_state *ads_r, adns_initflags flags,
-		      adns_logcallbackfn *logfn, void *logfndata) {
+		      adns_logcallbackfn *logfn, void *logfndata,
+		      const adns_allocator *alloc,
+		      const adns_transport *transport) {
   adns_state ads;
   const char *res_options, *adns_res_options;
   int r;
 
-  r= init_begin(&ads, flags, logfn, logfndata);
+  r= init_begin(&ads, flags, logfn, logfndata, alloc, transport);
   if (r) return r;
 
   res_options= instrum_getenv(ads,"RES_OPTIONS");
@@ -718,16 +995,18 @@ static int init_files(adns_state *ads_r, adns_initflags flags,
 }
 
 int adns_init(adns_state *ads_r, adns_initflags flags, FILE *diagfile) {
-  return init_files(ads_r, flags, logfn_file, diagfile ? diagfile : stderr);
+  return init_files(ads_r, flags, logfn_file, diagfile ? diagfile : stderr,
+		    0, 0);
 }
 
 static int init_strcfg(adns_state *ads_r, adns_initflags flags,
 		       adns_logcallbackfn *logfn, void *logfndata,
-		       const char *configtext) {
+		       const char *configtext, const adns_allocator *alloc,
+		       const adns_transport *transport) {
   adns_state ads;
   int r;
 
-  r= init_begin(&ads, flags, logfn, logfndata);
+  r= init_begin(&ads, flags, logfn, logfndata, alloc, transport);
   if (r) return r;
 
   readconfigtext(ads,configtext,"<supplied configuration text>");
@@ -747,42 +1026,77 @@ int adns_init_strcfg(adns_state *ads_r, adns_initflags flags,
 		     FILE *diagfile, const char *configtext) {
   return init_strcfg(ads_r, flags,
 		     diagfile ? logfn_file : 0, diagfile,
-		     configtext);
+		     configtext, 0, 0);
 }
 
 int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
 		    const char *configtext /*0=>use default config files*/,
 		    adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
 		    void *logfndata /*0 with logfn==0 => discard*/) {
+  return adns_init_alloc(newstate_r, flags, configtext, logfn, logfndata, 0);
+}
+
+int adns_init_alloc(adns_state *newstate_r, adns_initflags flags,
+		    const char *configtext /*0=>use default config files*/,
+		    adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
+		    void *logfndata /*0 with logfn==0 => discard*/,
+		    const adns_allocator *alloc /*0=>malloc etc.*/) {
+  return adns_init_transport(newstate_r, flags, configtext, logfn, logfndata,
+			     alloc, 0);
+}
+
+int adns_init_transport(adns_state *newstate_r, adns_initflags flags,
+			const char *configtext /*0=>use default config files*/,
+			adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
+			void *logfndata /*0 with logfn==0 => discard*/,
+			const adns_allocator *alloc /*0=>malloc etc.*/,
+			const adns_transport *transport /*0=>sockets*/) {
   if (!logfn && logfndata)
     logfn= logfn_file;
   if (configtext)
-    return init_strcfg(newstate_r, flags, logfn, logfndata, configtext);
+    return init_strcfg(newstate_r, flags, logfn, logfndata, configtext,
+		       alloc, transport);
   else
-    return init_files(newstate_r, flags, logfn, logfndata);
+    return init_files(newstate_r, flags, logfn, logfndata, alloc, transport);
 }
 
 void adns_finish(adns_state ads) {
+  struct adns__tcpconn *tc;
+  int i;
+
   adns__consistency(ads,0,cc_entex);
   for (;;) {
-    if (ads->udpw.head) adns_cancel(ads->udpw.head);
-    else if (ads->tcpw.head) adns_cancel(ads->tcpw.head);
-    else if (ads->childw.head) adns_cancel(ads->childw.head);
-    else if (ads->output.head) adns_cancel(ads->output.head);
+    if (ads->udpw.head) adns__cancel(ads->udpw.head);
+    else if (ads->cwndw.head) adns__cancel(ads->cwndw.head);
+    else if (ads->tcpw.head) adns__cancel(ads->tcpw.head);
+    else if (ads->childw.head) adns__cancel(ads->childw.head);
+    else if (ads->output.head) adns__cancel(ads->output.head);
     else break;
   }
-  close(ads->udpsocket);
-  if (ads->tcpsocket >= 0) close(ads->tcpsocket);
-  adns__vbuf_free(&ads->tcpsend);
-  adns__vbuf_free(&ads->tcprecv);
+  assert(!ads->memused);
+  adns_capture(ads,0);
+  if (ads->udpsocket >= 0) close(ads->udpsocket);
+  if (ads->udpsocket6 >= 0) close(ads->udpsocket6);
+  for (i=0; i<ads->nservers; i++)
+    if (ads->servers[i].udpsocket >= 0) close(ads->servers[i].udpsocket);
+  for (i=0; i<MAXTCPCONNS; i++) {
+    tc= &ads->tcpconns[i];
+    if (tc->tcpsocket >= 0) close(tc->tcpsocket);
+    adns__vbuf_free(&tc->tcpsend);
+    adns__vbuf_free(&tc->tcprecv);
+  }
   freesearchlist(ads);
-  free(ads);
+  freesockscreds(ads);
+  adns__local_finish(ads);
+  adns__free(ads,ads->servers);
+  adns__free(ads,ads);
 }
 
 void adns_forallqueries_begin(adns_state ads) {
   adns__consistency(ads,0,cc_entex);
   ads->forallnext=
     ads->udpw.head ? ads->udpw.head :
+    ads->cwndw.head ? ads->cwndw.head :
     ads->tcpw.head ? ads->tcpw.head :
     ads->childw.head ? ads->childw.head :
     ads->output.head;
@@ -799,6 +1113,12 @@ adns_query adns_forallqueries_next(adns_state ads, void **context_r) {
     if (qu->next) {
       nqu= qu->next;
     } else if (qu == ads->udpw.tail) {
+      nqu=
+	ads->cwndw.head ? ads->cwndw.head :
+	ads->tcpw.head ? ads->tcpw.head :
+	ads->childw.head ? ads->childw.head :
+	ads->output.head;
+    } else if (qu == ads->cwndw.tail) {
       nqu=
 	ads->tcpw.head ? ads->tcpw.head :
 	ads->childw.head ? ads->childw.head :
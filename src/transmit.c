@@ -120,17 +120,17 @@ adns_status adns__qdpl_normal(adns_state ads,
   return adns_s_ok;
 }
 
-adns_status adns__mkquery(adns_state ads, vbuf *vb, int *id_r,
-			  const char *owner, int ol,
-			  const typeinfo *typei, adns_rrtype type,
-			  adns_queryflags flags) {
+adns_status adns__mkquery_question(adns_state ads, vbuf *vb,
+				   const char *owner, int ol,
+				   const typeinfo *typei, adns_rrtype type,
+				   adns_queryflags flags) {
   int labelnum, ll, nbytes;
   byte label[255];
   byte *rqp;
   const char *p, *pe;
   adns_status st;
 
-  st= mkquery_header(ads,vb,id_r,ol+2); if (st) return st;
+  if (!adns__vbuf_ensure(vb,vb->used+ol+2+4)) return adns_s_nomemory;
 
   MKQUERY_START(vb);
 
@@ -157,6 +157,56 @@ adns_status adns__mkquery(adns_state ads, vbuf *vb, int *id_r,
   return adns_s_ok;
 }
 
+adns_status adns__mkquery(adns_state ads, vbuf *vb, int *id_r,
+			  const char *owner, int ol,
+			  const typeinfo *typei, adns_rrtype type,
+			  adns_queryflags flags) {
+  adns_status st;
+
+  st= mkquery_header(ads,vb,id_r,ol+2); if (st) return st;
+  return adns__mkquery_question(ads,vb, owner,ol, typei,type,flags);
+}
+
+adns_status adns__mkquery_question_wire(adns_state ads, vbuf *vb,
+					const byte *qname, int qnamelen,
+					adns_rrtype type) {
+  int i, ll, nbytes;
+  byte *rqp;
+
+  nbytes= 0;
+  for (i=0;;) {
+    if (i >= qnamelen) return adns_s_querydomaininvalid;
+    ll= qname[i++];
+    if (!ll) break;
+    if (ll > DNS_MAXLABEL) return adns_s_querydomaininvalid;
+    if (ll > qnamelen-i) return adns_s_querydomaininvalid;
+    nbytes+= ll+1;
+    if (nbytes >= DNS_MAXDOMAIN) return adns_s_querydomaintoolong;
+    i+= ll;
+  }
+  if (i != qnamelen) return adns_s_querydomaininvalid;
+
+  if (!adns__vbuf_ensure(vb,vb->used+qnamelen+4)) return adns_s_nomemory;
+
+  MKQUERY_START(vb);
+  memcpy(rqp,qname,qnamelen); rqp+= qnamelen;
+  MKQUERY_STOP(vb);
+
+  return mkquery_footer(vb,type);
+}
+
+adns_status adns__mkquery_prepared(adns_state ads, vbuf *vb, int *id_r,
+				   const byte *qd, int qdlen) {
+  adns_status st;
+
+  st= mkquery_header(ads,vb,id_r,qdlen-4); if (st) return st;
+  memcpy(vb->buf+vb->used,qd,qdlen);
+  vb->used+= qdlen;
+  assert(vb->used <= vb->avail);
+
+  return adns_s_ok;
+}
+
 adns_status adns__mkquery_frdgram(adns_state ads, vbuf *vb, int *id_r,
 				  const byte *qd_dgram, int qd_dglen,
 				  int qd_begin,
@@ -193,37 +243,51 @@ void adns__querysend_tcp(adns_query qu, struct timeval now) {
   struct iovec iov[2];
   int wr, r;
   adns_state ads;
-
-  if (qu->ads->tcpstate != server_ok) return;
+  struct adns__tcpconn *tc;
 
   assert(qu->state == query_tcpw);
 
+  ads= qu->ads;
+  tc= &ads->tcpconns[qu->tcpconn];
+  if (tc->tcpstate != server_ok) return;
+
   length[0]= (qu->query_dglen&0x0ff00U) >>8;
   length[1]= (qu->query_dglen&0x0ff);
 
-  ads= qu->ads;
-  if (!adns__vbuf_ensure(&ads->tcpsend,ads->tcpsend.used+qu->query_dglen+2))
+  if (tc->tcpsend_skip &&
+      tc->tcpsend_skip >= tc->tcpsend.used - tc->tcpsend_skip) {
+    /* Reclaim the written space.  We move no more than has been
+     * written since the buffer was last empty, so this is linear
+     * overall however the writes are split up. */
+    tc->tcpsend.used -= tc->tcpsend_skip;
+    memmove(tc->tcpsend.buf,tc->tcpsend.buf+tc->tcpsend_skip,
+	    tc->tcpsend.used);
+    tc->tcpsend_skip= 0;
+  }
+  if (!adns__vbuf_ensure(&tc->tcpsend,tc->tcpsend.used+qu->query_dglen+2))
     return;
 
   qu->retries++;
+  if (ads->capture)
+    adns__capture_dgram(ads,'S',tc->tcpserver,1,
+			qu->query_dgram,qu->query_dglen,now);
 
   /* Reset idle timeout. */
-  ads->tcptimeout.tv_sec= ads->tcptimeout.tv_usec= 0;
+  tc->tcptimeout.tv_sec= tc->tcptimeout.tv_usec= 0;
 
-  if (ads->tcpsend.used) {
+  if (tc->tcpsend.used) {
     wr= 0;
   } else {
     iov[0].iov_base= length;
     iov[0].iov_len= 2;
     iov[1].iov_base= qu->query_dgram;
     iov[1].iov_len= qu->query_dglen;
-    adns__sigpipe_protect(qu->ads);
-    wr= adns__sock_writev(qu->ads->tcpsocket,iov,2);
-    adns__sigpipe_unprotect(qu->ads);
+    wr= adns__tcp_writev(ads,tc->tcpsocket,iov,2);
     if (wr < 0) {
       if (!(errno == EAGAIN || errno == EINTR || errno == ENOSPC ||
-	    errno == ENOBUFS || errno == ENOMEM)) {
-	adns__tcp_broken(ads,"write",strerror(errno));
+	    errno == ENOBUFS || errno == ENOMEM ||
+	    errno == EINPROGRESS /* TCP Fast Open without a cookie */)) {
+	adns__tcp_broken(ads,tc,"write",strerror(errno));
 	return;
       }
       wr= 0;
@@ -231,52 +295,128 @@ void adns__querysend_tcp(adns_query qu, struct timeval now) {
   }
 
   if (wr<2) {
-    r= adns__vbuf_append(&ads->tcpsend,length,2-wr); assert(r);
+    r= adns__vbuf_append(&tc->tcpsend,length,2-wr); assert(r);
     wr= 0;
   } else {
     wr-= 2;
   }
   if (wr<qu->query_dglen) {
-    r= adns__vbuf_append(&ads->tcpsend,qu->query_dgram+wr,qu->query_dglen-wr);
+    r= adns__vbuf_append(&tc->tcpsend,qu->query_dgram+wr,qu->query_dglen-wr);
     assert(r);
   }
 }
 
-static void query_usetcp(adns_query qu, struct timeval now) {
-  qu->state= query_tcpw;
+void adns__query_settimeout(adns_query qu, struct timeval now, long ms) {
   qu->timeout= now;
-  timevaladd(&qu->timeout,TCPWAITMS);
-  LIST_LINK_TAIL(qu->ads->tcpw,qu);
-  adns__querysend_tcp(qu,now);
-  adns__tcp_tryconnect(qu->ads,now);
+  timevaladd(&qu->timeout,ms);
+  if (timerisset(&qu->deadline) && timercmp(&qu->deadline,&qu->timeout,<))
+    qu->timeout= qu->deadline;
 }
 
-void adns__query_send(adns_query qu, struct timeval now) {
-  struct sockaddr_in servaddr;
+static void query_sendtransport(adns_query qu, struct timeval now) {
+  /* TCP through an adns_transport: there is no connection, so the
+   * message goes straight to the application, and if it cannot take
+   * it the query just waits for its timeout. */
+  adns_state ads= qu->ads;
   int serv, r;
-  adns_state ads;
 
-  assert(qu->state == query_tosend);
-  if ((qu->flags & adns_qf_usevc) || (qu->query_dglen > DNS_MAXUDP)) {
-    query_usetcp(qu,now);
+  serv= ads->tcpconns[qu->tcpconn].tcpserver;
+  qu->retries++;
+  if (ads->capture)
+    adns__capture_dgram(ads,'S',serv,1,qu->query_dgram,qu->query_dglen,now);
+  r= ads->transport.tcpsendfn(ads->transport.context,serv,
+			      qu->query_dgram,qu->query_dglen);
+  if (r) adns__warn(ads,serv,0,"transport TCP send failed: %s",strerror(r));
+}
+
+static void query_usetcp(adns_query qu, struct timeval now) {
+  adns_state ads= qu->ads;
+  int i;
+
+  /* Use the connection with the fewest queries. */
+  qu->tcpconn= 0;
+  for (i=1; i<ads->ntcpconns; i++)
+    if (ads->tcpconns[i].nqueries < ads->tcpconns[qu->tcpconn].nqueries)
+      qu->tcpconn= i;
+
+  qu->state= query_tcpw;
+  ADNS_QPROBE(tcp_enqueue,qu,qu->tcpconn,now);
+  adns__query_settimeout(qu,now,TCPWAITMS);
+  LIST_LINK_TAIL(ads->tcpw,qu);
+  ads->ntcpw++;
+  ads->tcpconns[qu->tcpconn].nqueries++;
+  if (ads->transport.udpsendfn) {
+    query_sendtransport(qu,now);
     return;
   }
+  adns__querysend_tcp(qu,now);
+  adns__tcp_tryconnect(ads,&ads->tcpconns[qu->tcpconn],now);
+}
 
-  if (qu->retries >= UDPMAXRETRIES) {
-    adns__query_fail(qu,adns_s_timeout);
-    return;
+static int query_firstserver(adns_state ads) {
+  /* Chooses the server for a query's first datagram, according to
+   * the adns_serverselect option. */
+  struct server *ss;
+  int i, serv, total;
+
+  switch (ads->serverselect) {
+  case serverselect_first:
+    return 0;
+  case serverselect_weighted:
+    /* Smooth weighted round robin: over any run of total queries
+     * each server gets its weight's worth, evenly interleaved. */
+    serv= 0; total= 0;
+    for (i=0; i<ads->nservers; i++) {
+      ss= &ads->servers[i];
+      ss->wrrcurrent += ss->weight;
+      total += ss->weight;
+      if (ss->wrrcurrent > ads->servers[serv].wrrcurrent) serv= i;
+    }
+    ads->servers[serv].wrrcurrent -= total;
+    return serv;
+  case serverselect_leastload:
+    /* Fewest outstanding datagrams per unit of weight; ties are
+     * broken round robin. */
+    serv= ads->serverselectnext;
+    for (i=1; i<ads->nservers; i++) {
+      ss= &ads->servers[(ads->serverselectnext+i) % ads->nservers];
+      if (ss->nqueries * ads->servers[serv].weight <
+	  ads->servers[serv].nqueries * ss->weight)
+	serv= ss - ads->servers;
+    }
+    ads->serverselectnext= (ads->serverselectnext+1) % ads->nservers;
+    return serv;
+  default:
+    abort();
   }
+}
 
-  serv= qu->udpnextserver;
-  memset(&servaddr,0,sizeof(servaddr));
+static int cwnd_full(adns_state ads) {
+  return ads->udpinflight >= ads->cwnd;
+}
 
-  ads= qu->ads;
-  servaddr.sin_family= AF_INET;
-  servaddr.sin_addr= ads->servers[serv].addr;
-  servaddr.sin_port= htons(DNS_PORT);
+static void query_sendudp(adns_query qu, struct timeval now) {
+  const struct server *ss;
+  int serv, r;
+  adns_state ads;
 
-  r= adns__sock_sendto(ads->udpsocket,qu->query_dgram,qu->query_dglen,0,
-                       (const struct sockaddr*)&servaddr,sizeof(servaddr));
+  ads= qu->ads;
+  if (!qu->udpnsent)
+    qu->udpnextserver= qu->udpfirstserver= query_firstserver(ads);
+  serv= qu->udpnextserver;
+  ss= &ads->servers[serv];
+
+  if (ads->transport.udpsendfn) {
+    r= ads->transport.udpsendfn(ads->transport.context,serv,
+				qu->query_dgram,qu->query_dglen);
+    if (r) { errno= r; r= -1; }
+  } else if (ss->udpsocket >= 0)
+    r= adns__sock_write(ss->udpsocket,qu->query_dgram,qu->query_dglen);
+  else
+    r= adns__sock_sendto(ss->addr.sa.sa_family == AF_INET6
+			 ? ads->udpsocket6 : ads->udpsocket,
+			 qu->query_dgram,qu->query_dglen,0,
+			 &ss->addr.sa,ss->len);
   if (r<0) {
     if (errno == EMSGSIZE) {
       qu->retries= 0;
@@ -288,14 +428,119 @@ void adns__query_send(adns_query qu, struct timeval now) {
     } else if (errno == ENETDOWN) {
       adns__query_fail(qu,adns_s_netdown);
       return;
+    } else if (errno == ECONNREFUSED && ss->udpsocket >= 0) {
+      /* Left over from an earlier datagram, and this one was not
+       * sent.  Both will be retried after the normal timeout. */
+      adns__debug(ads,serv,0,"server unreachable: %s",strerror(errno));
     } else if (errno != EAGAIN)
       adns__warn(ads,serv,0,"sendto failed: %s",strerror(errno));
   }
 
-  qu->timeout= now;
-  timevaladd(&qu->timeout,UDPRETRYMS);
-  qu->udpsent |= (1<<serv);
+  adns__query_settimeout(qu,now,UDPRETRYMS);
+  ads->stats.udpsends++;
+  if (qu->udpnsent) ads->stats.udpretries++;
+  ads->servers[serv].stats.udpsends++;
+  qu->udpsent= now;
+  ADNS_QPROBE(udp_send,qu,serv,now);
+  if (ads->capture)
+    adns__capture_dgram(ads,'S',serv,0,qu->query_dgram,qu->query_dglen,now);
+  qu->udpnsent++;
   qu->udpnextserver= (serv+1)%ads->nservers;
+  qu->udpserver= serv;
   qu->retries++;
   LIST_LINK_TAIL(ads->udpw,qu);
+  ads->servers[serv].nqueries++;
+  ads->udpinflight++;
+}
+
+void adns__query_send(adns_query qu, struct timeval now) {
+  adns_state ads;
+
+  assert(qu->state == query_tosend);
+  if ((qu->flags & adns_qf_usevc) || (qu->query_dglen > DNS_MAXUDP)) {
+    query_usetcp(qu,now);
+    return;
+  }
+
+  if (qu->retries >= UDPMAXRETRIES) {
+    adns__query_fail(qu,adns_s_timeout);
+    return;
+  }
+
+  ads= qu->ads;
+  if (!qu->udpnsent && ads->cwndmax &&
+      (ads->cwndw.head || cwnd_full(ads))) {
+    qu->state= query_cwndw;
+    LIST_LINK_TAIL(ads->cwndw,qu);
+    LIST_LINK_TAIL_PART(ads->cwndwq[qu->prio],qu,cwndwclass.);
+    ads->cwndwprio[qu->prio]++;
+    return;
+  }
+  query_sendudp(qu,now);
+}
+
+void adns__cwnd_ack(adns_query qu) {
+  adns_state ads= qu->ads;
+
+  if (!ads->cwndmax) return;
+  if (qu->udpnsent != 1) return; /* not timely */
+  if (ads->cwnd >= ads->cwndmax) return;
+  if (ads->cwnd < ads->cwndssthresh) {
+    ads->cwnd++;
+  } else if (++ads->cwndacks >= ads->cwnd) {
+    ads->cwnd++;
+    ads->cwndacks= 0;
+  }
+}
+
+void adns__cwnd_loss(adns_state ads, struct timeval now) {
+  if (!ads->cwndmax) return;
+  if (timercmp(&now,&ads->cwndholdoff,<)) return;
+  ads->cwndssthresh= ads->cwnd/2;
+  if (ads->cwndssthresh < CWNDMIN) ads->cwndssthresh= CWNDMIN;
+  ads->cwnd= ads->cwndssthresh;
+  ads->cwndacks= 0;
+  /* One loss may show up as timeouts for a whole window's worth. */
+  ads->cwndholdoff= now;
+  timevaladd(&ads->cwndholdoff,UDPRETRYMS);
+  adns__debug(ads,-1,0,"congestion window now %d",ads->cwnd);
+}
+
+void adns__cwndw_unlink(adns_state ads, adns_query qu) {
+  LIST_UNLINK(ads->cwndw,qu);
+  LIST_UNLINK_PART(ads->cwndwq[qu->prio],qu,cwndwclass.);
+  ads->cwndwprio[qu->prio]--;
+}
+
+static adns_query cwnd_next(adns_state ads) {
+  /* cwndw is in order of arrival; we want the first of the best class
+   * waiting, unless we have passed over the head too often already. */
+  adns_query qu;
+  query_prio best;
+
+  if (ads->cwndskips >= PRIOSKIPMAX) {
+    ads->cwndskips= 0;
+    return ads->cwndw.head;
+  }
+  for (best= prio_interactive; !ads->cwndwq[best].head; best++);
+  qu= ads->cwndwq[best].head;
+  if (qu == ads->cwndw.head) ads->cwndskips= 0;
+  else ads->cwndskips++;
+  return qu;
+}
+
+int adns__cwnd_release(adns_state ads, int act, struct timeval now) {
+  adns_query qu;
+  int any;
+
+  any= 0;
+  while (ads->cwndw.head && !cwnd_full(ads)) {
+    if (!act) return 1;
+    any= 1;
+    qu= cwnd_next(ads);
+    adns__cwndw_unlink(ads,qu);
+    qu->state= query_tosend;
+    query_sendudp(qu,now);
+  }
+  return any;
 }
@@ -50,12 +50,12 @@
  * _manyistr                  (mf,cs)
  * _txt                       (pa)
  * _inaddr                    (pa,dip,di,cs +search_sortlist)
- * _addr                      (pa,di,div,csp,cs)
+ * _addr                      (pa,dip,di,div,csp,cs +addr_sortpos)
  * _domain                    (pap,csp,cs)
  * _dom_raw		      (pa)
  * _host_raw                  (pa)
  * _hostaddr                  (pap,pa,dip,di,mfp,mf,csp,cs
- *				+pap_findaddrs, icb_hostaddr)
+ *				+pap_findaddrs, icb_hostaddr, dualaddr_*)
  * _mx_raw                    (pa,di)
  * _mx                        (pa,di)
  * _inthostaddr               (mf,cs)
@@ -368,7 +368,7 @@ static adns_status cs_in6addr(vbuf *vb, const void *datap) {
 
 
 /*
- * _addr   (pa,di,div,csp,cs)
+ * _addr   (pa,dip,di,div,csp,cs +addr_sortpos)
  */
 
 static adns_status pa_addr(const parseinfo *pai, int cbyte,
@@ -378,17 +378,43 @@ static adns_status pa_addr(const parseinfo *pai, int cbyte,
 
   if (max-cbyte != 4) return adns_s_invaliddata;
   storeto->len= sizeof(storeto->addr.inet);
-  memset(&storeto->addr,0,sizeof(storeto->addr.inet));
+  memset(&storeto->addr,0,sizeof(storeto->addr));
   storeto->addr.inet.sin_family= AF_INET;
   memcpy(&storeto->addr.inet.sin_addr,dgram+cbyte,4);
   return adns_s_ok;
 }
 
+static adns_status pa_addr6(const parseinfo *pai, int cbyte,
+			    int max, void *datap) {
+  adns_rr_addr *storeto= datap;
+  const byte *dgram= pai->dgram;
+
+  if (max-cbyte != 16) return adns_s_invaliddata;
+  storeto->len= sizeof(storeto->addr.inet6);
+  memset(&storeto->addr,0,sizeof(storeto->addr));
+  storeto->addr.inet6.sin6_family= AF_INET6;
+  memcpy(&storeto->addr.inet6.sin6_addr,dgram+cbyte,16);
+  return adns_s_ok;
+}
+
+static int addr_sortpos(adns_state ads, const adns_rr_addr *rrp) {
+  switch (rrp->addr.sa.sa_family) {
+  case AF_INET:  return search_sortlist(ads,rrp->addr.inet.sin_addr);
+  case AF_INET6: return search_sortlist6(ads,&rrp->addr.inet6.sin6_addr);
+  default:       return ads->nsortlist;
+  }
+}
+
+static int dip_addr(adns_state ads,
+		    const adns_rr_addr *ap, const adns_rr_addr *bp) {
+  if (!ads->nsortlist) return 0;
+  return addr_sortpos(ads,bp) < addr_sortpos(ads,ap);
+}
+
 static int di_addr(adns_state ads, const void *datap_a, const void *datap_b) {
   const adns_rr_addr *ap= datap_a, *bp= datap_b;
 
-  assert(ap->addr.sa.sa_family == AF_INET);
-  return dip_inaddr(ads, ap->addr.inet.sin_addr, bp->addr.inet.sin_addr);
+  return dip_addr(ads,ap,bp);
 }
 
 static int div_addr(void *context, const void *datap_a, const void *datap_b) {
@@ -399,7 +425,7 @@ static int div_addr(void *context, const void *datap_a, const void *datap_b) {
 
 static adns_status csp_addr(vbuf *vb, const adns_rr_addr *rrp) {
   const char *ia;
-  char buf[30];
+  char buf[INET6_ADDRSTRLEN];
 
   switch (rrp->addr.inet.sin_family) {
   case AF_INET:
@@ -407,6 +433,16 @@ static adns_status csp_addr(vbuf *vb, const adns_rr_addr *rrp) {
     ia= inet_ntoa(rrp->addr.inet.sin_addr); assert(ia);
     CSP_ADDSTR(ia);
     break;
+  case AF_INET6:
+    CSP_ADDSTR("INET6 ");
+#ifdef HAVE_W32_SYSTEM
+    ia= adns__inet_ntop(AF_INET6,&rrp->addr.inet6.sin6_addr,buf,sizeof(buf));
+#else
+    ia= inet_ntop(AF_INET6,&rrp->addr.inet6.sin6_addr,buf,sizeof(buf));
+#endif
+    assert(ia);
+    CSP_ADDSTR(ia);
+    break;
   default:
     sprintf(buf,"AF=%u",rrp->addr.sa.sa_family);
     CSP_ADDSTR(buf);
@@ -491,20 +527,27 @@ static adns_status pa_host_raw(const parseinfo *pai, int cbyte,
  */
 
 static adns_status pap_findaddrs(const parseinfo *pai, adns_rr_hostaddr *ha,
-				 int *cbyte_io, int count, int dmstart) {
-  int rri, naddrs;
+				 int *cbyte_io, int count, int dmstart,
+				 int *fams_r) {
+  /* *fams_r gets bit 0 set if any A records were found, and bit 1
+   * for AAAA records. */
+  int rri, naddrs, dual;
   int type, class, rdlen, rdstart, ownermatched;
   unsigned long ttl;
   adns_status st;
 
+  /* For dual-stack, the A and AAAA RRsets need not be adjacent. */
+  dual= pai->qu->flags & adns_qf_dualstack;
+  *fams_r= 0;
   for (rri=0, naddrs=-1; rri<count; rri++) {
     st= adns__findrr_anychk(pai->qu, pai->serv, pai->dgram,
 			    pai->dglen, cbyte_io,
 			    &type, &class, &ttl, &rdlen, &rdstart,
 			    pai->dgram, pai->dglen, dmstart, &ownermatched);
     if (st) return st;
-    if (!ownermatched || class != DNS_CLASS_IN || type != adns_r_a) {
-      if (naddrs>0) break; else continue;
+    if (!ownermatched || class != DNS_CLASS_IN ||
+	!(type == adns_r_a || (dual && type == adns_r_aaaa))) {
+      if (naddrs>0 && !dual) break; else continue;
     }
     if (naddrs == -1) {
       naddrs= 0;
@@ -512,8 +555,10 @@ static adns_status pap_findaddrs(const parseinfo *pai, adns_rr_hostaddr *ha,
     if (!adns__vbuf_ensure(&pai->qu->vb, (naddrs+1)*sizeof(adns_rr_addr)))
       R_NOMEM;
     adns__update_expires(pai->qu,ttl,pai->now);
-    st= pa_addr(pai, rdstart,rdstart+rdlen,
-		pai->qu->vb.buf + naddrs*sizeof(adns_rr_addr));
+    *fams_r |= type == adns_r_a ? 1 : 2;
+    st= (type == adns_r_a ? pa_addr : pa_addr6)
+      (pai, rdstart,rdstart+rdlen,
+       pai->qu->vb.buf + naddrs*sizeof(adns_rr_addr));
     if (st) return st;
     naddrs++;
   }
@@ -545,15 +590,213 @@ static void icb_hostaddr(adns_query parent, adns_query child) {
 
   if (parent->children.head) {
     LIST_LINK_TAIL(ads->childw,parent);
+    ads->nchildw++;
+  } else {
+    adns__query_done(parent);
+  }
+}
+
+static adns_status dualaddr_merge(adns_query parent, dualaddr *da,
+				  adns_rr_addr **addrs_r, int *naddrs_r) {
+  /* Returns the status to report and, if that is ok, the addresses
+   * of both families in one sorted table allocated (interim) in
+   * parent.  If neither lookup found any, a temporary failure of
+   * either is preferred, since retrying might then help. */
+  adns_rr_addr *addrs;
+  adns_status st;
+  int fam, n;
+
+  *addrs_r= 0;
+  *naddrs_r= 0;
+  for (fam=0, n=0; fam<2; fam++)
+    if (!da->status[fam]) n += da->naddrs[fam];
+
+  if (!n) {
+    for (fam=0; fam<2; fam++) {
+      st= da->status[fam];
+      if (st > adns_s_ok && st <= adns_s_max_tempfail) return st;
+    }
+    return da->status[0] ? da->status[0] : da->status[1];
+  }
+
+  addrs= adns__alloc_interim(parent, n*sizeof(*addrs));
+  if (!addrs) return adns_s_nomemory;
+  for (fam=0, n=0; fam<2; fam++) {
+    if (da->status[fam]) continue;
+    memcpy(addrs+n, da->addrs[fam], da->naddrs[fam]*sizeof(*addrs));
+    n += da->naddrs[fam];
+  }
+  if (!adns__vbuf_ensure(&parent->vb, sizeof(*addrs)))
+    return adns_s_nomemory;
+  adns__isort(addrs, n, sizeof(*addrs), parent->vb.buf,
+	      div_addr, parent->ads);
+
+  *addrs_r= addrs;
+  *naddrs_r= n;
+  return adns_s_ok;
+}
+
+static void dualaddr_answer(adns_query qu, dualaddr *da) {
+  /* The addresses are the answer to qu itself. */
+  adns_answer *ans= qu->answer;
+  const struct timeval *now;
+  struct timeval tv_buf;
+  adns_rr_addr *addrs;
+  adns_status st;
+  int naddrs, l;
+
+  st= dualaddr_merge(qu,da,&addrs,&naddrs);
+
+  if (st == adns_s_nxdomain && !da->cname && (qu->flags & adns_qf_search)) {
+    now= 0;
+    adns__must_gettimeofday(qu->ads,&now,&tv_buf);
+    if (!now) { adns__query_fail(qu,adns_s_systemfail); return; }
+    adns__search_next(qu->ads,qu,*now);
+    return;
+  }
+
+  if (da->cname) {
+    l= strlen(da->cname)+1;
+    ans->cname= adns__alloc_preserved(qu,l);
+    if (!ans->cname) { adns__query_fail(qu,adns_s_nomemory); return; }
+    memcpy(ans->cname,da->cname,l);
+  }
+  if (st) { adns__query_fail(qu,st); return; }
+
+  ans->nrrs= naddrs;
+  ans->rrs.addr= addrs;
+  adns__query_done(qu);
+}
+
+static void icb_dualaddr(adns_query parent, adns_query child) {
+  adns_answer *cans= child->answer;
+  dualaddr *da= child->ctx.info.dual.da;
+  int fam= child->ctx.info.dual.fam;
+  adns_state ads= parent->ads;
+  adns_rr_hostaddr *rrp;
+  adns_query other;
+
+  da->child[fam]= 0;
+  da->status[fam]= cans->status;
+  da->naddrs[fam]= cans->nrrs;
+  da->addrs[fam]= cans->rrs.addr;
+  if (!da->cname) da->cname= cans->cname;
+  if (parent->expires > child->expires) parent->expires= child->expires;
+  adns__adopt_allocs(child,parent);
+
+  other= da->child[!fam];
+  if (other) {
+    if (!cans->nrrs || !(parent->flags & adns_qf_dualstack_first)) {
+      LIST_LINK_TAIL(ads->childw,parent);
+      ads->nchildw++;
+      return;
+    }
+    adns__cancel(other);
+    da->child[!fam]= 0;
+    da->status[!fam]= adns_s_ok;
+    da->naddrs[!fam]= 0;
+  }
+
+  if (!da->ha) {
+    dualaddr_answer(parent,da);
+    return;
+  }
+
+  rrp= da->ha;
+  rrp->astatus= dualaddr_merge(parent,da,&rrp->addrs,&rrp->naddrs);
+  if (rrp->astatus > adns_s_ok && rrp->astatus <= adns_s_max_tempfail)
+    rrp->naddrs= -1;
+
+  if (parent->children.head) {
+    LIST_LINK_TAIL(ads->childw,parent);
+    ads->nchildw++;
   } else {
     adns__query_done(parent);
   }
 }
 
+static adns_status dualaddr_submit(adns_query parent, adns_rr_hostaddr *ha,
+				   int fams, const char *owner, int ol,
+				   const byte *dgram, int dglen, int dmstart,
+				   adns_queryflags flags, struct timeval now) {
+  /* Submits A and AAAA lookups, as children of parent, for owner or
+   * (if owner is 0) the domain at dmstart in dgram.  Their addresses
+   * go into *ha, or if ha is 0 into parent's answer.  Does not put
+   * parent on childw.  Only the families in fams (bit 0 for A, bit 1
+   * for AAAA) are looked up; the addresses already in *ha, which must
+   * then be given, are used for the other.
+   */
+  static const adns_rrtype types[2]= { adns_r_addr, adns_r_addr6 };
+  adns_state ads= parent->ads;
+  const typeinfo *typei;
+  dualaddr *da;
+  qcontext ctx;
+  adns_query nqu;
+  adns_status st;
+  int fam, id;
+
+  da= adns__alloc_mine(parent, sizeof(*da));
+  if (!da) R_NOMEM;
+  memset(da,0,sizeof(*da));
+  da->ha= ha;
+
+  for (fam=0; fam<2; fam++) {
+    if (!(fams & (1<<fam))) {
+      assert(ha);
+      da->status[fam]= adns_s_ok;
+      da->naddrs[fam]= ha->naddrs;
+      da->addrs[fam]= ha->addrs;
+      continue;
+    }
+    typei= adns__findtype(types[fam]);
+    if (owner)
+      st= adns__mkquery(ads, &parent->vb, &id, owner, ol,
+			typei, types[fam], flags);
+    else
+      st= adns__mkquery_frdgram(ads, &parent->vb, &id,
+				dgram, dglen, dmstart, types[fam], flags);
+    if (st) return st;
+
+    ctx.ext= 0;
+    ctx.callback= icb_dualaddr;
+    ctx.info.dual.da= da;
+    ctx.info.dual.fam= fam;
+
+    st= adns__internal_submit(ads, &nqu, parent, typei, &parent->vb, id,
+			      flags, now, &ctx);
+    if (st) return st;
+
+    nqu->parent= parent;
+    LIST_LINK_TAIL_PART(parent->children,nqu,siblings.);
+    da->child[fam]= nqu;
+  }
+  return adns_s_ok;
+}
+
+void adns__dualaddr_query(adns_state ads, adns_query qu,
+			  const char *owner, int ol, struct timeval now) {
+  adns_queryflags flags;
+  adns_status st;
+
+  flags= qu->flags & ~(adns_qf_search | adns_qf_search_parallel |
+		       adns_qf_owner |
+		       adns_qf_dualstack | adns_qf_dualstack_first);
+  st= dualaddr_submit(qu, 0, 3, owner, ol, 0, 0, 0, flags, now);
+  if (st == adns_s_querydomaintoolong && (qu->flags & adns_qf_search)) {
+    adns__search_next(ads,qu,now);
+    return;
+  }
+  if (st) { adns__query_fail(qu,st); return; }
+
+  qu->state= query_childw;
+  LIST_LINK_TAIL(ads->childw,qu);
+  ads->nchildw++;
+}
+
 static adns_status pap_hostaddr(const parseinfo *pai, int *cbyte_io,
 				int max, adns_rr_hostaddr *rrp) {
   adns_status st;
-  int dmstart, cbyte;
+  int dmstart, cbyte, dual, fams;
   qcontext ctx;
   int id;
   adns_query nqu;
@@ -571,13 +814,23 @@ static adns_status pap_hostaddr(const parseinfo *pai, int *cbyte_io,
 
   cbyte= pai->nsstart;
 
-  st= pap_findaddrs(pai, rrp, &cbyte, pai->nscount, dmstart);
-  if (st) return st;
-  if (rrp->naddrs != -1) return adns_s_ok;
+  dual= pai->qu->flags & adns_qf_dualstack;
 
-  st= pap_findaddrs(pai, rrp, &cbyte, pai->arcount, dmstart);
+  st= pap_findaddrs(pai, rrp, &cbyte, pai->nscount, dmstart, &fams);
   if (st) return st;
-  if (rrp->naddrs != -1) return adns_s_ok;
+  if (rrp->naddrs == -1) {
+    st= pap_findaddrs(pai, rrp, &cbyte, pai->arcount, dmstart, &fams);
+    if (st) return st;
+  }
+  /* Glue for only one family does not tell us about the other. */
+  if (rrp->naddrs != -1 && (!dual || fams == 3)) return adns_s_ok;
+
+  nflags= adns_qf_quoteok_query;
+  if (!(pai->qu->flags & adns_qf_cname_loose)) nflags |= adns_qf_cname_forbid;
+
+  if (dual)
+    return dualaddr_submit(pai->qu, rrp, 3 & ~fams, 0, 0,
+			   pai->dgram, pai->dglen, dmstart, nflags, pai->now);
 
   st= adns__mkquery_frdgram(pai->ads, &pai->qu->vb, &id,
 			    pai->dgram, pai->dglen, dmstart,
@@ -588,10 +841,8 @@ static adns_status pap_hostaddr(const parseinfo *pai, int *cbyte_io,
   ctx.callback= icb_hostaddr;
   ctx.info.hostaddr= rrp;
 
-  nflags= adns_qf_quoteok_query;
-  if (!(pai->qu->flags & adns_qf_cname_loose)) nflags |= adns_qf_cname_forbid;
-
-  st= adns__internal_submit(pai->ads, &nqu, adns__findtype(adns_r_addr),
+  st= adns__internal_submit(pai->ads, &nqu, pai->qu,
+			    adns__findtype(adns_r_addr),
 			    &pai->qu->vb, id, nflags, pai->now, &ctx);
   if (st) return st;
 
@@ -618,11 +869,7 @@ static int dip_hostaddr(adns_state ads,
   if (ap->astatus != bp->astatus) return ap->astatus;
   if (ap->astatus) return 0;
 
-  assert(ap->addrs[0].addr.sa.sa_family == AF_INET);
-  assert(bp->addrs[0].addr.sa.sa_family == AF_INET);
-  return dip_inaddr(ads,
-		    ap->addrs[0].addr.inet.sin_addr,
-		    bp->addrs[0].addr.inet.sin_addr);
+  return dip_addr(ads, &ap->addrs[0], &bp->addrs[0]);
 }
 
 static int di_hostaddr(adns_state ads,
@@ -805,6 +1052,7 @@ static void icb_ptr(adns_query parent, adns_query child) {
 	return;
       } else {
 	LIST_LINK_TAIL(ads->childw,parent);
+	ads->nchildw++;
 	return;
       }
     }
@@ -874,7 +1122,8 @@ static adns_status pa_ptr(const parseinfo *pai, int dmstart,
   ctx.ext= 0;
   ctx.callback= icb_ptr;
   memset(&ctx.info,0,sizeof(ctx.info));
-  st= adns__internal_submit(pai->ads, &nqu, adns__findtype(adns_r_addr),
+  st= adns__internal_submit(pai->ads, &nqu, pai->qu,
+			    adns__findtype(adns_r_addr),
 			    &pai->qu->vb, id,
 			    adns_qf_quoteok_query, pai->now, &ctx);
   if (st) return st;
@@ -1355,6 +1604,7 @@ FLAT_TYPE(addr,   "A",  "addr", addr,    pa_addr,    di_addr,  cs_addr       ),
 DEEP_TYPE(ns,     "NS", "+addr",hostaddr,pa_hostaddr,di_hostaddr,cs_hostaddr ),
 DEEP_TYPE(ptr,    "PTR","checked",str,   pa_ptr,     0,        cs_domain     ),
 DEEP_TYPE(mx,     "MX", "+addr",inthostaddr,pa_mx,   di_mx,    cs_inthostaddr),
+FLAT_TYPE(addr6,  "AAAA","addr", addr,    pa_addr6,   di_addr,  cs_addr       ),
 XTRA_TYPE(srv,    "SRV","+addr",srvha,   pa_srvha,   di_srv,   cs_srvha,
           	                                       qdpl_srv, postsort_srv),
 
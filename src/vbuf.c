@@ -34,14 +34,23 @@
 /* vbuf functions */
 
 void adns__vbuf_init(vbuf *vb) {
-  vb->used= vb->avail= 0; vb->buf= 0;
+  vb->used= vb->avail= 0; vb->buf= 0; vb->ads= 0;
+}
+
+void adns__vbuf_initads(vbuf *vb, adns_state ads) {
+  vb->used= vb->avail= 0; vb->buf= 0; vb->ads= ads;
+}
+
+static void *vbuf_realloc(vbuf *vb, int newlen) {
+  return vb->ads ? adns__realloc(vb->ads,vb->buf,newlen)
+		 : realloc(vb->buf,newlen);
 }
 
 int adns__vbuf_ensure(vbuf *vb, int want) {
   void *nb;
   
   if (vb->avail >= want) return 1;
-  nb= realloc(vb->buf,want); if (!nb) return 0;
+  nb= vbuf_realloc(vb,want); if (!nb) return 0;
   vb->buf= nb;
   vb->avail= want;
   return 1;
@@ -60,8 +69,8 @@ int adns__vbuf_append(vbuf *vb, const byte *data, int len) {
   if (vb->avail < newlen) {
     if (newlen<20) newlen= 20;
     newlen <<= 1;
-    nb= realloc(vb->buf,newlen);
-    if (!nb) { newlen= vb->used+len; nb= realloc(vb->buf,newlen); }
+    nb= vbuf_realloc(vb,newlen);
+    if (!nb) { newlen= vb->used+len; nb= vbuf_realloc(vb,newlen); }
     if (!nb) return 0;
     vb->buf= nb;
     vb->avail= newlen;
@@ -77,7 +86,8 @@ int adns__vbuf_appendstr(vbuf *vb, const char *data) {
 }
 
 void adns__vbuf_free(vbuf *vb) {
-  free(vb->buf);
-  adns__vbuf_init(vb);
+  if (vb->ads) adns__free(vb->ads,vb->buf);
+  else free(vb->buf);
+  vb->used= vb->avail= 0; vb->buf= 0;
 }
 
@@ -199,6 +199,19 @@ adns__sock_writev (int fd, const struct iovec *iov, int iovcount)
 }
 
 
+int
+adns__sock_setsockopt (int fd, int level, int optname,
+                       const void *optval, int optlen)
+{
+  int res;
+
+  res = setsockopt (fd, level, optname, (const char *)optval, optlen);
+  if (res < 0)
+    errno = adns__sock_wsa2errno (WSAGetLastError ());
+  return res;
+}
+
+
 int
 adns__sock_close (int fd)
 {